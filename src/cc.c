@@ -890,8 +890,8 @@ static void adc_handle(struct cc *cc, char *msg) {
   }
 
   if(cmd.type != 'C') {
-    g_message("CC:%s: Not a client command: %s. --> %s", net_remoteaddr(cc->net), err->message, msg);
-    g_strfreev(cmd.argv);
+    g_message("CC:%s: Not a client command: %s", net_remoteaddr(cc->net), msg);
+    adc_cmd_free(&cmd);
     return;
   }
 
@@ -923,8 +923,8 @@ static void adc_handle(struct cc *cc, char *msg) {
       cc_disconnect(cc);
     } else {
       cc->state = CCS_IDLE;;
-      char *id = adc_getparam(cmd.argv, "ID", NULL);
-      char *token = adc_getparam(cmd.argv, "TO", NULL);
+      char *id = adc_param(&cmd, 0, "ID");
+      char *token = adc_param(&cmd, 0, "TO");
       char cid[24];
       if(istth(id))
         base32_decode(id, cid);
@@ -1080,7 +1080,7 @@ static void adc_handle(struct cc *cc, char *msg) {
       g_set_error(&cc->err, 1, 0, "(%s) %s", cmd.argv[0], cmd.argv[1]);
       if(cmd.argv[0][0] == '2')
         cc_disconnect(cc);
-    } else if(!adc_getparam(cmd.argv, "RF", NULL))
+    } else if(!adc_param(&cmd, 0, "RF"))
       g_message("CC:%s: Status: (%s) %s", net_remoteaddr(cc->net), cmd.argv[0], cmd.argv[1]);
     break;
 
@@ -1088,7 +1088,7 @@ static void adc_handle(struct cc *cc, char *msg) {
     g_message("CC:%s: Unknown command: %s", net_remoteaddr(cc->net), msg);
   }
 
-  g_strfreev(cmd.argv);
+  adc_cmd_free(&cmd);
 }
 
 
@@ -1171,109 +1171,85 @@ static void nmdc_direction(struct cc *cc, gboolean down, int num) {
 
 
 static void nmdc_handle(struct cc *cc, char *cmd) {
-  GMatchInfo *nfo;
-
-  // create regexes (declared statically, allocated/compiled on first call)
-#define CMDREGEX(name, regex) \
-  static GRegex * name = NULL;\
-  if(!name) name = g_regex_new("\\$" regex, G_REGEX_OPTIMIZE|G_REGEX_ANCHORED|G_REGEX_DOTALL|G_REGEX_RAW, 0, NULL)
-
-  CMDREGEX(mynick, "MyNick ([^ $]+)");
-  CMDREGEX(lock, "Lock ([^ $]+) Pk=[^ $]+");
-  CMDREGEX(supports, "Supports (.+)");
-  CMDREGEX(direction, "Direction (Download|Upload) ([0-9]+)");
-  CMDREGEX(adcget, "ADCGET ([^ ]+) (.+) ([0-9]+) (-?[0-9]+)");
-  CMDREGEX(adcsnd, "ADCSND (file|tthl) .+ ([0-9]+) (-?[0-9]+)");
-  CMDREGEX(error, "Error (.+)");
-  CMDREGEX(maxedout, "MaxedOut");
-
-  // $MyNick
-  if(g_regex_match(mynick, cmd, 0, &nfo)) { // 1 = nick
-    if(cc->state != CCS_HANDSHAKE) {
-      g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
-      g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), cmd);
-      cc_disconnect(cc);
-    } else {
-      char *nick = g_match_info_fetch(nfo, 1);
-      nmdc_mynick(cc, nick);
-      g_free(nick);
-    }
+  char *args, *a, *b, *c, *d;
+  int n = nmdc_cmd(cmd, &args);
+
+  // Check whether the command is allowed in the current state
+  gboolean valid = TRUE;
+  switch(n) {
+  case NMDCC_MYNICK:
+  case NMDCC_LOCK:
+  case NMDCC_SUPPORTS:
+  case NMDCC_DIRECTION:
+    valid = cc->state == CCS_HANDSHAKE;
+    break;
+  case NMDCC_ADCGET:
+    valid = !cc->dl && cc->state == CCS_IDLE;
+    break;
+  case NMDCC_ADCSND:
+  case NMDCC_ERROR:
+  case NMDCC_MAXEDOUT:
+    valid = cc->dl && cc->state == CCS_TRANSFER;
+    break;
+  }
+  if(!valid) {
+    g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
+    g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), cmd);
+    cc_disconnect(cc);
+    return;
   }
-  g_match_info_free(nfo);
 
-  // $Lock
-  if(g_regex_match(lock, cmd, 0, &nfo)) { // 1 = lock
-    char *lock = g_match_info_fetch(nfo, 1);
-    if(cc->state != CCS_HANDSHAKE) {
-      g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
-      g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), cmd);
-      cc_disconnect(cc);
+  switch(n) {
+
+  case NMDCC_MYNICK: // $MyNick nick
+    if((a = nmdc_arg(&args)))
+      nmdc_mynick(cc, a);
+    break;
+
+  case NMDCC_LOCK: // $Lock lock Pk=pk
+    if(!(a = nmdc_arg(&args)) || strncmp(args, "Pk=", 3) != 0)
+      break;
     // we don't implement the classic NMDC get, so we can't talk with non-EXTENDEDPROTOCOL clients
-    } else if(strncmp(lock, "EXTENDEDPROTOCOL", 16) != 0) {
+    if(strncmp(a, "EXTENDEDPROTOCOL", 16) != 0) {
       g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
       g_warning("CC:%s: Does not advertise EXTENDEDPROTOCOL.", net_remoteaddr(cc->net));
       cc_disconnect(cc);
     } else {
       net_send(cc->net, "$Supports MiniSlots XmlBZList ADCGet TTHL TTHF");
-      char *key = nmdc_lock2key(lock);
+      char *key = nmdc_lock2key(a);
       cc->dir = cc->dl ? g_random_int_range(0, 65535) : -1;
       net_sendf(cc->net, "$Direction %s %d", cc->dl ? "Download" : "Upload", cc->dl ? cc->dir : 0);
       net_sendf(cc->net, "$Key %s", key);
       g_free(key);
-      g_free(lock);
     }
-  }
-  g_match_info_free(nfo);
+    break;
 
-  // $Supports
-  if(g_regex_match(supports, cmd, 0, &nfo)) { // 1 = list
-    char *list = g_match_info_fetch(nfo, 1);
-    if(cc->state != CCS_HANDSHAKE) {
-      g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
-      g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), cmd);
-      cc_disconnect(cc);
+  case NMDCC_SUPPORTS: // $Supports list
     // Client must support ADCGet to download from us, since we haven't implemented the old NMDC $Get.
-    } else if(!strstr(list, "ADCGet")) {
+    if(*args && !strstr(args, "ADCGet")) {
       g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
       g_warning("CC:%s: Does not support ADCGet.", net_remoteaddr(cc->net));
       cc_disconnect(cc);
     }
-    g_free(list);
-  }
-  g_match_info_free(nfo);
+    break;
 
-  // $Direction
-  if(g_regex_match(direction, cmd, 0, &nfo)) { // 1 = dir, 2 = num
-    if(cc->state != CCS_HANDSHAKE) {
-      g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
-      g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), cmd);
-      cc_disconnect(cc);
-    } else {
-      char *dir = g_match_info_fetch(nfo, 1);
-      char *num = g_match_info_fetch(nfo, 2);
-      nmdc_direction(cc, strcmp(dir, "Download") == 0, strtol(num, NULL, 10));
-      g_free(dir);
-      g_free(num);
-    }
-  }
-  g_match_info_free(nfo);
-
-  // $ADCGET
-  if(g_regex_match(adcget, cmd, 0, &nfo)) { // 1 = type, 2 = identifier, 3 = start_pos, 4 = bytes
-    char *type = g_match_info_fetch(nfo, 1);
-    char *id = g_match_info_fetch(nfo, 2);
-    char *start = g_match_info_fetch(nfo, 3);
-    char *bytes = g_match_info_fetch(nfo, 4);
-    guint64 st = g_ascii_strtoull(start, NULL, 10);
-    gint64 by = g_ascii_strtoll(bytes, NULL, 10);
-    char *un_id = adc_unescape(id, TRUE);
-    if(cc->dl || cc->state != CCS_IDLE) {
-      g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
-      g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), cmd);
-      cc_disconnect(cc);
-    } else if(un_id && g_utf8_validate(un_id, -1, NULL)) {
+  case NMDCC_DIRECTION: // $Direction Download|Upload num
+    if(!(a = nmdc_arg(&args)) || (strcmp(a, "Download") != 0 && strcmp(a, "Upload") != 0))
+      break;
+    if(!g_ascii_isdigit(args[0]))
+      break;
+    nmdc_direction(cc, strcmp(a, "Download") == 0, strtol(args, NULL, 10));
+    break;
+
+  case NMDCC_ADCGET: // $ADCGET type identifier start_pos bytes [flags]
+    if(!(a = nmdc_escarg(&args)) || !(b = nmdc_escarg(&args)) || !(c = nmdc_arg(&args)) || !(d = nmdc_arg(&args)))
+      break;
+    if(!nmdc_isnum(c, FALSE) || !nmdc_isnum(d, TRUE))
+      break;
+    char *un_id = adc_unescape(b, TRUE);
+    if(un_id && g_utf8_validate(un_id, -1, NULL)) {
       GError *err = NULL;
-      handle_adcget(cc, type, un_id, st, by, &err);
+      handle_adcget(cc, a, un_id, g_ascii_strtoull(c, NULL, 10), g_ascii_strtoll(d, NULL, 10), &err);
       if(err) {
         if(err->code != 53)
           net_sendf(cc->net, "$Error %s", err->message);
@@ -1283,60 +1259,32 @@ static void nmdc_handle(struct cc *cc, char *cmd) {
       }
     }
     g_free(un_id);
-    g_free(type);
-    g_free(id);
-    g_free(start);
-    g_free(bytes);
-  }
-  g_match_info_free(nfo);
+    break;
 
-  // $ADCSND
-  if(g_regex_match(adcsnd, cmd, 0, &nfo)) { // 1 = file/tthl, 2 = start_pos, 3 = bytes
-    if(!cc->dl || cc->state != CCS_TRANSFER) {
-      g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
-      g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), cmd);
-      cc_disconnect(cc);
-    } else {
-      char *type = g_match_info_fetch(nfo, 1);
-      char *start = g_match_info_fetch(nfo, 2);
-      char *bytes = g_match_info_fetch(nfo, 3);
-      handle_adcsnd(cc, strcmp(type, "tthl") == 0, g_ascii_strtoull(start, NULL, 10), g_ascii_strtoll(bytes, NULL, 10));
-      g_free(type);
-      g_free(start);
-      g_free(bytes);
-    }
-  }
-  g_match_info_free(nfo);
+  case NMDCC_ADCSND: // $ADCSND file|tthl identifier start_pos bytes [flags]
+    if(!(a = nmdc_arg(&args)) || !nmdc_escarg(&args) || !(c = nmdc_arg(&args)) || !(d = nmdc_arg(&args)))
+      break;
+    if((strcmp(a, "file") != 0 && strcmp(a, "tthl") != 0) || !nmdc_isnum(c, FALSE) || !nmdc_isnum(d, TRUE))
+      break;
+    handle_adcsnd(cc, strcmp(a, "tthl") == 0, g_ascii_strtoull(c, NULL, 10), g_ascii_strtoll(d, NULL, 10));
+    break;
 
-  // $Error
-  if(g_regex_match(error, cmd, 0, &nfo)) { // 1 = message
-    if(!cc->dl || cc->state != CCS_TRANSFER) {
-      g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
-      g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), cmd);
-      cc_disconnect(cc);
-    } else {
-      char *msg = g_match_info_fetch(nfo, 1);
-      g_set_error_literal(&cc->err, 1, 0, msg);
-      // Handle "File Not Available" and ".. no more exists"
-      if(str_casestr(msg, "file not available") || str_casestr(msg, "no more exists"))
-        dl_queue_setuerr(cc->uid, cc->last_hash, DLE_NOFILE, NULL);
-      g_free(msg);
-      cc->state = CCS_IDLE;
-      dl_user_cc(cc->uid, cc);
-    }
-  }
-  g_match_info_free(nfo);
+  case NMDCC_ERROR: // $Error message
+    if(!*args)
+      break;
+    g_set_error_literal(&cc->err, 1, 0, args);
+    // Handle "File Not Available" and ".. no more exists"
+    if(str_casestr(args, "file not available") || str_casestr(args, "no more exists"))
+      dl_queue_setuerr(cc->uid, cc->last_hash, DLE_NOFILE, NULL);
+    cc->state = CCS_IDLE;
+    dl_user_cc(cc->uid, cc);
+    break;
 
-  // $MaxedOut
-  if(g_regex_match(maxedout, cmd, 0, &nfo)) {
-    if(!cc->dl || cc->state != CCS_TRANSFER) {
-      g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
-      g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), cmd);
-    } else
-      g_set_error_literal(&cc->err, 1, 0, "No Slots Available");
+  case NMDCC_MAXEDOUT:
+    g_set_error_literal(&cc->err, 1, 0, "No Slots Available");
     cc_disconnect(cc);
+    break;
   }
-  g_match_info_free(nfo);
 }
 
 
@@ -676,6 +676,8 @@ static void c_version(char *args) {
 static void c_connections(char *args) {
   if(args[0])
     ui_m(NULL, 0, "This command does not accept any arguments.");
+  else if(ui_headless)
+    ui_m(NULL, 0, "The connection list is not available in headless mode.");
   else {
     if(ui_conn)
       ui_tab_cur = g_list_find(ui_tabs, ui_conn);
@@ -688,6 +690,8 @@ static void c_connections(char *args) {
 static void c_queue(char *args) {
   if(args[0])
     ui_m(NULL, 0, "This command does not accept any arguments.");
+  else if(ui_headless)
+    ui_m(NULL, 0, "The download queue is not available in headless mode.");
   else {
     if(ui_dl)
       ui_tab_cur = g_list_find(ui_tabs, ui_dl);
@@ -0,0 +1,314 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2012 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+#include "ncdc.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+/* Control socket, used to control ncdc when it runs without a user interface
+ * (--headless). The socket is created as ctl.sock in the session directory
+ * and accepts a simple line-based protocol. Every line sent by the client is
+ * one of the following:
+ *
+ *   @              List the open tabs, the current tab is marked with a '*'.
+ *   @<tab>         Select a tab, either by name (e.g. "#hub") or by number.
+ *   <command>      Anything else is handled as if it was typed on the input
+ *                  line of the current tab, e.g. "/connect", "/set nick x" or
+ *                  a chat message.
+ *
+ * Every line written in reply to a command is prefixed with "= ", and the
+ * reply is terminated with a line containing only a ".". All other messages
+ * that would normally be displayed in a tab (chat, joins, errors, etc) are
+ * sent to every client as "* <tab> <message>".
+ */
+
+struct ctl {
+  int sock;
+  GIOChannel *chan;
+  guint in_watch;
+  guint out_watch;
+  GString *rbuf;
+  GString *wbuf;
+  guint drop; // idle source that frees the client, set when disconnecting
+};
+
+// Maximum length of a single command line and the maximum amount of unsent
+// data for a client. A client that exceeds either is disconnected.
+#define CTL_MAXLINE   (64*1024)
+#define CTL_MAXBUF    (1024*1024)
+
+static int ctl_sock = -1;
+static char *ctl_path = NULL;
+static GSList *ctl_clients = NULL;
+
+// The client of which a command is currently being executed.
+static struct ctl *ctl_cur = NULL;
+
+
+static void ctl_free(struct ctl *c) {
+  if(ctl_cur == c)
+    ctl_cur = NULL;
+  ctl_clients = g_slist_remove(ctl_clients, c);
+  if(c->drop)
+    g_source_remove(c->drop);
+  if(c->in_watch)
+    g_source_remove(c->in_watch);
+  if(c->out_watch)
+    g_source_remove(c->out_watch);
+  g_io_channel_unref(c->chan);
+  close(c->sock);
+  g_string_free(c->rbuf, TRUE);
+  g_string_free(c->wbuf, TRUE);
+  g_slice_free(struct ctl, c);
+}
+
+
+static gboolean ctl_drop(gpointer dat) {
+  struct ctl *c = dat;
+  c->drop = 0;
+  ctl_free(c);
+  return FALSE;
+}
+
+
+// Disconnects a client. The struct itself is freed from an idle function,
+// since it may still be in use by the caller. The watches are removed right
+// away, so that a client that keeps sending data or has hung up doesn't keep
+// the main loop busy in the mean time.
+static void ctl_disconnect(struct ctl *c) {
+  if(c->drop)
+    return;
+  if(c->in_watch)
+    g_source_remove(c->in_watch);
+  if(c->out_watch)
+    g_source_remove(c->out_watch);
+  c->in_watch = c->out_watch = 0;
+  shutdown(c->sock, SHUT_RDWR);
+  c->drop = g_idle_add(ctl_drop, c);
+}
+
+
+static gboolean ctl_out(GIOChannel *src, GIOCondition cond, gpointer dat) {
+  struct ctl *c = dat;
+  while(c->wbuf->len > 0) {
+    int r = send(c->sock, c->wbuf->str, c->wbuf->len, MSG_NOSIGNAL);
+    if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return TRUE;
+    if(r < 0 && errno == EINTR)
+      continue;
+    if(r <= 0) {
+      g_debug("ctl: Write error: %s", g_strerror(errno));
+      c->out_watch = 0;
+      ctl_disconnect(c);
+      return FALSE;
+    }
+    g_string_erase(c->wbuf, 0, r);
+  }
+  c->out_watch = 0;
+  return FALSE;
+}
+
+
+static void ctl_write(struct ctl *c, const char *prefix, const char *msg) {
+  if(c->drop)
+    return;
+  g_string_append(c->wbuf, prefix);
+  g_string_append(c->wbuf, msg);
+  g_string_append_c(c->wbuf, '\n');
+  if(!c->out_watch)
+    c->out_watch = g_io_add_watch(c->chan, G_IO_OUT, ctl_out, c);
+}
+
+
+// Writes a (possibly multi-line) message to a client. A client that isn't
+// reading its messages is disconnected.
+static void ctl_msg(struct ctl *c, const char *prefix, const char *msg) {
+  if(c->drop)
+    return;
+  if(c->wbuf->len > CTL_MAXBUF) {
+    g_debug("ctl: Client is not reading, disconnecting.");
+    ctl_disconnect(c);
+    return;
+  }
+  char **lines = g_strsplit(msg, "\n", 0);
+  char **line;
+  for(line=lines; *line; line++)
+    ctl_write(c, prefix, *line);
+  g_strfreev(lines);
+}
+
+
+// Called by ui_m() for every message when running headless.
+void ctl_m(struct ui_tab *tab, const char *msg) {
+  if(ctl_cur) {
+    ctl_msg(ctl_cur, "= ", msg);
+    return;
+  }
+  char *prefix = g_strdup_printf("* %s ", tab->name);
+  GSList *n;
+  for(n=ctl_clients; n; n=n->next)
+    ctl_msg(n->data, prefix, msg);
+  g_free(prefix);
+}
+
+
+static void ctl_tab(struct ctl *c, const char *name) {
+  GList *n;
+  int i = 1;
+  char *end;
+  int num = strtol(name, &end, 10);
+  for(n=ui_tabs; n; n=n->next, i++) {
+    struct ui_tab *t = n->data;
+    if(!*name) {
+      char *tmp = g_strdup_printf("%d %s%s", i, t->name, n == ui_tab_cur ? " *" : "");
+      ctl_msg(c, "= ", tmp);
+      g_free(tmp);
+    } else if((!*end && num == i) || strcmp(t->name, name) == 0) {
+      ui_tab_cur = n;
+      return;
+    }
+  }
+  if(*name)
+    ctl_msg(c, "= ", "No such tab.");
+}
+
+
+static void ctl_line(struct ctl *c, char *line) {
+  if(line[0] == '@')
+    ctl_tab(c, line+1);
+  else {
+    ctl_cur = c;
+    cmd_handle(line);
+    ctl_cur = NULL;
+  }
+  ctl_write(c, "", ".");
+}
+
+
+static gboolean ctl_in(GIOChannel *src, GIOCondition cond, gpointer dat) {
+  struct ctl *c = dat;
+  char buf[4096];
+  int r = read(c->sock, buf, sizeof(buf));
+  if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return TRUE;
+  if(r <= 0) {
+    if(r < 0)
+      g_debug("ctl: Read error: %s", g_strerror(errno));
+    c->in_watch = 0;
+    ctl_disconnect(c);
+    return FALSE;
+  }
+  g_string_append_len(c->rbuf, buf, r);
+
+  char *sep;
+  while(!c->drop && (sep = memchr(c->rbuf->str, '\n', c->rbuf->len)) != NULL) {
+    *sep = 0;
+    if(sep > c->rbuf->str && sep[-1] == '\r')
+      sep[-1] = 0;
+    char *line = g_strdup(c->rbuf->str);
+    g_string_erase(c->rbuf, 0, sep - c->rbuf->str + 1);
+    if(!g_utf8_validate(line, -1, NULL)) {
+      ctl_msg(c, "= ", "Invalid UTF-8.");
+      ctl_write(c, "", ".");
+    } else
+      ctl_line(c, line);
+    g_free(line);
+  }
+
+  if(!c->drop && c->rbuf->len > CTL_MAXLINE) {
+    g_debug("ctl: Line too long, disconnecting.");
+    c->in_watch = 0;
+    ctl_disconnect(c);
+  }
+  return !c->drop;
+}
+
+
+static gboolean ctl_accept(GIOChannel *src, GIOCondition cond, gpointer dat) {
+  int sock = accept(ctl_sock, NULL, NULL);
+  if(sock < 0) {
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      g_warning("Error accepting control connection: %s", g_strerror(errno));
+    return TRUE;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+  struct ctl *c = g_slice_new0(struct ctl);
+  c->sock = sock;
+  c->chan = g_io_channel_unix_new(sock);
+  c->rbuf = g_string_new("");
+  c->wbuf = g_string_new("");
+  c->in_watch = g_io_add_watch(c->chan, G_IO_IN | G_IO_HUP | G_IO_ERR, ctl_in, c);
+  ctl_clients = g_slist_prepend(ctl_clients, c);
+  return TRUE;
+}
+
+
+void ctl_init() {
+  struct sockaddr_un addr = {};
+  ctl_path = g_build_filename(db_dir, "ctl.sock", NULL);
+  if(strlen(ctl_path) >= sizeof(addr.sun_path))
+    g_error("Path to the control socket (%s) is too long.", ctl_path);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, ctl_path);
+
+  ctl_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(ctl_sock < 0)
+    g_error("Can't create control socket: %s", g_strerror(errno));
+
+  // An existing socket is either a left-over from a previous run, or belongs
+  // to another ncdc instance using the same session directory.
+  if(connect(ctl_sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    g_error("Another instance of ncdc is already listening on %s.", ctl_path);
+  unlink(ctl_path);
+  mode_t old = umask(0077);
+  if(bind(ctl_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    g_error("Can't bind control socket to %s: %s", ctl_path, g_strerror(errno));
+  umask(old);
+  if(listen(ctl_sock, 16) < 0)
+    g_error("Can't listen on control socket: %s", g_strerror(errno));
+  fcntl(ctl_sock, F_SETFL, fcntl(ctl_sock, F_GETFL) | O_NONBLOCK);
+
+  GIOChannel *chan = g_io_channel_unix_new(ctl_sock);
+  g_io_add_watch(chan, G_IO_IN, ctl_accept, NULL);
+  g_io_channel_unref(chan);
+}
+
+
+void ctl_close() {
+  if(ctl_sock < 0)
+    return;
+  while(ctl_clients)
+    ctl_free(ctl_clients->data);
+  close(ctl_sock);
+  unlink(ctl_path);
+  g_free(ctl_path);
+}
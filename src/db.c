@@ -583,28 +583,37 @@ char *db_fl_gettthl(const char *root, int *len) {
 }
 
 
-// Get information for a file. Returns 0 if not found or error.
-gint64 db_fl_getfile(const char *path, time_t *lastmod, guint64 *size, char *tth) {
+// Get information for a number of files. The lookups are queued in a single
+// transaction, so the database thread doesn't have to be woken up for each
+// file. The results are written to the given arrays, tths should have room for
+// 24*num bytes. ids[i] is 0 if paths[i] is not found or on error.
+void db_fl_getfiles(int num, char **paths, gint64 *ids, time_t *lastmods, guint64 *sizes, char *tths) {
   GAsyncQueue *a = g_async_queue_new_full(g_free);
-  db_queue_push(0,
-    "SELECT f.id, f.lastmod, f.tth, d.size FROM hashfiles f JOIN hashdata d ON d.root = f.tth WHERE f.filename = ?",
-    DBQ_TEXT, path,
-    DBQ_RES, a, DBQ_INT64, DBQ_INT64, DBQ_TEXT, DBQ_INT64,
-    DBQ_END
-  );
+  int i;
+  db_queue_lock();
+  for(i=0; i<num; i++)
+    db_queue_push_unlocked(i < num-1 ? DBF_NEXT : 0,
+      "SELECT f.id, f.lastmod, f.tth, d.size FROM hashfiles f JOIN hashdata d ON d.root = f.tth WHERE f.filename = ?",
+      DBQ_TEXT, paths[i],
+      DBQ_RES, a, DBQ_INT64, DBQ_INT64, DBQ_TEXT, DBQ_INT64,
+      DBQ_END
+    );
+  db_queue_unlock();
 
-  char *r = g_async_queue_pop(a);
-  gint64 id = 0;
-  if(darray_get_int32(r) == SQLITE_ROW) {
-    id = darray_get_int64(r);
-    *lastmod = darray_get_int64(r);
-    base32_decode(darray_get_string(r), tth);
-    *size = darray_get_int64(r);
+  // Every query sends back its rows followed by a final result
+  for(i=0; i<num; i++) {
+    ids[i] = 0;
+    char *r;
+    while(darray_get_int32(r = g_async_queue_pop(a)) == SQLITE_ROW) {
+      ids[i] = darray_get_int64(r);
+      lastmods[i] = darray_get_int64(r);
+      base32_decode(darray_get_string(r), tths+i*24);
+      sizes[i] = darray_get_int64(r);
+      g_free(r);
+    }
+    g_free(r);
   }
-  g_free(r);
   g_async_queue_unref(a);
-
-  return id;
 }
 
 
@@ -659,11 +668,11 @@ void db_fl_purgedata() {
 // Fetches everything (except the raw TTHL data) from the dl table in no
 // particular order, calls the callback for each row.
 void db_dl_getdls(
-  void (*callback)(const char *tth, guint64 size, const char *dest, char prio, char error, const char *error_msg, int tthllen)
+  void (*callback)(const char *tth, guint64 size, const char *dest, char prio, char error, const char *error_msg, int tthllen, guint64 have, const char *hashstate, int hashstatelen)
 ) {
   GAsyncQueue *a = g_async_queue_new_full(g_free);
-  db_queue_push(DBF_NOCACHE, "SELECT tth, size, dest, priority, error, COALESCE(error_msg, ''), length(tthl) FROM dl",
-    DBQ_RES, a, DBQ_TEXT, DBQ_INT64, DBQ_TEXT, DBQ_INT, DBQ_INT, DBQ_TEXT, DBQ_INT,
+  db_queue_push(DBF_NOCACHE, "SELECT tth, size, dest, priority, error, COALESCE(error_msg, ''), length(tthl), COALESCE(have, 0), COALESCE(hashstate, '') FROM dl",
+    DBQ_RES, a, DBQ_TEXT, DBQ_INT64, DBQ_TEXT, DBQ_INT, DBQ_INT, DBQ_TEXT, DBQ_INT, DBQ_INT64, DBQ_BLOB,
     DBQ_END
   );
 
@@ -677,7 +686,10 @@ void db_dl_getdls(
     char err = darray_get_int32(r);
     char *errmsg = darray_get_string(r);
     int tthllen = darray_get_int32(r);
-    callback(hash, size, dest, prio, err, errmsg[0]?errmsg:NULL, tthllen);
+    guint64 have = darray_get_int64(r);
+    int statelen;
+    char *state = darray_get_dat(r, &statelen);
+    callback(hash, size, dest, prio, err, errmsg[0]?errmsg:NULL, tthllen, have, statelen ? state : NULL, statelen);
     g_free(r);
   }
   g_free(r);
@@ -796,6 +808,21 @@ void db_dl_settthl(const char *tth, const char *tthl, int len) {
 }
 
 
+// Sets the have and hashstate columns for a dl row. These indicate how much of
+// the incomplete file has been verified and the (opaque) hash state of the last
+// incomplete block, respectively.
+void db_dl_setprogress(const char *tth, guint64 have, const char *hashstate, int len) {
+  char hash[40] = {};
+  base32_encode(tth, hash);
+  db_queue_push(0, "UPDATE dl SET have = ?, hashstate = ? WHERE tth = ?",
+    DBQ_INT64, (gint64)have,
+    DBQ_BLOB, len, hashstate,
+    DBQ_TEXT, hash,
+    DBQ_END
+  );
+}
+
+
 // Adds a new row to the dl table.
 void db_dl_insert(const char *tth, guint64 size, const char *dest, char priority, char error, const char *error_msg) {
   char hash[40] = {};
@@ -826,6 +853,58 @@ void db_dl_adduser(const char *tth, guint64 uid, char error, const char *error_m
 }
 
 
+// Adds a user to several dl items at once, in a single transaction. tths is
+// an array of num raw TTHs.
+void db_dl_addusers(const char *tths, int num, guint64 uid) {
+  char hash[40] = {};
+  int i;
+  db_queue_lock();
+  for(i=0; i<num; i++) {
+    base32_encode(tths + i*24, hash);
+    db_queue_push_unlocked(i < num-1 ? DBF_NEXT : 0,
+      "INSERT OR REPLACE INTO dl_users (tth, uid, error, error_msg) VALUES (?, ?, ?, ?)",
+      DBQ_TEXT, hash,
+      DBQ_INT64, (gint64)uid,
+      DBQ_INT, 0,
+      DBQ_TEXT, NULL,
+      DBQ_END
+    );
+  }
+  db_queue_unlock();
+}
+
+
+// Adds several new rows to the dl table, each with a dl_users row for the
+// given user, in a single transaction. tths is an array of num raw TTHs.
+void db_dl_insertbatch(int num, const char *tths, const guint64 *sizes, char **dests, char priority, guint64 uid) {
+  char hash[40] = {};
+  int i;
+  db_queue_lock();
+  for(i=0; i<num; i++) {
+    base32_encode(tths + i*24, hash);
+    db_queue_push_unlocked(DBF_NEXT,
+      "INSERT OR REPLACE INTO dl (tth, size, dest, priority, error, error_msg) VALUES (?, ?, ?, ?, ?, ?)",
+      DBQ_TEXT, hash,
+      DBQ_INT64, (gint64)sizes[i],
+      DBQ_TEXT, dests[i],
+      DBQ_INT, (int)priority,
+      DBQ_INT, 0,
+      DBQ_TEXT, NULL,
+      DBQ_END
+    );
+    db_queue_push_unlocked(i < num-1 ? DBF_NEXT : 0,
+      "INSERT OR REPLACE INTO dl_users (tth, uid, error, error_msg) VALUES (?, ?, ?, ?)",
+      DBQ_TEXT, hash,
+      DBQ_INT64, (gint64)uid,
+      DBQ_INT, 0,
+      DBQ_TEXT, NULL,
+      DBQ_END
+    );
+  }
+  db_queue_unlock();
+}
+
+
 gboolean db_dl_checkhash(const char *root, int num, const char *hash) {
   char rhash[40] = {};
   base32_encode(root, rhash);
@@ -1291,7 +1370,7 @@ static void db_init_schema() {
   // New database? Initialize schema.
   if(ver == 0) {
     db_queue_lock();
-    db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, "PRAGMA user_version = 1", DBQ_END);
+    db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, "PRAGMA user_version = 2", DBQ_END);
     db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE,
       "CREATE TABLE hashdata ("
       "  root TEXT NOT NULL PRIMARY KEY,"
@@ -1313,7 +1392,9 @@ static void db_init_schema() {
       "  priority INTEGER NOT NULL DEFAULT 0,"
       "  error INTEGER NOT NULL DEFAULT 0,"
       "  error_msg TEXT,"
-      "  tthl BLOB"
+      "  tthl BLOB,"
+      "  have INTEGER,"
+      "  hashstate BLOB"
       ")", DBQ_END);
     db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE,
       "CREATE TABLE dl_users ("
@@ -1343,6 +1424,20 @@ static void db_init_schema() {
       g_error("Error creating database schema.");
     g_free(r);
     g_async_queue_unref(a);
+
+  // Version 1 -> 2: Add the have and hashstate columns to the dl table.
+  } else if(ver == 1) {
+    db_queue_lock();
+    db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, "ALTER TABLE dl ADD COLUMN have INTEGER", DBQ_END);
+    db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, "ALTER TABLE dl ADD COLUMN hashstate BLOB", DBQ_END);
+    GAsyncQueue *a = g_async_queue_new_full(g_free);
+    db_queue_push_unlocked(DBF_LAST|DBF_NOCACHE, "PRAGMA user_version = 2", DBQ_RES, a, DBQ_END);
+    db_queue_unlock();
+    char *r = g_async_queue_pop(a);
+    if(darray_get_int32(r) != SQLITE_DONE)
+      g_error("Error upgrading database schema.");
+    g_free(r);
+    g_async_queue_unref(a);
   }
 }
 
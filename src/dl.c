@@ -30,6 +30,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#ifdef HAVE_LINUX_FS_H
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <linux/fs.h>
+#endif
+
 
 #if INTERFACE
 
@@ -54,6 +60,12 @@ struct dl_user {
   struct cc *cc;             // Always when state = IDL or ACT, may be set or NULL in EXP
   GSequence *queue;          // list of struct dl_user_dl, ordered by dl_user_dl_sort()
   struct dl_user_dl *active; // when state = DLU_ACT, the dud that is being downloaded (NULL if it had been removed from the queue while downloading)
+  // Position in the download scheduler, and the values it has been ordered
+  // on. (See dl_queue_sched_cmp())
+  GSequenceIter *sched;      // NULL if not in the scheduler
+  struct dl *sched_dl;       // dl of the dl_user_getdl() result
+  char sched_prio;           // sched_dl->prio
+  gboolean sched_idl : 1;    // state == DLU_IDL
 };
 
 /* State machine for dl_user.state:
@@ -108,6 +120,7 @@ struct dl {
   gboolean flmatch : 1;     // For lists: Whether to match queue after completed download
   gboolean dlthread : 1;    // Whether a dl thread is active
   gboolean delete : 1;      // Pending delection
+  gboolean moving : 1;      // Whether the file is being moved to its destination (implies dlthread)
   char prio;                // DLP_*
   char error;               // DLE_*
   int incfd;                // file descriptor for this file in <incoming_dir>
@@ -120,6 +133,7 @@ struct dl {
   guint64 have;             // what we have so far
   char *inc;                // path to the incomplete file (<incoming_dir>/<base32-hash>)
   char *dest;               // destination path (must be on same filesystem as the incomplete file)
+  int move_pct;             // progress of the move to the destination, in percent (atomic)
   guint64 hash_block;       // number of bytes that each block represents
   struct tth_ctx *hash_tth; // TTH state of the last block that we have
   GSequenceIter *iter;      // used by UIT_DL
@@ -143,6 +157,16 @@ GHashTable *dl_queue = NULL;
 // uid -> dl_user lookup table.
 static GHashTable *queue_users = NULL;
 
+// Number of dl_user structs in the DLU_ACT state.
+static int queue_users_act = 0;
+
+// Download scheduler: dl_user structs that are possible targets to connect to
+// or to start a download from, ordered by priority. See dl_queue_sched().
+static GSequence *queue_sched = NULL;
+
+// Thread pool used for moving completed files to their destination.
+static GThreadPool *dl_move_pool = NULL;
+
 
 
 // Utility function that returns an error string for DLE_* errors.
@@ -170,6 +194,10 @@ char *dl_strerror(char err, const char *sub) {
 
 static gboolean dl_user_waitdone(gpointer dat);
 static void dl_queue_checkrm(struct dl *dl, gboolean justfin);
+static gboolean dl_queue_start_istarget(struct dl_user *du);
+static gboolean dl_queue_start_user(struct dl_user *du);
+static void dl_queue_sched(struct dl_user *du);
+static void dl_queue_sched_dl(struct dl *dl);
 
 
 // Determine whether a dl_user_dl struct can be considered as "enabled".
@@ -246,9 +274,16 @@ static void dl_user_setstate(struct dl_user *du, int state) {
     struct dl_user_dl *dud = du->active;
     du->active = NULL;
     dud->dl->active = FALSE;
+    dl_queue_sched_dl(dud->dl);
     dl_queue_checkrm(dud->dl, FALSE);
   }
 
+  // Keep track of the number of active users
+  if(state >= 0 && du->state != DLU_ACT && state == DLU_ACT)
+    queue_users_act++;
+  else if(state >= 0 && du->state == DLU_ACT && state != DLU_ACT)
+    queue_users_act--;
+
   // Set state
   //g_debug("dlu:%"G_GINT64_MODIFIER"x: %d -> %d (active = %s)", du->uid, du->state, state, du->active ? "true":"false");
   if(state >= 0)
@@ -256,14 +291,17 @@ static void dl_user_setstate(struct dl_user *du, int state) {
 
   // Check whether there is any value in keeping this dl_user struct in memory
   if(du->state == DLU_NCO && !g_sequence_get_length(du->queue)) {
+    if(du->sched)
+      g_sequence_remove(du->sched);
     g_hash_table_remove(queue_users, &du->uid);
     g_sequence_free(du->queue);
     g_slice_free(struct dl_user, du);
     return;
   }
 
-  // Check whether we can initiate a download again. (We could be more
-  // selective here to possibly decrease CPU usage, but oh well.)
+  // Update the position of this user in the scheduler and check whether we
+  // can initiate a download again.
+  dl_queue_sched(du);
   dl_queue_start();
 }
 
@@ -288,6 +326,13 @@ void dl_user_cc(guint64 uid, struct cc *cc) {
   g_return_if_fail(!cc || du->state == DLU_NCO || du->state == DLU_EXP || du->state == DLU_ACT);
   du->cc = cc;
   dl_user_setstate(du, cc ? DLU_IDL : DLU_WAI);
+
+  // If we have more to download from this user, request the next file right
+  // away rather than waiting for dl_queue_start_do(). This keeps the
+  // connection busy when downloading many small files, and the slot we'd be
+  // taking has just been freed by this user anyway.
+  if(cc && dl_queue_start_istarget(du) && queue_users_act < var_get_int(0, VAR_download_slots))
+    dl_queue_start_user(du);
 }
 
 
@@ -295,8 +340,17 @@ void dl_user_cc(guint64 uid, struct cc *cc) {
 // get from that user. May be called with uid=0 after joining a hub, in which
 // case all users in the queue will be checked.
 void dl_user_join(guint64 uid) {
-  if(!uid || g_hash_table_lookup(queue_users, &uid))
+  struct dl_user *du;
+  if(uid && (du = g_hash_table_lookup(queue_users, &uid))) {
+    dl_queue_sched(du);
+    dl_queue_start();
+  } else if(!uid) {
+    GHashTableIter iter;
+    g_hash_table_iter_init(&iter, queue_users);
+    while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&du))
+      dl_queue_sched(du);
     dl_queue_start();
+  }
 }
 
 
@@ -327,6 +381,7 @@ static void dl_user_add(struct dl *dl, guint64 uid, char error, const char *erro
   g_ptr_array_add(dl->u, g_sequence_insert_sorted(du->queue, dud, dl_user_dl_sort, NULL));
   if(ui_dl)
     ui_dl_dud_listchange(dud, UIDL_ADD);
+  dl_queue_sched(du);
 }
 
 
@@ -425,96 +480,92 @@ static gboolean dl_queue_start_user(struct dl_user *du) {
 }
 
 
-// Compares two dl_user structs by a "priority" to determine from whom to
-// download first. Note that users in the IDL state always get priority over
-// users in the NCO state, in order to prevent the situation that the
-// lower-priority user in the IDL state is connected to anyway in a next
-// iteration. Returns -1 if a has a higher priority than b.
-// This function assumes dl_queue_start_istarget() for both arguments.
-static gint dl_queue_start_cmp(gconstpointer a, gconstpointer b) {
+// Compares two dl_user structs in the scheduler by a "priority" to determine
+// from whom to download first. Note that users in the IDL state always get
+// priority over users in the NCO state, in order to prevent the situation
+// that the lower-priority user in the IDL state is connected to anyway in a
+// next iteration. Otherwise this is equivalent to dl_user_dl_sort() on the
+// highest-priority file of each user. Only the values cached in the dl_user
+// struct are used, so that the order remains consistent when a dl item
+// changes. Returns -1 if a has a higher priority than b.
+static gint dl_queue_sched_cmp(gconstpointer a, gconstpointer b, gpointer dat) {
   const struct dl_user *ua = a;
   const struct dl_user *ub = b;
-  return -1*(
-    ua->state == DLU_IDL && ub->state != DLU_IDL ?  1 :
-    ua->state != DLU_IDL && ub->state == DLU_IDL ? -1 :
-    dl_user_dl_sort(dl_user_getdl(ub), dl_user_getdl(ua), NULL)
-  );
+  return
+      ua->sched_idl && !ub->sched_idl ? -1 : !ua->sched_idl && ub->sched_idl ? 1
+    : ua->sched_dl->islist && !ub->sched_dl->islist ? -1 : !ua->sched_dl->islist && ub->sched_dl->islist ? 1
+    : ua->sched_prio > ub->sched_prio ? -1 : ua->sched_prio < ub->sched_prio ? 1
+    : strcmp(ua->sched_dl->dest, ub->sched_dl->dest) ? strcmp(ua->sched_dl->dest, ub->sched_dl->dest)
+    : ua->uid > ub->uid ? 1 : ua->uid < ub->uid ? -1 : 0;
 }
 
 
-// Initiates a new connection to a user or requests a file from an already
-// connected user, based on the current state of dl_user and dl structs.  This
-// function is relatively slow, so is executed from a timeout to bulk-check
-// everything after some state variables have changed. Should not be called
-// directly, use dl_queue_start() instead.
-static gboolean dl_queue_start_do(gpointer dat) {
-  int freeslots = var_get_int(0, VAR_download_slots);
-
-  // Walk through all users in the queue and:
-  // - determine possible targets to connect to or to start a transfer from
-  // - determine the highest-priority target
-  // - calculate freeslots
-  GPtrArray *targets = g_ptr_array_new();
-  struct dl_user *du, *target = NULL;
-  int target_i = 0;
-  GHashTableIter iter;
-  g_hash_table_iter_init(&iter, queue_users);
-  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&du)) {
-    if(du->state == DLU_ACT)
-      freeslots--;
-    if(dl_queue_start_istarget(du)) {
-      if(!target || dl_queue_start_cmp(target, du) > 0) {
-        target_i = targets->len;
-        target = du;
-      }
-      g_ptr_array_add(targets, du);
-    }
+// (Re-)inserts a user into the scheduler, or removes it if it isn't a target
+// anymore. This should be called whenever something changed that may have
+// improved the position of the user: a state change, or a change to the
+// queue of the user. Changes that can only lower its position (e.g. a file
+// being started by another user) are detected lazily in dl_queue_start_do().
+static void dl_queue_sched(struct dl_user *du) {
+  if(du->sched) {
+    g_sequence_remove(du->sched);
+    du->sched = NULL;
   }
+  if(!dl_queue_start_istarget(du))
+    return;
+  du->sched_dl = dl_user_getdl(du)->dl;
+  du->sched_prio = du->sched_dl->prio;
+  du->sched_idl = du->state == DLU_IDL;
+  du->sched = g_sequence_insert_sorted(queue_sched, du, dl_queue_sched_cmp, NULL);
+}
 
-  // Try to connect to the previously found highest-priority target, then go
-  // through the list again to eliminate any users that may not be a target
-  // anymore and to fetch a new highest-priority target.
-  while(freeslots > 0 && target) {
-    if(dl_queue_start_user(target) && !--freeslots)
-      break;
-    g_ptr_array_remove_index_fast(targets, target_i);
 
-    int i = 0;
-    target = NULL;
-    while(i < targets->len) {
-      du = g_ptr_array_index(targets, i);
-      if(!dl_queue_start_istarget(du))
-        g_ptr_array_remove_index_fast(targets, i);
-      else {
-        if(!target || dl_queue_start_cmp(target, du) > 0) {
-          target_i = i;
-          target = du;
-        }
-        i++;
-      }
-    }
-  }
+// Updates the scheduler for all users of a dl item. To be called when its
+// priority has changed or when it is not being downloaded anymore.
+static void dl_queue_sched_dl(struct dl *dl) {
+  int i;
+  for(i=0; i<dl->u->len; i++)
+    dl_queue_sched(((struct dl_user_dl *)g_sequence_get(g_ptr_array_index(dl->u, i)))->u);
+}
 
-  g_ptr_array_unref(targets);
 
-  // Reset this value *after* performing all the checks and starts, to ignore
-  // any dl_queue_start() calls while this function was working - this function
-  // already takes those changes into account anyway.
+// Initiates new connections to users or requests a file from already
+// connected users, as long as there are free download slots. Users are taken
+// from the start of the scheduler. Since the order of the scheduler may be
+// outdated, each user is validated again before starting anything. Should not
+// be called directly, use dl_queue_start() instead.
+static gboolean dl_queue_start_do(gpointer dat) {
+  // Reset this value *before* performing the starts, dl_queue_start() will be
+  // called again when something changed in the mean time.
   dl_queue_needstart = FALSE;
+
+  int freeslots = var_get_int(0, VAR_download_slots) - queue_users_act;
+  GSequenceIter *i;
+  while(freeslots > 0 && !g_sequence_iter_is_end(i = g_sequence_get_begin_iter(queue_sched))) {
+    struct dl_user *du = g_sequence_get(i);
+    struct dl_user_dl *dud = dl_queue_start_istarget(du) ? dl_user_getdl(du) : NULL;
+    // Not a target anymore, or its highest-priority file has changed: update
+    // its position and look again.
+    if(!dud || dud->dl != du->sched_dl || dud->dl->prio != du->sched_prio) {
+      dl_queue_sched(du);
+      continue;
+    }
+    g_sequence_remove(du->sched);
+    du->sched = NULL;
+    if(dl_queue_start_user(du))
+      freeslots--;
+  }
   return FALSE;
 }
 
 
 // Make sure dl_queue_start() can be called at any time that something changed
-// that might allow us to initiate a download again. Since this is a relatively
-// expensive operation, dl_queue_start() simply queues a dl_queue_start_do()
-// from a timer.
-// TODO: Make the timeout configurable? It's a tradeoff between download
-// management responsiveness and CPU usage.
+// that might allow us to initiate a download again. The actual work is done
+// in dl_queue_start_do() from an idle source, so that many changes within the
+// same main loop iteration are handled together.
 void dl_queue_start() {
   if(!dl_queue_needstart) {
     dl_queue_needstart = TRUE;
-    g_timeout_add(500, dl_queue_start_do, NULL);
+    g_idle_add(dl_queue_start_do, NULL);
   }
 }
 
@@ -526,8 +577,9 @@ void dl_queue_start() {
 
 // Adds a dl item to the queue. dl->inc will be determined and opened here.
 // dl->hastthl will be set if the file is small enough to not need TTHL data.
-// dl->u is also created here.
-static void dl_queue_insert(struct dl *dl, gboolean init) {
+// dl->u is also created here. dl_queue_insert_prep() only does the in-memory
+// part, the caller is responsible for updating the UI and the database.
+static void dl_queue_insert_prep(struct dl *dl) {
   // Set dl->hastthl for files smaller than MINTTHLSIZE.
   if(!dl->islist && !dl->hastthl && dl->size <= DL_MINTTHLSIZE) {
     dl->hastthl = TRUE;
@@ -541,6 +593,11 @@ static void dl_queue_insert(struct dl *dl, gboolean init) {
   dl->u = g_ptr_array_new();
   // insert in the global queue
   g_hash_table_insert(dl_queue, dl->hash, dl);
+}
+
+
+static void dl_queue_insert(struct dl *dl, gboolean init) {
+  dl_queue_insert_prep(dl);
   if(ui_dl)
     ui_dl_listchange(dl, UIDL_ADD);
 
@@ -611,28 +668,96 @@ static gboolean dl_queue_addfile(guint64 uid, char *hash, guint64 size, char *fn
 }
 
 
-// Recursively adds a file or directory to the queue. *excl will only be
-// checked for files in subdirectories, if *fl is a file it will always be
-// added.
-void dl_queue_add_fl(guint64 uid, struct fl_list *fl, char *base, GRegex *excl) {
-  // check excl
-  if(base && excl && g_regex_match(excl, fl->name, 0, NULL)) {
-    ui_mf(NULL, 0, "Ignoring `%s': excluded by regex.", fl->name);
+struct dl_queue_add_fl_state {
+  const char *dir;   // download directory
+  GRegex *excl;
+  GString *path;     // path of the current item, relative to dir
+  GPtrArray *dls;    // items added
+  int dup;           // number of files that were already queued
+  int excluded;      // number of items excluded by excl
+};
+
+
+static void dl_queue_add_fl_collect(struct dl_queue_add_fl_state *s, struct fl_list *fl) {
+  if(fl->isfile) {
+    if(g_hash_table_lookup(dl_queue, fl->tth)) {
+      s->dup++;
+      return;
+    }
+    struct dl *dl = g_slice_new0(struct dl);
+    memcpy(dl->hash, fl->tth, 24);
+    dl->size = fl->size;
+    dl->dest = g_build_filename(s->dir, s->path->str, NULL);
+    dl_queue_insert_prep(dl);
+    g_ptr_array_add(s->dls, dl);
     return;
   }
 
-  char *name = base ? g_build_filename(base, fl->name, NULL) : g_strdup(fl->name);
-  if(fl->isfile) {
-    if(!dl_queue_addfile(uid, fl->tth, fl->size, name))
-      ui_mf(NULL, 0, "Ignoring `%s': already queued.", name);
-  } else {
-    int i;
-    for(i=0; i<fl->sub->len; i++)
-      dl_queue_add_fl(uid, g_ptr_array_index(fl->sub, i), name, excl);
+  int i, len = s->path->len;
+  for(i=0; i<fl->sub->len; i++) {
+    struct fl_list *f = g_ptr_array_index(fl->sub, i);
+    if(s->excl && g_regex_match(s->excl, f->name, 0, NULL)) {
+      s->excluded++;
+      continue;
+    }
+    g_string_append_c(s->path, '/');
+    g_string_append(s->path, f->name);
+    dl_queue_add_fl_collect(s, f);
+    g_string_truncate(s->path, len);
   }
-  if(!base)
-    ui_mf(NULL, 0, "%s added to queue.", name);
-  g_free(name);
+}
+
+
+// Adds a file or directory to the queue. *excl will only be checked for
+// items in subdirectories, if *fl is a file it will always be added.
+// All dl items are created first, and are then added to the UI, the user and
+// the database in a single batch.
+void dl_queue_add_fl(guint64 uid, struct fl_list *fl, GRegex *excl) {
+  struct dl_queue_add_fl_state s = {};
+  s.dir = var_get(0, VAR_download_dir);
+  s.excl = excl;
+  s.path = g_string_new(fl->name);
+  s.dls = g_ptr_array_new();
+  dl_queue_add_fl_collect(&s, fl);
+
+  int i;
+  if(s.dls->len) {
+    if(ui_dl)
+      ui_dl_listadd(s.dls);
+    GArray *tths = g_array_sized_new(FALSE, FALSE, 24, s.dls->len);
+    GArray *sizes = g_array_sized_new(FALSE, FALSE, sizeof(guint64), s.dls->len);
+    GPtrArray *dests = g_ptr_array_sized_new(s.dls->len);
+    for(i=0; i<s.dls->len; i++) {
+      struct dl *dl = g_ptr_array_index(s.dls, i);
+      dl_user_add(dl, uid, 0, NULL);
+      g_array_append_vals(tths, dl->hash, 1);
+      g_array_append_val(sizes, dl->size);
+      g_ptr_array_add(dests, dl->dest);
+    }
+    db_dl_insertbatch(s.dls->len, tths->data, (guint64 *)sizes->data, (char **)dests->pdata, DLP_MED, uid);
+    g_array_free(tths, TRUE);
+    g_array_free(sizes, TRUE);
+    g_ptr_array_free(dests, TRUE);
+    dl_queue_start();
+  }
+  g_debug("dl:%016"G_GINT64_MODIFIER"x: queueing %s: %d files", uid, fl->name, s.dls->len);
+
+  if(fl->isfile)
+    ui_mf(NULL, 0, s.dup ? "Ignoring `%s': already queued." : "%s added to queue.", fl->name);
+  else {
+    GString *msg = g_string_new("");
+    g_string_printf(msg, "%s added to queue: %d file%s", fl->name, s.dls->len, s.dls->len == 1 ? "" : "s");
+    if(s.dup)
+      g_string_append_printf(msg, ", %d already queued", s.dup);
+    if(s.excluded)
+      g_string_append_printf(msg, ", %d excluded by regex", s.excluded);
+    g_string_append_c(msg, '.');
+    ui_m(NULL, 0, msg->str);
+    g_string_free(msg, TRUE);
+  }
+
+  g_string_free(s.path, TRUE);
+  g_ptr_array_free(s.dls, TRUE);
 }
 
 
@@ -650,6 +775,16 @@ void dl_queue_add_res(struct search_r *r) {
 }
 
 
+// Returns whether the user has been added to a dl item.
+static gboolean dl_user_has(struct dl *dl, guint64 uid) {
+  int i;
+  for(i=0; i<dl->u->len; i++)
+    if(((struct dl_user_dl *)g_sequence_get(g_ptr_array_index(dl->u, i)))->u->uid == uid)
+      return TRUE;
+  return FALSE;
+}
+
+
 // Add a user to a dl item, if the file is in the queue and the user hasn't
 // been added yet. Returns:
 //  -1  Not found in queue
@@ -659,10 +794,8 @@ int dl_queue_matchfile(guint64 uid, char *tth) {
   struct dl *dl = g_hash_table_lookup(dl_queue, tth);
   if(!dl)
     return -1;
-  int i;
-  for(i=0; i<dl->u->len; i++)
-    if(((struct dl_user_dl *)g_sequence_get(g_ptr_array_index(dl->u, i)))->u->uid == uid)
-      return 0;
+  if(dl_user_has(dl, uid))
+    return 0;
   dl_user_add(dl, uid, 0, NULL);
   db_dl_adduser(dl->hash, uid, 0, NULL);
   dl_queue_start();
@@ -670,25 +803,87 @@ int dl_queue_matchfile(guint64 uid, char *tth) {
 }
 
 
-// Recursively walks through the file list and adds the user to matching dl
-// items. Returns the number of items found, and the number of items for which
-// the user was added is stored in *added (should be initialized to zero).
+static void dl_queue_match_collect(struct fl_list *fl, GArray *tths) {
+  int i;
+  for(i=0; i<fl->sub->len; i++) {
+    struct fl_list *f = g_ptr_array_index(fl->sub, i);
+    if(f->isfile && f->hastth)
+      g_array_append_vals(tths, f->tth, 1);
+    else if(!f->isfile)
+      dl_queue_match_collect(f, tths);
+  }
+}
+
+
+static gint dl_queue_match_cmp(gconstpointer a, gconstpointer b) {
+  return memcmp(a, b, 24);
+}
+
+
+static gint dl_queue_match_dlcmp(gconstpointer a, gconstpointer b) {
+  return memcmp((*(struct dl **)a)->hash, (*(struct dl **)b)->hash, 24);
+}
+
+
+// Walks through the file list and adds the user to matching dl items. Returns
+// the number of items found, and the number of items for which the user was
+// added is stored in *added (should be initialized to zero).
+// The TTHs in the list and the hashes of the items in the queue are both
+// collected into a sorted array and then merged, and the new dl_users rows
+// are all added in a single transaction.
 int dl_queue_match_fl(guint64 uid, struct fl_list *fl, int *added) {
-  if(fl->isfile && fl->hastth) {
-    int r = dl_queue_matchfile(uid, fl->tth);
+  if(fl->isfile) {
+    int r = fl->hastth ? dl_queue_matchfile(uid, fl->tth) : -1;
     if(r == 1)
       (*added)++;
     return r >= 0 ? 1 : 0;
+  }
 
-  } else {
-    int n = 0;
-    int i;
-    for(i=0; i<fl->sub->len; i++)
-      n += dl_queue_match_fl(uid, g_ptr_array_index(fl->sub, i), added);
-    return n;
+  GArray *tths = g_array_new(FALSE, FALSE, 24);
+  dl_queue_match_collect(fl, tths);
+  g_array_sort(tths, dl_queue_match_cmp);
+
+  GPtrArray *dls = g_ptr_array_sized_new(g_hash_table_size(dl_queue));
+  GHashTableIter iter;
+  struct dl *dl;
+  g_hash_table_iter_init(&iter, dl_queue);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&dl))
+    if(!dl->islist)
+      g_ptr_array_add(dls, dl);
+  g_ptr_array_sort(dls, dl_queue_match_dlcmp);
+
+  GArray *addtths = g_array_new(FALSE, FALSE, 24);
+  int n = 0, i = 0, j = 0;
+  while(i < tths->len && j < dls->len) {
+    dl = g_ptr_array_index(dls, j);
+    int c = memcmp(tths->data + i*24, dl->hash, 24);
+    if(c < 0)
+      i++;
+    else if(c > 0)
+      j++;
+    else {
+      // The same file may be present in the list more than once
+      for(; i < tths->len && memcmp(tths->data + i*24, dl->hash, 24) == 0; i++)
+        n++;
+      if(!dl_user_has(dl, uid)) {
+        dl_user_add(dl, uid, 0, NULL);
+        g_array_append_vals(addtths, dl->hash, 1);
+      }
+      j++;
+    }
   }
-}
 
+  if(addtths->len) {
+    db_dl_addusers(addtths->data, addtths->len, uid);
+    dl_queue_start();
+  }
+  *added += addtths->len;
+
+  g_array_free(tths, TRUE);
+  g_array_free(addtths, TRUE);
+  g_ptr_array_free(dls, TRUE);
+  return n;
+}
 
 
 
@@ -784,6 +979,7 @@ void dl_queue_setprio(struct dl *dl, char prio) {
   int i;
   for(i=0; i<dl->u->len; i++)
     g_sequence_sort_changed(g_ptr_array_index(dl->u, i), dl_user_dl_sort, NULL);
+  dl_queue_sched_dl(dl);
   // Start the download if it is enabled
   if(enabled)
     dl_queue_start();
@@ -838,6 +1034,7 @@ void dl_queue_setuerr(guint64 uid, char *tth, char e, const char *emsg) {
     // while changing the ordering may cause problems.
     g_sequence_sort(du->queue, dl_user_dl_sort, NULL);
   }
+  dl_queue_sched(du);
 
   // update DB
   db_dl_setuerr(uid, tth, e, emsg);
@@ -901,59 +1098,222 @@ void dl_queue_rmuser(guint64 uid, char *tth) {
 
 // Managing of active downloads
 
-// Called when we've got a complete file
-static void dl_finished(struct dl *dl) {
-  g_debug("dl: download of `%s' finished, removing from queue", dl->dest);
-  // close
-  if(dl->incfd > 0)
-    g_warn_if_fail(close(dl->incfd) == 0);
-  dl->incfd = 0;
+// Moving completed files to their destination. This is done in a background
+// thread, as it may involve copying the entire file if the incoming directory
+// and the destination are on a different filesystem. The thread only touches
+// dl->move_pct, everything else it needs is copied into the context.
+
+struct dl_move_ctx {
+  struct dl *dl;
+  gboolean islist;
+  char hash[24];
+  char *inc;
+  char *dest;
+  char *err;
+};
+
+
+// Size of the buffer used when falling back to read()/write(), and the number
+// of bytes to pass to a single copy_file_range() call.
+#define DL_MOVE_BUFSIZE (128*1024)
+#define DL_MOVE_CHUNK (8*1024*1024)
+
+
+// Copies the incomplete file to dest. Tries, in order, to clone the file
+// (reflink), copy_file_range() and read()/write(). Returns an error message on
+// failure, in which case the partially written destination file is removed.
+static char *dl_move_copy(struct dl_move_ctx *c, const char *dest) {
+  int in = open(c->inc, O_RDONLY);
+  if(in < 0)
+    return g_strdup(g_strerror(errno));
+  int out = open(dest, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if(out < 0) {
+    char *err = g_strdup(g_strerror(errno));
+    close(in);
+    return err;
+  }
+
+  char *err = NULL;
+  char *buf = NULL;
+  struct stat st;
+  guint64 size = 0, off = 0;
+  if(fstat(in, &st) < 0)
+    err = g_strdup(g_strerror(errno));
+  else
+    size = st.st_size;
+
+#if defined(HAVE_LINUX_FS_H) && defined(FICLONE)
+  if(!err && ioctl(out, FICLONE, in) == 0)
+    off = size;
+#endif
+#if !defined(HAVE_LINUX_FS_H) || !defined(SYS_copy_file_range)
+  buf = g_malloc(DL_MOVE_BUFSIZE);
+#endif
+
+  while(!err && off < size) {
+    ssize_t r;
+#if defined(HAVE_LINUX_FS_H) && defined(SYS_copy_file_range)
+    if(!buf) {
+      r = syscall(SYS_copy_file_range, in, NULL, out, NULL, (size_t)MIN(size-off, DL_MOVE_CHUNK), 0);
+      // Not supported by the kernel or for this combination of filesystems,
+      // fall back to read()/write().
+      if(r < 0 && off == 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+        buf = g_malloc(DL_MOVE_BUFSIZE);
+        continue;
+      }
+    } else
+#endif
+    {
+      r = read(in, buf, DL_MOVE_BUFSIZE);
+      ssize_t w = 0;
+      while(r > 0 && w < r) {
+        ssize_t n = write(out, buf+w, r-w);
+        if(n < 0 && errno == EINTR)
+          continue;
+        if(n < 0) {
+          r = -1;
+          break;
+        }
+        w += n;
+      }
+    }
+    if(r < 0 && errno == EINTR)
+      continue;
+    if(r < 0)
+      err = g_strdup(g_strerror(errno));
+    else if(r == 0)
+      err = g_strdup("Unexpected end of file");
+    else {
+      off += r;
+      g_atomic_int_set(&c->dl->move_pct, (int) ((off*100)/size));
+    }
+  }
+  g_free(buf);
+
+  if(!err && fsync(out) < 0)
+    err = g_strdup(g_strerror(errno));
+  if(close(out) < 0 && !err)
+    err = g_strdup(g_strerror(errno));
+  close(in);
+  if(err)
+    unlink(dest);
+  return err;
+}
+
+
+static gboolean dl_move_done(gpointer dat) {
+  struct dl_move_ctx *c = dat;
+  struct dl *dl = c->dl;
+
+  dl->dlthread = FALSE;
+  dl->moving = FALSE;
+
+  if(dl->delete)
+    dl_queue_rm(dl);
+
+  else {
+    if(c->err)
+      dl_queue_seterr(dl, DLE_IO_DEST, c->err);
+
+    // open the file list
+    if(dl->islist && dl->prio != DLP_ERR && dl->u->len == 1) {
+      // Ugly hack: make sure to not select the browse tab, if one is opened
+      GList *cur = ui_tab_cur;
+      ui_fl_queue(((struct dl_user_dl *)g_sequence_get(g_ptr_array_index(dl->u, 0)))->u->uid,
+          FALSE, dl->flsel, dl->flpar, dl->flopen, dl->flmatch);
+      ui_tab_cur = cur;
+    }
+    // and check whether we can remove this item from the queue
+    dl_queue_checkrm(dl, TRUE);
+  }
+
+  g_free(c->inc);
+  g_free(c->dest);
+  g_free(c->err);
+  g_slice_free(struct dl_move_ctx, c);
+  return FALSE;
+}
+
+
+static void dl_move_thread(gpointer dat, gpointer udat) {
+  struct dl_move_ctx *c = dat;
+
   // Create destination directory, if it does not exist yet.
-  char *parent = g_path_get_dirname(dl->dest);
+  char *parent = g_path_get_dirname(c->dest);
   if(g_mkdir_with_parents(parent, 0755) < 0)
-    dl_queue_seterr(dl, DLE_IO_DEST, g_strerror(errno));
+    c->err = g_strdup(g_strerror(errno));
   g_free(parent);
 
   // Prevent overwiting other files by appending a prefix to the destination if
   // it already exists. It is assumed that fn + any dupe-prevention-extension
   // does not exceed NAME_MAX. (Not that checking against NAME_MAX is really
   // reliable - some filesystems have an even more strict limit)
+  // Other moves may be running at the same time, so the name is claimed by
+  // atomically creating an empty file, which is then replaced below.
   int num = 1;
-  char *dest = g_strdup(dl->dest);
-  while(!dl->islist && g_file_test(dest, G_FILE_TEST_EXISTS)) {
-    g_free(dest);
-    dest = g_strdup_printf("%s.%d", dl->dest, num++);
+  char *dest = g_strdup(c->dest);
+  while(!c->err && !c->islist) {
+    int fd = open(dest, O_WRONLY|O_CREAT|O_EXCL, 0666);
+    if(fd >= 0) {
+      close(fd);
+      break;
+    }
+    if(errno != EEXIST)
+      c->err = g_strdup(g_strerror(errno));
+    else {
+      g_free(dest);
+      dest = g_strdup_printf("%s.%d", c->dest, num++);
+    }
   }
 
-  // Move the file to the destination.
-  // TODO: this may block for a while if they are not on the same filesystem,
-  // do this in a separate thread?
-  GError *err = NULL;
-  if(dl->prio != DLP_ERR) {
-    GFile *src = g_file_new_for_path(dl->inc);
-    GFile *dst = g_file_new_for_path(dest);
-    g_file_move(src, dst, dl->islist ? G_FILE_COPY_OVERWRITE : G_FILE_COPY_BACKUP, NULL, NULL, NULL, &err);
-    g_object_unref(src);
-    g_object_unref(dst);
-    if(err) {
-      g_warning("Error moving `%s' to `%s': %s", dl->inc, dest, err->message);
-      dl_queue_seterr(dl, DLE_IO_DEST, err->message);
-      g_error_free(err);
-    }
+  // Move the file to the destination, falling back to a copy if they are not
+  // on the same filesystem.
+  if(!c->err && rename(c->inc, dest) < 0) {
+    if(errno != EXDEV) {
+      c->err = g_strdup(g_strerror(errno));
+      if(!c->islist)
+        unlink(dest);
+    } else if(!(c->err = dl_move_copy(c, dest)))
+      unlink(c->inc);
   }
+
+  if(c->err)
+    g_warning("Error moving `%s' to `%s': %s", c->inc, dest, c->err);
+  // Remove the item from the database right away, so that it won't be loaded
+  // again if ncdc is closed before dl_move_done() gets to run.
+  else if(!c->islist)
+    db_dl_rm(c->hash);
   g_free(dest);
 
-  // open the file list
-  if(dl->islist && dl->prio != DLP_ERR) {
-    g_return_if_fail(dl->u->len == 1);
-    // Ugly hack: make sure to not select the browse tab, if one is opened
-    GList *cur = ui_tab_cur;
-    ui_fl_queue(((struct dl_user_dl *)g_sequence_get(g_ptr_array_index(dl->u, 0)))->u->uid,
-        FALSE, dl->flsel, dl->flpar, dl->flopen, dl->flmatch);
-    ui_tab_cur = cur;
+  g_idle_add_full(G_PRIORITY_HIGH_IDLE, dl_move_done, c, NULL);
+}
+
+
+// Called when we've got a complete file
+static void dl_finished(struct dl *dl) {
+  g_debug("dl: download of `%s' finished, removing from queue", dl->dest);
+  // close
+  if(dl->incfd > 0)
+    g_warn_if_fail(close(dl->incfd) == 0);
+  dl->incfd = 0;
+
+  // Nothing to move if we're in an error state, just check whether we can
+  // remove this item from the queue
+  if(dl->prio == DLP_ERR) {
+    dl_queue_checkrm(dl, TRUE);
+    return;
   }
-  // and check whether we can remove this item from the queue
-  dl_queue_checkrm(dl, TRUE);
+
+  struct dl_move_ctx *c = g_slice_new0(struct dl_move_ctx);
+  c->dl = dl;
+  c->islist = dl->islist;
+  memcpy(c->hash, dl->hash, 24);
+  c->inc = g_strdup(dl->inc);
+  c->dest = g_strdup(dl->dest);
+  dl->dlthread = TRUE;
+  dl->moving = TRUE;
+  g_atomic_int_set(&dl->move_pct, 0);
+  g_thread_pool_push(dl_move_pool, c, NULL);
 }
 
 
@@ -1021,6 +1381,7 @@ struct recv_ctx {
   guint64 uid;
   char *err_msg, *uerr_msg;
   char err, uerr;
+  gboolean synced; // whether all data written so far has been fdatasync()'ed
   struct fadv adv;
 };
 
@@ -1055,6 +1416,21 @@ void *dl_recv_create(guint64 uid, const char *tth) {
 }
 
 
+// Saves dl->have and dl->hash_tth to the database, so that we don't have to
+// hash the last block of the incomplete file again on the next startup. The
+// hash state is only saved when the data it covers is known to be on disk,
+// otherwise it could be trusted for data that was lost in a crash.
+static void dl_save_progress(struct dl *dl, gboolean synced) {
+  if(dl->islist)
+    return;
+  char state[tth_state_len];
+  gboolean save = synced && dl->hash_tth;
+  if(save)
+    tth_save(dl->hash_tth, state);
+  db_dl_setprogress(dl->hash, dl->have, state, save ? tth_state_len : 0);
+}
+
+
 void dl_recv_done(void *dat) {
   struct recv_ctx *c = dat;
 
@@ -1076,7 +1452,8 @@ void dl_recv_done(void *dat) {
     if(c->dl->have >= c->dl->size) {
       g_warn_if_fail(c->dl->have == c->dl->size);
       dl_finished(c->dl);
-    }
+    } else
+      dl_save_progress(c->dl, c->synced);
   }
 
   // Clean up
@@ -1146,6 +1523,7 @@ gboolean dl_recv_data(struct net *n, char *buf, int length, int left, void *dat)
       c->err_msg = g_strdup(g_strerror(errno));
       return FALSE;
     }
+    c->synced = FALSE;
     fadv_purge(&c->adv, r);
 
     // check hash
@@ -1176,6 +1554,11 @@ gboolean dl_recv_data(struct net *n, char *buf, int length, int left, void *dat)
     c->dl->have += r;
   }
 
+  // Make sure the data is on disk before the hash state is saved in
+  // dl_recv_done(). Doing this here keeps the main thread from blocking.
+  if(!left && c->dl->have < c->dl->size && !c->dl->islist)
+    c->synced = fdatasync(c->dl->incfd) == 0;
+
   // TODO: if dl->have == d->size, close() the file here? Since close() may
   // actually flush the data to disk and thus block for a while.
 
@@ -1190,8 +1573,14 @@ gboolean dl_recv_data(struct net *n, char *buf, int length, int left, void *dat)
 
 
 // Checks the incoming file for what we already have and modifies dl->have and
-// dl->hash_tth accordingly.
+// dl->hash_tth accordingly. When called, dl->have and dl->hash_tth hold the
+// progress as saved with dl_save_progress(), if any.
 void dl_load_partial(struct dl *dl) {
+  guint64 saved = dl->have;
+  struct tth_ctx *ctx = dl->hash_tth;
+  dl->have = 0;
+  dl->hash_tth = NULL;
+
   // get size of the incomplete file, but only if we have tthl info
   char *fn = NULL;
   if(dl->hastthl) {
@@ -1203,11 +1592,25 @@ void dl_load_partial(struct dl *dl) {
       dl->have = st.st_size;
   }
 
-  // If we have already downloaded some data, hash the last block and update
-  // dl->hash_tth.
+  // All completed blocks have been verified while downloading, only the last
+  // (incomplete) block needs to be hashed again in order to update
+  // dl->hash_tth. If the saved hash state is still valid for this block, we
+  // only have to hash whatever has been written after it was saved - usually
+  // nothing at all.
   guint64 left = dl->hash_block ? dl->have % dl->hash_block : 0;
+  guint64 start = dl->have - left;
+  if(ctx && saved >= start && saved <= dl->have && ctx->tiger.length > 0
+      && (guint64)ctx->leafnum*1024 + ctx->tiger.length-1 == saved - start) {
+    left = dl->have - saved;
+    dl->have = saved;
+    dl->hash_tth = ctx;
+    ctx = NULL;
+  } else
+    dl->have = start;
+  if(ctx)
+    g_slice_free(struct tth_ctx, ctx);
+
   if(left > 0) {
-    dl->have -= left;
     int fd = open(fn, O_RDONLY);
     if(fd < 0 || lseek(fd, dl->have, SEEK_SET) == (off_t)-1) {
       g_warning("Error opening %s: %s. Throwing away last block.", fn, g_strerror(errno));
@@ -1218,7 +1621,7 @@ void dl_load_partial(struct dl *dl) {
     while(left > 0) {
       char buf[10240];
       int r = read(fd, buf, MIN(left, 10240));
-      if(r < 0) {
+      if(r <= 0) {
         g_warning("Error reading from %s: %s. Throwing away unreadable data.", fn, g_strerror(errno));
         left = 0;
         break;
@@ -1236,7 +1639,7 @@ void dl_load_partial(struct dl *dl) {
 
 
 // Creates and inserts a struct dl item from the database in the queue
-void dl_load_dl(const char *tth, guint64 size, const char *dest, char prio, char error, const char *error_msg, int tthllen) {
+void dl_load_dl(const char *tth, guint64 size, const char *dest, char prio, char error, const char *error_msg, int tthllen, guint64 have, const char *hashstate, int hashstatelen) {
   g_return_if_fail(dest);
 
   struct dl *dl = g_slice_new0(struct dl);
@@ -1255,6 +1658,16 @@ void dl_load_dl(const char *tth, guint64 size, const char *dest, char prio, char
     dl->hash_block = tth_blocksize(dl->size, tthllen/24);
   }
 
+  // Saved progress, validated in dl_load_partial()
+  dl->have = have;
+  if(hashstate && hashstatelen == tth_state_len) {
+    dl->hash_tth = g_slice_new(struct tth_ctx);
+    if(!tth_load(dl->hash_tth, hashstate, hashstatelen)) {
+      g_slice_free(struct tth_ctx, dl->hash_tth);
+      dl->hash_tth = NULL;
+    }
+  }
+
   dl_queue_insert(dl, TRUE);
 }
 
@@ -1269,6 +1682,8 @@ void dl_load_dlu(const char *tth, guint64 uid, char error, const char *error_msg
 
 void dl_init_global() {
   queue_users = g_hash_table_new(g_int64_hash, g_int64_equal);
+  queue_sched = g_sequence_new(NULL);
+  dl_move_pool = g_thread_pool_new(dl_move_thread, NULL, 2, FALSE, NULL);
   dl_queue = g_hash_table_new(g_int_hash, tiger_hash_equal);
   // load stuff from the database
   db_dl_getdls(dl_load_dl);
@@ -1285,6 +1700,8 @@ void dl_init_global() {
 
 
 void dl_close_global() {
+  // Wait for any files that are still being moved to their destination
+  g_thread_pool_free(dl_move_pool, FALSE, TRUE);
   // Delete incomplete file lists. They won't be completed anyway.
   GHashTableIter iter;
   struct dl *dl;
@@ -1303,7 +1720,7 @@ void dl_close_global() {
 
 // Various cleanup/gc utilities
 
-// Removes old filelists from /fl/. Can be run from a timer.
+// Removes old filelists and their caches from /fl/. Can be run from a timer.
 gboolean dl_fl_clean(gpointer dat) {
   char *dir = g_build_filename(db_dir, "fl", NULL);
   GDir *d = g_dir_open(dir, 0, NULL);
@@ -1319,8 +1736,19 @@ gboolean dl_fl_clean(gpointer dat) {
       continue;
     char *fn = g_build_filename(dir, n, NULL);
     struct stat st;
-    if(stat(fn, &st) >= 0 && st.st_mtime < ref)
+    // A cache expires together with its file list, or when the list is gone.
+    int len = strlen(fn);
+    if(len > 4 && strcmp(fn+len-4, ".flc") == 0) {
+      char *xml = g_strdup_printf("%.*s.xml.bz2", len-4, fn);
+      if(stat(xml, &st) < 0 || st.st_mtime < ref)
+        unlink(fn);
+      g_free(xml);
+    } else if(stat(fn, &st) >= 0 && st.st_mtime < ref) {
       unlink(fn);
+      char *cache = fl_cache_path(fn);
+      unlink(cache);
+      g_free(cache);
+    }
     g_free(fn);
   }
   g_dir_close(d);
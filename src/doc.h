@@ -298,7 +298,9 @@ static const struct doc_set {
   " seconds, 'm' for minutes, 'h' for hours and 'd' for days. Set to 0 to"
   " disable automatically refreshing the file list. This setting also"
   " determines whether ncdc will perform a refresh on startup. See the"
-  " `/refresh' command to manually refresh your file list."
+  " `/refresh' command to manually refresh your file list. On systems with"
+  " inotify support, changes to the shared directories are also picked up as"
+  " they happen, so a long interval is usually sufficient."
 },
 { "backlog", 1, "<integer>",
   "When opening a hub or PM tab, ncdc can load a certain amount of lines from"
@@ -367,8 +369,9 @@ static const struct doc_set {
   "The directory where finished downloads are moved to. Finished downloads are"
   " by default stored in <session directory>/dl/. It is possible to set this to"
   " a location that is on a different filesystem than the incoming directory,"
-  " but doing so is not recommended: ncdc will block when moving the completed"
-  " files to their final destination."
+  " in which case completed files are copied to their final destination in a"
+  " background thread. This costs extra disk I/O, so keeping both directories"
+  " on the same filesystem is still recommended."
 },
 { "download_exclude", 0, "<regex>",
   "When recursively adding a directory to the download queue - by pressing `b'"
@@ -518,6 +521,14 @@ static const struct doc_set {
   "Enabling TLS may result in less accurate traffic shaping when the"
   " `download_rate' or `upload_rate' settings are used."
 },
+{ "ui_frame_interval", 0, "<integer>",
+  "Minimum time, in milliseconds, between two screen updates that are not"
+  " caused by keyboard input. Only the parts of the screen that have changed"
+  " are redrawn. Increasing this value reduces CPU usage and the amount of"
+  " data sent to the terminal, which may be useful when running ncdc over a"
+  " slow SSH connection, at the cost of a less responsive display of"
+  " incoming chat messages and transfer statistics."
+},
 { "ui_time_format", 0, "<string>",
   "The format of the time displayed in the lower-left of the screen. Set `-' to"
   " not display a time at all. The string is passed to the Glib"
@@ -28,6 +28,11 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 
 char           *fl_local_list_file;
@@ -183,8 +188,52 @@ struct fl_scan_args {
 };
 
 
+// Scanning happens in two phases. In the first phase the directories of a
+// share are scanned in parallel: fl_scan_thread() queues the root directories
+// in fl_scan_dir_pool, and every scanned directory in turn queues its
+// subdirectories. Each job only fills the sub array of its own directory, so
+// the resulting tree does not depend on the order in which the directories
+// happen to be scanned. Files are compared against the old in-memory tree,
+// and only the files that can't be found there have their realpath()
+// resolved. In the second phase, the hash information of those files is
+// fetched from the database in batches. Directory sizes are calculated
+// afterwards. Scanning is mostly latency-bound (especially on network
+// filesystems), so there are more threads than CPUs.
+#define FL_SCAN_THREADS 8
+
+// Number of files to look up in the database in a single transaction
+#define FL_SCAN_BATCH 256
+
+static GThreadPool *fl_scan_dir_pool;
+
+// State shared by all jobs of a single fl_scan_thread() run.
+struct fl_scan_ctx {
+  GMutex *lock;
+  GCond *cond;
+  int pending;      // number of queued or active jobs, protected by lock
+  gboolean utf8fs;  // whether the filesystem encoding is UTF-8
+  gboolean inc_hidden;
+  GRegex *excl;
+  GArray *lookup;   // struct fl_scan_lookup, protected by lock
+};
+
+struct fl_scan_job {
+  struct fl_scan_ctx *ctx;
+  struct fl_list *dir, *old;
+  char *path;  // filesystem encoding
+  char *vpath; // UTF-8
+};
+
+// A file that has to be looked up in the database
+struct fl_scan_lookup {
+  struct fl_list *fl;
+  char *real; // realpath() in UTF-8
+};
+
+
 // Removes duplicate files (that is, files with the same name in a
-// case-insensitive context) from a dirtectory.
+// case-insensitive context) from a dirtectory. The sizes of the parent
+// directories are not updated, these are calculated after the scan.
 static void fl_scan_rmdupes(struct fl_list *fl, const char *vpath) {
   int i = 1;
   while(i<fl->sub->len) {
@@ -193,7 +242,7 @@ static void fl_scan_rmdupes(struct fl_list *fl, const char *vpath) {
     if(fl_list_cmp_strict(a, b) == 0) {
       char *tmp = g_build_filename(vpath, b->name, NULL);
       ui_mf(ui_main, UIP_MED, "Not sharing \"%s\": Other file with same name (but different case) already shared.", tmp);
-      fl_list_remove(b);
+      g_ptr_array_remove_index(fl->sub, i);
       g_free(tmp);
     } else
       i++;
@@ -205,9 +254,11 @@ static void fl_scan_rmdupes(struct fl_list *fl, const char *vpath) {
 // of DELETE FROM queries in a single transaction. This is significantly faster
 // than using a separate transaction for each DELETE.
 static void fl_scan_invalidate(gint64 id, gboolean force_flush) {
+  static GStaticMutex lock = G_STATIC_MUTEX_INIT;
   static gint64 rmids[50];
   static int i = 0;
 
+  g_static_mutex_lock(&lock);
   if(id)
     rmids[i++] = id;
 
@@ -215,102 +266,124 @@ static void fl_scan_invalidate(gint64 id, gboolean force_flush) {
     db_fl_rmfiles(rmids, i);
     i = 0;
   }
+  g_static_mutex_unlock(&lock);
 }
 
 
-// Fetches TTH information either from the database or from *oldpar, and
-// invalidates this data if the file has changed.
-static void fl_scan_check(struct fl_list *oldpar, struct fl_list *new, const char *real) {
-  time_t oldlastmod;
-  guint64 oldsize;
-  char oldhash[24];
-  gint64 oldid = 0;
+// Copies the given hash information into *new, or invalidates it if the file
+// has changed. Returns FALSE in the latter case.
+static gboolean fl_scan_update(struct fl_list *new, gint64 oldid, time_t oldlastmod, guint64 oldsize, const char *oldhash) {
+  if(oldlastmod < fl_list_getlocal(new).lastmod || oldsize != new->size) {
+    fl_scan_invalidate(oldid, FALSE);
+    return FALSE;
+  }
+  new->hastth = TRUE;
+  memcpy(new->tth, oldhash, 24);
+  fl_list_getlocal(new).lastmod = oldlastmod;
+  fl_list_getlocal(new).id = oldid;
+  return TRUE;
+}
+
 
+// Fetches TTH information from *oldpar, and invalidates this data if the file
+// has changed. Returns FALSE if the file has no hash information in *oldpar,
+// in which case it has to be looked up in the database.
+static gboolean fl_scan_check(struct fl_list *oldpar, struct fl_list *new, const char *vpath) {
   struct fl_list *old = oldpar && oldpar->sub ? fl_list_file_strict(oldpar, new) : NULL;
-  // Get from the previous in-memory structure
-  if(old && fl_list_getlocal(old).id) {
-    oldid = fl_list_getlocal(old).id;
-    oldlastmod = fl_list_getlocal(old).lastmod;
-    oldsize = old->size;
-    memcpy(oldhash, old->tth, 24);
-  // Otherwise, do a database lookup on the file path
-  } else
-    oldid = db_fl_getfile(real, &oldlastmod, &oldsize, oldhash);
+  if(!old || !fl_list_getlocal(old).id)
+    return FALSE;
+  if(!fl_scan_update(new, fl_list_getlocal(old).id, fl_list_getlocal(old).lastmod, old->size, old->tth))
+    g_debug("fl: Dropping hash information for `%s/%s': file has changed.", vpath, new->name);
+  return TRUE;
+}
 
-  // Check for file change
-  if(oldid && (oldlastmod < fl_list_getlocal(new).lastmod || oldsize != new->size)) {
-    g_debug("fl: Dropping hash information for `%s': file has changed.", real);
-    fl_scan_invalidate(oldid, FALSE);
-  // Otherwise, update *new
-  } else if(oldid) {
-    new->hastth = TRUE;
-    memcpy(new->tth, oldhash, 24);
-    fl_list_getlocal(new).lastmod = oldlastmod;
-    fl_list_getlocal(new).id = oldid;
+
+// Returns the realpath() of a file in UTF-8, or NULL on error.
+// For *path and *vpath see fl_scan_dir(), *name is in UTF-8.
+static char *fl_scan_realpath(struct fl_scan_ctx *ctx, const char *path, const char *vpath, const char *name) {
+  char *ename = ctx->utf8fs ? g_strdup(name) : g_filename_from_utf8(name, -1, NULL, NULL, NULL);
+  char *cpath = g_build_filename(path, ename, NULL);
+  char *tmp = realpath(cpath, NULL);
+  int err = errno;
+  char *real = tmp ? g_filename_to_utf8(tmp, -1, NULL, NULL, NULL) : NULL;
+  if(!real) {
+    char *vcpath = g_build_filename(vpath, name, NULL);
+    ui_mf(ui_main, UIP_MED, "Error getting file path for \"%s\": %s", vcpath, tmp ? "Encoding error." : g_strerror(err));
+    g_free(vcpath);
   }
+  free(tmp);
+  g_free(cpath);
+  g_free(ename);
+  return real;
+}
+
+
+// Fetches the hash information of num files from the database.
+static void fl_scan_lookup(struct fl_scan_lookup *l, int num) {
+  char *paths[FL_SCAN_BATCH];
+  gint64 ids[FL_SCAN_BATCH];
+  time_t lastmods[FL_SCAN_BATCH];
+  guint64 sizes[FL_SCAN_BATCH];
+  char tths[FL_SCAN_BATCH*24];
+  int i;
+  for(i=0; i<num; i++)
+    paths[i] = l[i].real;
+  db_fl_getfiles(num, paths, ids, lastmods, sizes, tths);
+  for(i=0; i<num; i++)
+    if(ids[i] && !fl_scan_update(l[i].fl, ids[i], lastmods[i], sizes[i], tths+i*24))
+      g_debug("fl: Dropping hash information for `%s': file has changed.", l[i].real);
 }
 
 
-// *name is in filesystem encoding. For *path and *vpath see fl_scan_dir().
-static struct fl_list *fl_scan_item(struct fl_list *old, const char *path, const char *vpath, const char *name, GRegex *excl) {
+// *name is in filesystem encoding, dfd is the opened directory. For *vpath
+// see fl_scan_dir().
+static struct fl_list *fl_scan_item(struct fl_scan_ctx *ctx, struct fl_list *old, int dfd, const char *vpath, const char *name) {
   char *uname = NULL;  // name-to-UTF8
-  char *vcpath = NULL; // vpath + uname
   char *ename = NULL;  // uname-to-filesystem
-  char *cpath = NULL;  // path + ename
-  char *real = NULL;   // realpath(cpath)-to-UTF8
+  char *vcpath = NULL; // vpath + uname, only for error reporting
   struct fl_list *node = NULL;
 
-  // Try to get a UTF-8 filename
-  uname = g_filename_to_utf8(name, -1, NULL, NULL, NULL);
-  if(!uname)
-    uname = g_filename_display_name(name);
+  // Try to get a UTF-8 filename. If the filesystem encoding is UTF-8, then a
+  // valid name doesn't need any conversion in either direction.
+  if(ctx->utf8fs && g_utf8_validate(name, -1, NULL)) {
+    uname = g_strdup(name);
+    ename = g_strdup(name);
+  } else {
+    uname = g_filename_to_utf8(name, -1, NULL, NULL, NULL);
+    if(!uname)
+      uname = g_filename_display_name(name);
+  }
 
   // Check for share_exclude as soon as we have the confname
-  if(excl && g_regex_match(excl, uname, 0, NULL))
+  if(ctx->excl && g_regex_match(ctx->excl, uname, 0, NULL))
     goto done;
 
-  // Get the virtual path (for reporting purposes)
-  vcpath = g_build_filename(vpath, uname, NULL);
-
   // Check that the UTF-8 filename can be converted back to something we can
   // access on the filesystem. If it can't be converted back, we won't share
   // the file at all. Keeping track of a raw-to-UTF-8 filename lookup table
   // isn't worth the effort.
-  ename = g_filename_from_utf8(uname, -1, NULL, NULL, NULL);
+  if(!ename)
+    ename = g_filename_from_utf8(uname, -1, NULL, NULL, NULL);
   if(!ename) {
+    vcpath = g_build_filename(vpath, uname, NULL);
     ui_mf(ui_main, UIP_MED, "Error reading directory entry in \"%s\": Invalid encoding.", vcpath);
     goto done;
   }
 
-  // Get cpath and try to stat() the file
+  // Try to stat() the file
   // we're currently following symlinks, but I'm not sure whether that's a good idea yet
-  cpath = g_build_filename(path, ename, NULL);
   struct stat dat;
-  int r = stat(cpath, &dat);
+  int r = fstatat(dfd, ename, &dat, 0);
   if(r < 0 || !(S_ISREG(dat.st_mode) || S_ISDIR(dat.st_mode))) {
+    int err = errno;
+    vcpath = g_build_filename(vpath, uname, NULL);
     if(r < 0)
-      ui_mf(ui_main, UIP_MED, "Error stat'ing \"%s\": %s", vcpath, g_strerror(errno));
+      ui_mf(ui_main, UIP_MED, "Error stat'ing \"%s\": %s", vcpath, g_strerror(err));
     else
       ui_mf(ui_main, UIP_MED, "Not sharing \"%s\": Neither file nor directory.", vcpath);
     goto done;
   }
 
-  // Get the realpath() (for lookup in the database)
-  // TODO: this path is only used if fl_scan_check() can't find the item in the
-  // old fl_list structure. It may be more efficient to only try to execute
-  // this code when this is the case.
-  char *tmp = realpath(cpath, NULL);
-  if(!tmp) {
-    ui_mf(ui_main, UIP_MED, "Error getting file path for \"%s\": %s", vcpath, g_strerror(errno));
-    goto done;
-  }
-  real = g_filename_to_utf8(tmp, -1, NULL, NULL, NULL);
-  free(tmp);
-  if(!real) {
-    ui_mf(ui_main, UIP_MED, "Error getting file path for \"%s\": %s", vcpath, "Encoding error.");
-    goto done;
-  }
-
   // create the node
   node = fl_list_create(uname, S_ISREG(dat.st_mode) ? TRUE : FALSE);
   if(S_ISREG(dat.st_mode)) {
@@ -319,82 +392,173 @@ static struct fl_list *fl_scan_item(struct fl_list *old, const char *path, const
     fl_list_getlocal(node).lastmod = dat.st_mtime;
   }
 
-  // Fetch id, tth, and hashtth fields.
-  if(node->isfile)
-    fl_scan_check(old, node, real);
+  // Fetch id, tth, and hashtth fields from the old tree. Files that aren't
+  // in there are marked with id = -1, see fl_scan_dir().
+  if(node->isfile && !fl_scan_check(old, node, vpath))
+    fl_list_getlocal(node).id = -1;
 
 done:
   g_free(uname);
   g_free(vcpath);
-  g_free(cpath);
   g_free(ename);
-  g_free(real);
   return node;
 }
 
 
-// recursive
+static void fl_scan_push(struct fl_scan_ctx *ctx, struct fl_list *dir, struct fl_list *old, char *path, char *vpath) {
+  struct fl_scan_job *j = g_slice_new(struct fl_scan_job);
+  j->ctx = ctx;
+  j->dir = dir;
+  j->old = old;
+  j->path = path;
+  j->vpath = vpath;
+  g_mutex_lock(ctx->lock);
+  ctx->pending++;
+  g_mutex_unlock(ctx->lock);
+  g_thread_pool_push(fl_scan_dir_pool, j, NULL);
+}
+
+
 // Doesn't handle paths longer than PATH_MAX, but I don't think it matters all that much.
 // *path is the filesystem path in filename encoding, vpath is the virtual path in UTF-8.
-static void fl_scan_dir(struct fl_list *parent, struct fl_list *old, const char *path, const char *vpath, gboolean inc_hidden, GRegex *excl) {
-  GError *err = NULL;
-  GDir *dir = g_dir_open(path, 0, &err);
+static void fl_scan_dir(struct fl_scan_ctx *ctx, struct fl_list *parent, struct fl_list *old, const char *path, const char *vpath) {
+  int dfd = open(path, O_RDONLY|O_DIRECTORY);
+  DIR *dir = dfd < 0 ? NULL : fdopendir(dfd);
   if(!dir) {
     ui_mf(ui_main, UIP_MED, "Error reading directory \"%s\": %s", vpath, g_strerror(errno));
-    g_error_free(err);
+    if(dfd >= 0)
+      close(dfd);
     return;
   }
-  const char *name;
-  while((name = g_dir_read_name(dir))) {
+  struct dirent *ent;
+  while((ent = readdir(dir))) {
+    const char *name = ent->d_name;
     if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
       continue;
-    if(!inc_hidden && name[0] == '.')
+    if(!ctx->inc_hidden && name[0] == '.')
       continue;
     // check with *excl, stat and create
-    struct fl_list *item = fl_scan_item(old, path, vpath, name, excl);
-    // and add it
-    if(item)
-      fl_list_add(parent, item, -1);
+    struct fl_list *item = fl_scan_item(ctx, old, dfd, vpath, name);
+    // and add it. Don't use fl_list_add() here, as that updates the sizes of
+    // all parent directories, which are shared with the other jobs.
+    if(item) {
+      item->parent = parent;
+      g_ptr_array_add(parent->sub, item);
+    }
   }
-  g_dir_close(dir);
+  closedir(dir);
 
   // Sort
   fl_list_sort(parent);
   fl_scan_rmdupes(parent, vpath);
 
-  // check for directories (outside of the above loop, to avoid having too many
-  // directories opened at the same time. Costs some extra CPU cycles, though...)
-  int i;
+  // Get the real paths of the files that weren't in the old tree, these are
+  // looked up in the database after the scan. Files of which the path can't
+  // be resolved are not shared.
+  GArray *lookup = NULL;
+  int i = 0;
+  while(i<parent->sub->len) {
+    struct fl_list *cur = g_ptr_array_index(parent->sub, i);
+    if(!cur->isfile || fl_list_getlocal(cur).id != -1) {
+      i++;
+      continue;
+    }
+    fl_list_getlocal(cur).id = 0;
+    struct fl_scan_lookup l = { cur, fl_scan_realpath(ctx, path, vpath, cur->name) };
+    if(!l.real) {
+      g_ptr_array_remove_index(parent->sub, i);
+      continue;
+    }
+    if(!lookup)
+      lookup = g_array_new(FALSE, FALSE, sizeof(struct fl_scan_lookup));
+    g_array_append_val(lookup, l);
+    i++;
+  }
+  if(lookup) {
+    g_mutex_lock(ctx->lock);
+    g_array_append_vals(ctx->lookup, lookup->data, lookup->len);
+    g_mutex_unlock(ctx->lock);
+    g_array_free(lookup, TRUE);
+  }
+
+  // queue the subdirectories (outside of the above loop, to avoid having too
+  // many directories opened at the same time)
   for(i=0; i<parent->sub->len; i++) {
     struct fl_list *cur = g_ptr_array_index(parent->sub, i);
     if(!cur->isfile) {
-      char *enc = g_filename_from_utf8(cur->name, -1, NULL, NULL, NULL);
-      char *cpath = g_build_filename(path, enc, NULL);
-      char *virtpath = g_build_filename(vpath, cur->name, NULL);
+      char *enc = ctx->utf8fs ? g_strdup(cur->name) : g_filename_from_utf8(cur->name, -1, NULL, NULL, NULL);
       cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
-      fl_scan_dir(cur, old && old->sub ? fl_list_file_strict(old, cur) : NULL, cpath, virtpath, inc_hidden, excl);
-      g_free(virtpath);
-      g_free(cpath);
+      fl_scan_push(ctx, cur, old && old->sub ? fl_list_file_strict(old, cur) : NULL,
+        g_build_filename(path, enc, NULL), g_build_filename(vpath, cur->name, NULL));
       g_free(enc);
     }
   }
 }
 
 
+static void fl_scan_dir_thread(gpointer data, gpointer udata) {
+  struct fl_scan_job *j = data;
+  struct fl_scan_ctx *ctx = j->ctx;
+  fl_scan_dir(ctx, j->dir, j->old, j->path, j->vpath);
+  g_free(j->path);
+  g_free(j->vpath);
+  g_slice_free(struct fl_scan_job, j);
+
+  g_mutex_lock(ctx->lock);
+  if(!--ctx->pending)
+    g_cond_signal(ctx->cond);
+  g_mutex_unlock(ctx->lock);
+}
+
+
+// Calculates the directory sizes of a freshly scanned tree.
+static guint64 fl_scan_sizes(struct fl_list *fl) {
+  if(fl->isfile)
+    return fl->size;
+  fl->size = 0;
+  int i;
+  for(i=0; i<fl->sub->len; i++)
+    fl->size += fl_scan_sizes(g_ptr_array_index(fl->sub, i));
+  return fl->size;
+}
+
+
 // Must be called in a separate thread.
 static void fl_scan_thread(gpointer data, gpointer udata) {
   struct fl_scan_args *args = data;
+  struct fl_scan_ctx ctx = {};
+  ctx.lock = g_mutex_new();
+  ctx.cond = g_cond_new();
+  ctx.utf8fs = g_get_filename_charsets(NULL);
+  ctx.inc_hidden = args->inc_hidden;
+  ctx.excl = args->excl_regex;
+  ctx.lookup = g_array_new(FALSE, FALSE, sizeof(struct fl_scan_lookup));
 
   int i, len = g_strv_length(args->path);
   for(i=0; i<len; i++) {
     struct fl_list *cur = fl_list_create("", FALSE);
-    char *tmp = g_filename_from_utf8(args->path[i], -1, NULL, NULL, NULL);
     cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
-    fl_scan_dir(cur, args->file[i], tmp, args->path[i], args->inc_hidden, args->excl_regex);
-    g_free(tmp);
     args->res[i] = cur;
+    fl_scan_push(&ctx, cur, args->file[i], g_filename_from_utf8(args->path[i], -1, NULL, NULL, NULL), g_strdup(args->path[i]));
   }
 
+  g_mutex_lock(ctx.lock);
+  while(ctx.pending)
+    g_cond_wait(ctx.cond, ctx.lock);
+  g_mutex_unlock(ctx.lock);
+  g_mutex_free(ctx.lock);
+  g_cond_free(ctx.cond);
+
+  // Second phase, fetch the hash information of the new files
+  for(i=0; i<ctx.lookup->len; i+=FL_SCAN_BATCH)
+    fl_scan_lookup(&g_array_index(ctx.lookup, struct fl_scan_lookup, i), MIN(FL_SCAN_BATCH, ctx.lookup->len-i));
+  for(i=0; i<ctx.lookup->len; i++)
+    g_free(g_array_index(ctx.lookup, struct fl_scan_lookup, i).real);
+  g_array_free(ctx.lookup, TRUE);
+
+  for(i=0; i<len; i++)
+    fl_scan_sizes(args->res[i]);
+
   fl_scan_invalidate(0, TRUE);
   g_idle_add_full(G_PRIORITY_HIGH_IDLE, args->donefun, args, NULL);
 }
@@ -662,6 +826,344 @@ fl_hash_done_f:
 
 
 
+// Watching shared directories for changes
+// Every directory in fl_local_list gets an inotify watch. Changed items are
+// collected in fl_watch_pending and applied to the list a few seconds later in
+// a single batch. The delay avoids hashing files that are still being written
+// to, and changes are postponed while a refresh is in progress, since the scan
+// thread reads the list at that time. New directories are scanned with a
+// regular fl_refresh(), which adds watches for everything it has scanned.
+// A periodic full refresh is still useful to catch anything that has been
+// missed, e.g. changes made while ncdc wasn't running.
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define FL_WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR)
+
+// Seconds to wait before applying changes
+#define FL_WATCH_DELAY 2
+
+static int         fl_watch_fd = -1;
+static GHashTable *fl_watch_wds;     // wd -> virtual path (as in fl_list_path())
+static GHashTable *fl_watch_paths;   // virtual path -> wd, keys are owned by fl_watch_wds
+static GHashTable *fl_watch_pending; // set of virtual paths of changed items
+static guint       fl_watch_timer = 0;
+
+static void fl_refresh_delhash(struct fl_list *cur);
+
+
+static void fl_watch_unmap(int wd) {
+  char *vpath = g_hash_table_lookup(fl_watch_wds, GINT_TO_POINTER(wd));
+  if(vpath) {
+    g_hash_table_remove(fl_watch_paths, vpath);
+    g_hash_table_remove(fl_watch_wds, GINT_TO_POINTER(wd));
+  }
+}
+
+
+// *vpath is the virtual path of the directory, *path its filesystem path.
+// Subdirectories that are already watched are skipped, their subdirectories
+// have been added together with them or through an event on them.
+static void fl_watch_add_rec(struct fl_list *fl, const char *vpath, const char *path) {
+  static gboolean warned = FALSE;
+  if(!g_hash_table_lookup(fl_watch_paths, vpath)) {
+    int wd = inotify_add_watch(fl_watch_fd, path, FL_WATCH_MASK);
+    if(wd < 0) {
+      // Other errors are likely caused by the directory being removed, which
+      // will be noticed by the watch on the parent.
+      if(errno == ENOSPC && !warned) {
+        ui_m(ui_main, UIP_MED, "Not all shared directories can be watched for changes. Increase fs.inotify.max_user_watches to fix this.");
+        warned = TRUE;
+      }
+      return;
+    }
+    // The same directory may have been watched under a different path, e.g.
+    // when it has been moved.
+    fl_watch_unmap(wd);
+    char *tmp = g_strdup(vpath);
+    g_hash_table_insert(fl_watch_wds, GINT_TO_POINTER(wd), tmp);
+    g_hash_table_insert(fl_watch_paths, tmp, GINT_TO_POINTER(wd));
+  }
+
+  int i;
+  for(i=0; i<fl->sub->len; i++) {
+    struct fl_list *cur = g_ptr_array_index(fl->sub, i);
+    if(cur->isfile)
+      continue;
+    char *cvpath = g_build_filename(vpath, cur->name, NULL);
+    char *enc = g_hash_table_lookup(fl_watch_paths, cvpath) ? NULL
+      : g_filename_from_utf8(cur->name, -1, NULL, NULL, NULL);
+    if(enc) {
+      char *cpath = g_build_filename(path, enc, NULL);
+      fl_watch_add_rec(cur, cvpath, cpath);
+      g_free(cpath);
+      g_free(enc);
+    }
+    g_free(cvpath);
+  }
+}
+
+
+// Adds watches for a directory in fl_local_list and its subdirectories. The
+// directory itself and its direct subdirectories are always checked, but
+// subtrees that are already watched aren't walked again. This keeps the call
+// after every refresh cheap, even for large shares.
+static void fl_watch_add(struct fl_list *fl) {
+  if(fl_watch_fd < 0 || fl->isfile)
+    return;
+  if(!fl->parent) {
+    int i;
+    for(i=0; i<fl->sub->len; i++)
+      fl_watch_add(g_ptr_array_index(fl->sub, i));
+    return;
+  }
+  char *vpath = fl_list_path(fl);
+  char *tmp = fl_local_path(fl);
+  char *path = g_filename_from_utf8(tmp, -1, NULL, NULL, NULL);
+  if(path)
+    fl_watch_add_rec(fl, vpath, path);
+  g_free(path);
+  g_free(tmp);
+  g_free(vpath);
+}
+
+
+static void fl_watch_del_rec(struct fl_list *fl, const char *vpath) {
+  gpointer wd;
+  if(g_hash_table_lookup_extended(fl_watch_paths, vpath, NULL, &wd)) {
+    inotify_rm_watch(fl_watch_fd, GPOINTER_TO_INT(wd));
+    fl_watch_unmap(GPOINTER_TO_INT(wd));
+  }
+  int i;
+  for(i=0; i<fl->sub->len; i++) {
+    struct fl_list *cur = g_ptr_array_index(fl->sub, i);
+    if(!cur->isfile) {
+      char *cvpath = g_build_filename(vpath, cur->name, NULL);
+      fl_watch_del_rec(cur, cvpath);
+      g_free(cvpath);
+    }
+  }
+}
+
+
+// Recursively removes the watches of a directory. Must be called before the
+// directory is removed from fl_local_list.
+static void fl_watch_del(struct fl_list *fl) {
+  if(fl_watch_fd < 0 || fl->isfile)
+    return;
+  char *vpath = fl_list_path(fl);
+  fl_watch_del_rec(fl, vpath);
+  g_free(vpath);
+}
+
+
+// Removes all watches, so that the next fl_watch_add() walks the entire list
+// again. Used when events have been lost, in which case new directories
+// inside watched ones may not have been noticed.
+static void fl_watch_reset() {
+  GHashTableIter iter;
+  gpointer wd;
+  g_hash_table_iter_init(&iter, fl_watch_wds);
+  while(g_hash_table_iter_next(&iter, &wd, NULL))
+    inotify_rm_watch(fl_watch_fd, GPOINTER_TO_INT(wd));
+  g_hash_table_remove_all(fl_watch_paths);
+  g_hash_table_remove_all(fl_watch_wds);
+}
+
+
+// Compares a changed item on the filesystem with fl_local_list and updates
+// the list, hash queue and hash index accordingly. Returns TRUE if the item is
+// a directory that needs to be scanned.
+static gboolean fl_watch_update(const char *vpath, gboolean inc_hidden, GRegex *excl) {
+  const char *name = strrchr(vpath, '/')+1;
+  char *dirpath = g_strndup(vpath, name-vpath-1);
+  struct fl_list *dir = fl_list_from_path(fl_local_list, dirpath);
+  g_free(dirpath);
+  if(!dir || dir->isfile || !dir->parent)
+    return FALSE;
+  struct fl_list *old = fl_list_file(dir, name);
+
+  // Check whether the item should (still) be shared
+  struct stat st;
+  gboolean share = (inc_hidden || name[0] != '.') && !(excl && g_regex_match(excl, name, 0, NULL));
+  if(share) {
+    char *tmp = fl_local_path(dir);
+    char *enc = g_filename_from_utf8(tmp, -1, NULL, NULL, NULL);
+    char *ename = g_filename_from_utf8(name, -1, NULL, NULL, NULL);
+    char *path = enc && ename ? g_build_filename(enc, ename, NULL) : NULL;
+    share = path && stat(path, &st) == 0 && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode));
+    g_free(path);
+    g_free(ename);
+    g_free(enc);
+    g_free(tmp);
+  }
+
+  // Nothing has changed. A directory that has lost its watch has been
+  // replaced by a new one, so rescan it.
+  if(old && share && !!old->isfile == !!S_ISREG(st.st_mode)) {
+    if(!old->isfile) {
+      char *tmp = fl_list_path(old);
+      gboolean watched = g_hash_table_lookup(fl_watch_paths, tmp) ? TRUE : FALSE;
+      g_free(tmp);
+      return !watched;
+    }
+    if(old->size == st.st_size && fl_list_getlocal(old).lastmod >= st.st_mtime)
+      return FALSE;
+  }
+
+  if(old) {
+    // Drop the hash information if this is a modified version of the file
+    if(share && old->isfile && S_ISREG(st.st_mode) && fl_list_getlocal(old).id) {
+      g_debug("fl: Dropping hash information for `%s': file has changed.", vpath);
+      fl_scan_invalidate(fl_list_getlocal(old).id, FALSE);
+    }
+    fl_watch_del(old);
+    fl_hash_queue_delrec(old);
+    fl_refresh_delhash(old);
+    fl_list_remove(old);
+  }
+  if(!share)
+    return FALSE;
+
+  struct fl_list *new = fl_list_create(name, S_ISREG(st.st_mode) ? TRUE : FALSE);
+  if(S_ISREG(st.st_mode)) {
+    new->isfile = TRUE;
+    new->size = st.st_size;
+    fl_list_getlocal(new).lastmod = st.st_mtime;
+  } else
+    new->sub = g_ptr_array_new_with_free_func(fl_list_free);
+
+  if(fl_list_file_strict(dir, new)) {
+    ui_mf(ui_main, UIP_MED, "Not sharing \"%s\": Other file with same name (but different case) already shared.", vpath);
+    fl_list_free(new);
+    return FALSE;
+  }
+
+  // Insert at the right position, so that the directory remains sorted
+  int b = 0, e = dir->sub->len;
+  while(b < e) {
+    int i = b + (e - b)/2;
+    if(fl_list_cmp(g_ptr_array_index(dir->sub, i), new) < 0)
+      b = i+1;
+    else
+      e = i;
+  }
+  fl_list_add(dir, new, b);
+  if(new->isfile)
+    fl_hash_queue_append(new);
+  return !new->isfile;
+}
+
+
+static gboolean fl_watch_flush(gpointer dat) {
+  // Don't touch the list while the scan thread may be reading it
+  if(fl_refresh_queue->head)
+    return TRUE;
+  fl_watch_timer = 0;
+
+  char *excl = var_get(0, VAR_share_exclude);
+  GRegex *excl_regex = excl ? g_regex_new(excl, G_REGEX_OPTIMIZE, 0, NULL) : NULL;
+  gboolean inc_hidden = var_get_bool(0, VAR_share_hidden);
+
+  GPtrArray *scan = g_ptr_array_new_with_free_func(g_free);
+  GHashTableIter iter;
+  char *vpath;
+  g_hash_table_iter_init(&iter, fl_watch_pending);
+  while(g_hash_table_iter_next(&iter, (gpointer *)&vpath, NULL))
+    if(fl_watch_update(vpath, inc_hidden, excl_regex))
+      g_ptr_array_add(scan, g_strdup(vpath));
+  g_hash_table_remove_all(fl_watch_pending);
+  fl_scan_invalidate(0, TRUE);
+
+  // Start the scans only after all items have been updated. A directory may
+  // have been removed again by a later update.
+  int i;
+  for(i=0; i<scan->len; i++) {
+    struct fl_list *fl = fl_list_from_path(fl_local_list, g_ptr_array_index(scan, i));
+    if(fl && !fl->isfile) {
+      fl_watch_add(fl);
+      fl_refresh(fl);
+    }
+  }
+
+  g_ptr_array_unref(scan);
+  if(excl_regex)
+    g_regex_unref(excl_regex);
+  fl_needflush = TRUE;
+  return FALSE;
+}
+
+
+static gboolean fl_watch_read(GIOChannel *src, GIOCondition cond, gpointer dat) {
+  char buf[16*1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  int r = read(fl_watch_fd, buf, sizeof(buf));
+  if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return TRUE;
+  if(r <= 0) {
+    g_warning("Error reading inotify events: %s", r < 0 ? g_strerror(errno) : "Unexpected EOF.");
+    return FALSE;
+  }
+
+  char *p = buf;
+  while(p < buf+r) {
+    struct inotify_event *ev = (struct inotify_event *)p;
+    p += sizeof(struct inotify_event) + ev->len;
+
+    // Events have been lost, fall back to a full refresh
+    if(ev->mask & IN_Q_OVERFLOW) {
+      g_debug("fl: inotify queue overflow, refreshing.");
+      fl_watch_reset();
+      fl_refresh(NULL);
+      continue;
+    }
+    if(ev->mask & IN_IGNORED) {
+      fl_watch_unmap(ev->wd);
+      continue;
+    }
+    char *vpath = g_hash_table_lookup(fl_watch_wds, GINT_TO_POINTER(ev->wd));
+    // New files are only considered after they have been written
+    if(!vpath || !ev->len || ((ev->mask & IN_CREATE) && !(ev->mask & IN_ISDIR)))
+      continue;
+    // Items with an invalid encoding aren't shared, a refresh will complain about them
+    char *uname = g_filename_to_utf8(ev->name, -1, NULL, NULL, NULL);
+    if(uname)
+      g_hash_table_replace(fl_watch_pending, g_build_filename(vpath, uname, NULL), (void *)1);
+    g_free(uname);
+  }
+
+  if(!fl_watch_timer && g_hash_table_size(fl_watch_pending))
+    fl_watch_timer = g_timeout_add_seconds(FL_WATCH_DELAY, fl_watch_flush, NULL);
+  return TRUE;
+}
+
+
+static void fl_watch_init() {
+  fl_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(fl_watch_fd < 0) {
+    ui_mf(ui_main, UIP_MED, "Can't watch shared directories for changes: %s", g_strerror(errno));
+    return;
+  }
+  fl_watch_wds = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  fl_watch_paths = g_hash_table_new(g_str_hash, g_str_equal);
+  fl_watch_pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  GIOChannel *chan = g_io_channel_unix_new(fl_watch_fd);
+  g_io_add_watch(chan, G_IO_IN, fl_watch_read, NULL);
+  g_io_channel_unref(chan);
+}
+
+#else
+
+#define fl_watch_add(fl) ((void)0)
+#define fl_watch_del(fl) ((void)0)
+#define fl_watch_init() ((void)0)
+
+#endif
+
+
+
+
+
 // Refresh filelist & (un)share directories
 
 
@@ -759,6 +1261,7 @@ static void fl_refresh_compare(struct fl_list *old, struct fl_list *new) {
 
     // remove
     if(remove) {
+      fl_watch_del(oldl);
       fl_refresh_delhash(oldl);
       fl_list_remove(oldl);
       // don't modify oldi, after deletion it will automatically point to the next item in the list
@@ -850,6 +1353,7 @@ static gboolean fl_refresh_scanned(gpointer dat) {
   for(i=0; i<len; i++) {
     fl_refresh_compare(args->file[i], args->res[i]);
     fl_list_free(args->res[i]);
+    fl_watch_add(args->file[i]);
   }
 
   // If the hash queue is empty after calling fl_refresh_compare() then it
@@ -913,10 +1417,12 @@ void fl_unshare(const char *dir) {
   if(dir) {
     struct fl_list *fl = fl_list_file(fl_local_list, dir);
     g_return_if_fail(fl);
+    fl_watch_del(fl);
     fl_hash_queue_delrec(fl);
     fl_refresh_delhash(fl);
     fl_list_remove(fl);
   } else if(fl_local_list) {
+    fl_watch_del(fl_local_list);
     fl_hash_queue_delrec(fl_local_list);
     fl_refresh_delhash(fl_local_list);
     fl_list_free(fl_local_list);
@@ -967,6 +1473,7 @@ void fl_init() {
   fl_local_list_file = g_build_filename(db_dir, "files.xml.bz2", NULL);
   fl_refresh_queue = g_queue_new();
   fl_scan_pool = g_thread_pool_new(fl_scan_thread, NULL, 1, FALSE, NULL);
+  fl_scan_dir_pool = g_thread_pool_new(fl_scan_dir_thread, NULL, FL_SCAN_THREADS, FALSE, NULL);
   fl_hash_pool = g_thread_pool_new(fl_hash_thread, NULL, 1, FALSE, NULL);
   fl_hash_queue = g_hash_table_new(g_direct_hash, g_direct_equal);
   fl_hash_reset = g_cancellable_new();
@@ -1024,8 +1531,12 @@ void fl_init() {
   if(!fl_local_list || !dorefresh)
     ui_m(NULL, UIM_NOLOG|UIM_DIRECT, NULL);
 
+  // Start watching for changes. The refresh will add the watches itself.
+  fl_watch_init();
   if(dorefresh || var_get_int(0, VAR_autorefresh))
     fl_refresh(NULL);
+  else
+    fl_watch_add(fl_local_list);
 }
 
 
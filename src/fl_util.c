@@ -28,7 +28,6 @@
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <libxml/xmlreader.h>
 #include <libxml/xmlwriter.h>
 #include <bzlib.h>
 
@@ -482,41 +481,507 @@ gboolean fl_search_match_full(struct fl_list *fl, struct fl_search *s) {
 
 
 
+// Parallel bzip2 compression and decompression, used by fl_load() and
+// fl_save().
+//
+// bzip2 compresses every block of at most 900k of input independently, the
+// only state shared between the blocks of a stream is the combined CRC in the
+// stream trailer. When compressing, the input is split into chunks that are
+// guaranteed to fit in a single block, each chunk is compressed as a separate
+// stream in a thread pool, and the resulting blocks are bit-concatenated into
+// a single stream again. When decompressing, the block boundaries are found
+// by scanning for the 48-bit block magic, and each block is wrapped into a
+// stream of its own and decompressed in the thread pool. The block magic may
+// also occur by chance within compressed data, so when a block fails to
+// decompress it is retried together with the next one(s).
+
+#define FL_BZ_BLOCKMAGIC G_GUINT64_CONSTANT(0x314159265359)
+#define FL_BZ_EOSMAGIC   G_GUINT64_CONSTANT(0x177245385090)
+
+// Compression level used for saving
+#define FL_BZ_LEVEL 7
+
+// Maximum number of blocks to retry together when a block fails to decompress
+#define FL_BZ_MAXSPAN 4
+
+static GThreadPool *fl_bz_pool = NULL;
+static int fl_bz_threads = 0;
+static GStaticMutex fl_bz_pool_lock = G_STATIC_MUTEX_INIT;
+
+
+struct fl_bz_bits {
+  GString *buf;
+  guint64 acc;
+  int n;
+};
+
+struct fl_bz_job {
+  struct fl_bz *bz;
+  char *in;
+  unsigned int inlen;
+  char *out;
+  unsigned int outlen;
+  guint64 nbits;  // compressing: length of the block in out
+  guint32 crc;    // compressing: CRC of the block
+  int mark, end;  // decompressing: indices of the marks this block starts and ends at
+  gboolean done, ok;
+};
+
+struct fl_bz {
+  GMutex *lock;
+  GCond *cond;    // signalled when a job is done
+  GQueue *jobs;   // jobs in progress, in stream order
+  gboolean write;
+  // Compressing
+  FILE *f;
+  GString *chunk;
+  int chunksize;
+  struct fl_bz_bits bits;
+  guint32 crc;
+  gboolean err;
+  // Decompressing
+  guchar *data;
+  gsize len;
+  GArray *marks;  // bit positions of all block and end-of-stream magics
+  int next;       // next mark to create a job for
+  struct fl_bz_job *cur;
+  unsigned int curpos;
+};
+
+
+static void fl_bz_put(struct fl_bz_bits *b, int n, guint32 v) {
+  b->acc = (b->acc << n) | (v & ((G_GUINT64_CONSTANT(1) << n) - 1));
+  b->n += n;
+  while(b->n >= 8) {
+    b->n -= 8;
+    g_string_append_c(b->buf, (b->acc >> b->n) & 0xFF);
+  }
+}
+
+
+// Reads n (<= 32) bits starting at bit position pos.
+static guint32 fl_bz_get(const guchar *s, guint64 pos, int n) {
+  const guchar *p = s + pos/8;
+  int bits = (pos & 7) + n;
+  guint64 v = 0;
+  int i;
+  for(i=0; i<bits; i+=8)
+    v = (v << 8) | *(p++);
+  return (v >> (i - bits)) & ((G_GUINT64_CONSTANT(1) << n) - 1);
+}
+
+
+static guint64 fl_bz_get48(const guchar *s, guint64 pos) {
+  return ((guint64)fl_bz_get(s, pos, 16) << 32) | fl_bz_get(s, pos+16, 32);
+}
+
+
+static void fl_bz_copy(struct fl_bz_bits *b, const guchar *s, guint64 pos, guint64 n) {
+  for(; n>=32; n-=32, pos+=32)
+    fl_bz_put(b, 32, fl_bz_get(s, pos, 32));
+  if(n > 0)
+    fl_bz_put(b, n, fl_bz_get(s, pos, n));
+}
+
+
+static void fl_bz_job_free(struct fl_bz_job *j) {
+  g_free(j->in);
+  g_free(j->out);
+  g_slice_free(struct fl_bz_job, j);
+}
+
+
+static gboolean fl_bz_compress(struct fl_bz_job *j) {
+  j->outlen = j->inlen + j->inlen/100 + 600;
+  j->out = g_malloc(j->outlen);
+  if(BZ2_bzBuffToBuffCompress(j->out, &j->outlen, j->in, j->inlen, FL_BZ_LEVEL, 0, 0) != BZ_OK)
+    return FALSE;
+
+  // The block starts right after the 32-bit stream header and its magic is
+  // followed by the block CRC. The stream ends with the end-of-stream magic,
+  // the stream CRC (which equals the block CRC when there is only one block)
+  // and 0-7 bits of padding.
+  const guchar *out = (guchar *)j->out;
+  guint64 total = (guint64)j->outlen*8;
+  j->crc = fl_bz_get(out, 32+48, 32);
+  int pad;
+  for(pad=0; pad<8; pad++) {
+    guint64 end = total - pad - 80;
+    if(fl_bz_get48(out, end) == FL_BZ_EOSMAGIC && fl_bz_get(out, end+48, 32) == j->crc) {
+      j->nbits = end - 32;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+
+static gboolean fl_bz_decompress(struct fl_bz_job *j) {
+  bz_stream s = {};
+  if(BZ2_bzDecompressInit(&s, 0, 0) != BZ_OK)
+    return FALSE;
+  unsigned int size = MAX(j->inlen*8, 64*1024);
+  j->out = g_malloc(size);
+  s.next_in = j->in;
+  s.avail_in = j->inlen;
+  int r;
+  do {
+    if(j->outlen == size) {
+      size *= 2;
+      j->out = g_realloc(j->out, size);
+    }
+    s.next_out = j->out + j->outlen;
+    s.avail_out = size - j->outlen;
+    r = BZ2_bzDecompress(&s);
+    j->outlen = size - s.avail_out;
+  } while(r == BZ_OK && (s.avail_in > 0 || s.avail_out == 0));
+  BZ2_bzDecompressEnd(&s);
+  return r == BZ_STREAM_END;
+}
+
+
+static void fl_bz_thread(gpointer dat, gpointer udat) {
+  struct fl_bz_job *j = dat;
+  gboolean ok = j->bz->write ? fl_bz_compress(j) : fl_bz_decompress(j);
+  g_mutex_lock(j->bz->lock);
+  j->ok = ok;
+  j->done = TRUE;
+  g_cond_broadcast(j->bz->cond);
+  g_mutex_unlock(j->bz->lock);
+}
+
+
+static struct fl_bz *fl_bz_new(gboolean write) {
+  g_static_mutex_lock(&fl_bz_pool_lock);
+  if(!fl_bz_pool) {
+    fl_bz_threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+    fl_bz_pool = g_thread_pool_new(fl_bz_thread, NULL, fl_bz_threads, FALSE, NULL);
+  }
+  g_static_mutex_unlock(&fl_bz_pool_lock);
+
+  struct fl_bz *bz = g_slice_new0(struct fl_bz);
+  bz->lock = g_mutex_new();
+  bz->cond = g_cond_new();
+  bz->jobs = g_queue_new();
+  bz->write = write;
+  return bz;
+}
+
+
+static void fl_bz_push(struct fl_bz *bz, struct fl_bz_job *j) {
+  j->bz = bz;
+  g_queue_push_tail(bz->jobs, j);
+  g_thread_pool_push(fl_bz_pool, j, NULL);
+}
+
+
+// Returns the first job in the queue, waiting for it to finish if necessary.
+static struct fl_bz_job *fl_bz_pop(struct fl_bz *bz) {
+  struct fl_bz_job *j = g_queue_pop_head(bz->jobs);
+  if(j) {
+    g_mutex_lock(bz->lock);
+    while(!j->done)
+      g_cond_wait(bz->cond, bz->lock);
+    g_mutex_unlock(bz->lock);
+  }
+  return j;
+}
+
+
+static void fl_bz_free(struct fl_bz *bz) {
+  struct fl_bz_job *j;
+  while((j = fl_bz_pop(bz)) != NULL)
+    fl_bz_job_free(j);
+  if(bz->cur)
+    fl_bz_job_free(bz->cur);
+  if(bz->chunk)
+    g_string_free(bz->chunk, TRUE);
+  if(bz->bits.buf)
+    g_string_free(bz->bits.buf, TRUE);
+  if(bz->marks)
+    g_array_free(bz->marks, TRUE);
+  g_free(bz->data);
+  g_queue_free(bz->jobs);
+  g_mutex_free(bz->lock);
+  g_cond_free(bz->cond);
+  g_slice_free(struct fl_bz, bz);
+}
+
+
+static struct fl_bz *fl_bz_write_open(FILE *f) {
+  struct fl_bz *bz = fl_bz_new(TRUE);
+  bz->f = f;
+  // bzip2 run-length encodes its input before the block sorting, which may
+  // grow the data by at most 5/4. Chunks of this size always fit in a single
+  // block.
+  bz->chunksize = (FL_BZ_LEVEL*100000 - 19) / 5 * 4;
+  bz->chunk = g_string_sized_new(bz->chunksize);
+  bz->bits.buf = g_string_sized_new(bz->chunksize);
+  g_string_append_printf(bz->bits.buf, "BZh%d", FL_BZ_LEVEL);
+  return bz;
+}
+
+
+// Writes the blocks of finished jobs to the file. If all is FALSE, this only
+// waits for jobs when there are too many of them in progress.
+static void fl_bz_write_blocks(struct fl_bz *bz, gboolean all) {
+  while(all ? !g_queue_is_empty(bz->jobs) : g_queue_get_length(bz->jobs) > 2*fl_bz_threads) {
+    struct fl_bz_job *j = fl_bz_pop(bz);
+    if(!j->ok)
+      bz->err = TRUE;
+    if(!bz->err) {
+      bz->crc = ((bz->crc << 1) | (bz->crc >> 31)) ^ j->crc;
+      fl_bz_copy(&bz->bits, (guchar *)j->out, 32, j->nbits);
+    }
+    fl_bz_job_free(j);
+  }
+  if(!bz->err && bz->bits.buf->len > 0) {
+    if(fwrite(bz->bits.buf->str, 1, bz->bits.buf->len, bz->f) != bz->bits.buf->len)
+      bz->err = TRUE;
+    g_string_truncate(bz->bits.buf, 0);
+  }
+}
+
+
+static void fl_bz_write_chunk(struct fl_bz *bz) {
+  struct fl_bz_job *j = g_slice_new0(struct fl_bz_job);
+  j->inlen = bz->chunk->len;
+  j->in = g_string_free(bz->chunk, FALSE);
+  bz->chunk = g_string_sized_new(bz->chunksize);
+  fl_bz_push(bz, j);
+}
+
+
+static gboolean fl_bz_write(struct fl_bz *bz, const char *buf, int len) {
+  while(len > 0) {
+    int n = MIN(len, bz->chunksize - bz->chunk->len);
+    g_string_append_len(bz->chunk, buf, n);
+    buf += n;
+    len -= n;
+    if(bz->chunk->len >= bz->chunksize) {
+      fl_bz_write_chunk(bz);
+      fl_bz_write_blocks(bz, FALSE);
+    }
+  }
+  return !bz->err;
+}
+
+
+// Flushes all data, writes the stream trailer and frees the struct. Does not
+// close the file.
+static gboolean fl_bz_write_close(struct fl_bz *bz) {
+  if(bz->chunk->len > 0)
+    fl_bz_write_chunk(bz);
+  fl_bz_write_blocks(bz, TRUE);
+  fl_bz_put(&bz->bits, 24, FL_BZ_EOSMAGIC >> 24);
+  fl_bz_put(&bz->bits, 24, FL_BZ_EOSMAGIC & 0xFFFFFF);
+  fl_bz_put(&bz->bits, 32, bz->crc);
+  if(bz->bits.n > 0)
+    fl_bz_put(&bz->bits, 8 - bz->bits.n, 0);
+  fl_bz_write_blocks(bz, TRUE);
+  gboolean ok = !bz->err;
+  fl_bz_free(bz);
+  return ok;
+}
+
+
+// Reads the entire (compressed) file and locates the blocks.
+static struct fl_bz *fl_bz_read_open(FILE *f, GError **err) {
+  GString *data = g_string_new("");
+  char buf[64*1024];
+  int r;
+  while((r = fread(buf, 1, sizeof(buf), f)) > 0)
+    g_string_append_len(data, buf, r);
+  if(ferror(f)) {
+    g_set_error(err, 1, 0, "Read error: %s", g_strerror(errno));
+    g_string_free(data, TRUE);
+    return NULL;
+  }
+  if(data->len < 4 || strncmp(data->str, "BZh", 3) != 0 || data->str[3] < '1' || data->str[3] > '9') {
+    g_set_error(err, 1, 0, "bzip2 decompression error. (%d)", BZ_DATA_ERROR_MAGIC);
+    g_string_free(data, TRUE);
+    return NULL;
+  }
+
+  struct fl_bz *bz = fl_bz_new(FALSE);
+  bz->len = data->len;
+  bz->data = (guchar *)g_string_free(data, FALSE);
+  bz->marks = g_array_new(FALSE, FALSE, sizeof(guint64));
+
+  // Check all 8 bit alignments of the last 48 bits after every byte.
+  guint64 w = 0;
+  gsize i;
+  int k;
+  for(i=0; i<bz->len; i++) {
+    w = (w << 8) | bz->data[i];
+    for(k=7; k>=0; k--) {
+      guint64 m = (w >> k) & G_GUINT64_CONSTANT(0xFFFFFFFFFFFF);
+      if((m == FL_BZ_BLOCKMAGIC || m == FL_BZ_EOSMAGIC) && (i+1)*8 - k >= 48) {
+        guint64 pos = (i+1)*8 - k - 48;
+        g_array_append_val(bz->marks, pos);
+      }
+    }
+  }
+  return bz;
+}
+
+
+// Creates a job for the block starting at the given mark and ending at the
+// span'th mark after it.
+static struct fl_bz_job *fl_bz_read_job(struct fl_bz *bz, int mark, int span) {
+  struct fl_bz_job *j = g_slice_new0(struct fl_bz_job);
+  guint64 start = g_array_index(bz->marks, guint64, mark);
+  guint64 end = mark+span < bz->marks->len ? g_array_index(bz->marks, guint64, mark+span) : bz->len*8;
+  j->mark = mark;
+  j->end = MIN(mark+span, bz->marks->len);
+  if(end - start < 80) {
+    j->done = TRUE;
+    return j;
+  }
+
+  // A stream consisting of a single block has the block CRC as stream CRC.
+  struct fl_bz_bits b = { g_string_sized_new((end-start)/8 + 16) };
+  fl_bz_put(&b, 32, ('B'<<24) | ('Z'<<16) | ('h'<<8) | '9');
+  fl_bz_copy(&b, bz->data, start, end-start);
+  fl_bz_put(&b, 24, FL_BZ_EOSMAGIC >> 24);
+  fl_bz_put(&b, 24, FL_BZ_EOSMAGIC & 0xFFFFFF);
+  fl_bz_put(&b, 32, fl_bz_get(bz->data, start+48, 32));
+  if(b.n > 0)
+    fl_bz_put(&b, 8 - b.n, 0);
+  j->inlen = b.buf->len;
+  j->in = g_string_free(b.buf, FALSE);
+  return j;
+}
+
+
+// Returns the index of the first block magic at or after the given mark.
+static int fl_bz_read_nextblock(struct fl_bz *bz, int mark) {
+  for(; mark<bz->marks->len; mark++)
+    if(fl_bz_get48(bz->data, g_array_index(bz->marks, guint64, mark)) == FL_BZ_BLOCKMAGIC)
+      break;
+  return mark;
+}
+
+
+static int fl_bz_read(struct fl_bz *bz, char *buf, int len, GError **err) {
+  while(!bz->cur || bz->curpos >= bz->cur->outlen) {
+    if(bz->cur)
+      fl_bz_job_free(bz->cur);
+    bz->cur = NULL;
+
+    // Keep the thread pool busy
+    while(g_queue_get_length(bz->jobs) < 2*fl_bz_threads
+        && (bz->next = fl_bz_read_nextblock(bz, bz->next)) < bz->marks->len) {
+      struct fl_bz_job *j = fl_bz_read_job(bz, bz->next, 1);
+      bz->next = j->end;
+      if(j->done) {
+        j->bz = bz;
+        g_queue_push_tail(bz->jobs, j);
+      } else
+        fl_bz_push(bz, j);
+    }
+
+    struct fl_bz_job *j = fl_bz_pop(bz);
+    if(!j)
+      return 0;
+
+    // Retry with the next block(s) included, after discarding the jobs for
+    // those.
+    int span = 1;
+    int mark = j->mark;
+    while(!j->ok && span < FL_BZ_MAXSPAN) {
+      struct fl_bz_job *n;
+      while((n = fl_bz_pop(bz)) != NULL)
+        fl_bz_job_free(n);
+      fl_bz_job_free(j);
+      j = fl_bz_read_job(bz, mark, ++span);
+      if(!j->done)
+        j->ok = fl_bz_decompress(j);
+      bz->next = j->end;
+    }
+    if(!j->ok) {
+      g_set_error(err, 1, 0, "bzip2 decompression error. (%d)", BZ_DATA_ERROR);
+      fl_bz_job_free(j);
+      return -1;
+    }
+    bz->cur = j;
+    bz->curpos = 0;
+  }
+
+  int n = MIN(len, bz->cur->outlen - bz->curpos);
+  memcpy(buf, bz->cur->out + bz->curpos, n);
+  bz->curpos += n;
+  return n;
+}
+
+
+
+
 // Internal structure used by fl_load() and fl_save()
 
 struct fl_loadsave_context {
   char *file;     // some name, for debugging purposes
-  BZFILE *fh_bz;  // if BZ2 compression is enabled (implies fh_h!=NULL)
+  struct fl_bz *bz; // if BZ2 compression is enabled (implies fh_h!=NULL)
   FILE *fh_f;     // if we're working with a file
   GString *buf;   // if we're working with a buffer (only fl_save() supports this)
   GError **err;
   gboolean stream_end;
+  gboolean *closeok; // fl_save(): set to FALSE if flushing the file failed
 };
 
 
 
 
 // Read filelist from an xml file
+//
+// This is a small streaming parser that understands just enough XML to read
+// the file lists generated by DC clients. The (decompressed) input is read
+// into a single buffer in large chunks, tags are tokenized within that buffer
+// and attribute values are unescaped in-place, so nothing is copied until the
+// name ends up in its fl_list node. The items of all open directories are
+// collected on a single stack, and are moved into a GPtrArray of the exact
+// size and sorted only once, when their directory is closed.
+
+
+#define FL_LOAD_BUFSIZE (128*1024)
+#define FL_LOAD_MAXBUF  (16*1024*1024)
+#define FL_LOAD_MAXATTR 16
+
+struct fl_load_attr {
+  const char *name;
+  int namelen;
+  char *val;
+  char *valend;
+};
 
+struct fl_load_ctx {
+  struct fl_loadsave_context *xc;
+  char *buf;
+  int size, len, pos;
+  int line;
+  gboolean local, havefl, done;
+  int unknown;        // nesting level within unknown elements
+  GPtrArray *items;   // pending items of all open directories
+  GPtrArray *dirs;    // open directories, dirs[0] = root
+  GArray *starts;     // index into items of the first item of each open directory
+  struct fl_load_attr attr[FL_LOAD_MAXATTR];
+  int nattr;
+};
 
-static int fl_load_input(void *context, char *buf, int len) {
-  struct fl_loadsave_context *xc = context;
+
+static int fl_load_input(struct fl_loadsave_context *xc, char *buf, int len) {
   if(xc->stream_end)
     return 0;
-  int bzerr;
-  if(xc->fh_bz) {
-    int r = BZ2_bzRead(&bzerr, xc->fh_bz, buf, len);
-    if(bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
-      g_set_error(xc->err, 1, 0, "bzip2 decompression error. (%d)", bzerr);
-      return -1;
-    } else {
-      xc->stream_end = bzerr == BZ_STREAM_END;
-      return r;
-    }
+  if(xc->bz) {
+    int r = fl_bz_read(xc->bz, buf, len, xc->err);
+    xc->stream_end = r <= 0;
+    return r;
   } else if(xc->fh_f) {
     int r = fread(buf, 1, len, xc->fh_f);
-    if(r < 0)
+    if(r <= 0 && ferror(xc->fh_f)) {
       g_set_error(xc->err, 1, 0, "Read error: %s", g_strerror(errno));
+      return -1;
+    }
     xc->stream_end = r <= 0;
     return r;
   } else
@@ -524,115 +989,343 @@ static int fl_load_input(void *context, char *buf, int len) {
 }
 
 
-static int fl_load_close(void *context) {
-  struct fl_loadsave_context *xc = context;
-  int bzerr;
-  if(xc->fh_bz)
-    BZ2_bzReadClose(&bzerr, xc->fh_bz);
+static void fl_load_close(struct fl_loadsave_context *xc) {
+  if(xc->bz)
+    fl_bz_free(xc->bz);
   fclose(xc->fh_f);
   g_free(xc->file);
   g_slice_free(struct fl_loadsave_context, xc);
-  return 0;
 }
 
 
-static void fl_load_error(void *arg, const char *msg, xmlParserSeverities severity, xmlTextReaderLocatorPtr locator) {
-  struct fl_loadsave_context *xc = arg;
-  if(severity == XML_PARSER_SEVERITY_VALIDITY_WARNING || severity == XML_PARSER_SEVERITY_WARNING)
-    g_warning("XML parse warning in %s line %d: %s", xc->file, xmlTextReaderLocatorLineNumber(locator), msg);
-  else if(xc->err && !*(xc->err))
-    g_set_error(xc->err, 1, 0, "XML parse error on input line %d: %s", xmlTextReaderLocatorLineNumber(locator), msg);
-}
-
-
-static int fl_load_handle(xmlTextReaderPtr reader, gboolean *havefl, gboolean *newdir, struct fl_list **cur, gboolean local) {
-  struct fl_list *tmp;
-  char *attr[3];
-  char name[50], *tmpname;
-
-  tmpname = (char *)xmlTextReaderName(reader);
-  strncpy(name, tmpname, 50);
-  name[49] = 0;
-  free(tmpname);
-
-  switch(xmlTextReaderNodeType(reader)) {
-
-  case XML_READER_TYPE_ELEMENT:
-    // <FileListing ..>
-    // We ignore its attributes (for now)
-    if(strcmp(name, "FileListing") == 0) {
-      if(*havefl)
-        return -1;
-      *havefl = TRUE;
-    // <Directory ..>
-    } else if(strcmp(name, "Directory") == 0) {
-      if(!*havefl)
-        return -1;
-      if(!(attr[0] = (char *)xmlTextReaderGetAttribute(reader, (xmlChar *)"Name")))
-        return -1;
-      attr[1] = (char *)xmlTextReaderGetAttribute(reader, (xmlChar *)"Incomplete");
-      if(attr[1] && strcmp(attr[1], "0") != 0 && strcmp(attr[1], "1") != 0) {
-        free(attr[0]);
-        return -1;
-      }
-      tmp = fl_list_create(attr[0], FALSE);
-      tmp->isfile = FALSE;
-      tmp->sub = g_ptr_array_new_with_free_func(fl_list_free);
-      fl_list_add(*newdir ? *cur : (*cur)->parent, tmp, -1);
-      *cur = tmp;
-      *newdir = !xmlTextReaderIsEmptyElement(reader);
-      free(attr[0]);
-      free(attr[1]);
-    // <File .. />
-    } else if(strcmp(name, "File") == 0) {
-      if(!*havefl || !xmlTextReaderIsEmptyElement(reader))
-        return -1;
-      if(!(attr[0] = (char *)xmlTextReaderGetAttribute(reader, (xmlChar *)"Name")))
-        return -1;
-      attr[1] = (char *)xmlTextReaderGetAttribute(reader, (xmlChar *)"Size");
-      if(!attr[1] || strspn(attr[1], "0123456789") != strlen(attr[1])) {
-        free(attr[0]);
-        return -1;
-      }
-      attr[2] = (char *)xmlTextReaderGetAttribute(reader, (xmlChar *)"TTH");
-      if(!attr[2] || !istth(attr[2])) {
-        free(attr[0]);
-        free(attr[1]);
-        return -1;
-      }
-      tmp = fl_list_create(attr[0], local);
-      tmp->isfile = TRUE;
-      tmp->size = g_ascii_strtoull(attr[1], NULL, 10);
-      tmp->hastth = TRUE;
-      base32_decode(attr[2], tmp->tth);
-      fl_list_add(*newdir ? *cur : (*cur)->parent, tmp, -1);
-      *cur = tmp;
-      *newdir = FALSE;
-      free(attr[0]);
-      free(attr[1]);
-      free(attr[2]);
+static void fl_load_error(struct fl_load_ctx *c, const char *fmt, ...) {
+  if(!c->xc->err || *(c->xc->err))
+    return;
+  va_list va;
+  va_start(va, fmt);
+  char *msg = g_strdup_vprintf(fmt, va);
+  va_end(va);
+  g_set_error(c->xc->err, 1, 0, "XML parse error on input line %d: %s", c->line, msg);
+  g_free(msg);
+}
+
+
+static int fl_load_lines(const char *s, const char *end) {
+  int n = 0;
+  while((s = memchr(s, '\n', end-s)) != NULL) {
+    n++;
+    s++;
+  }
+  return n;
+}
+
+
+// Unescapes an attribute value in-place, including the whitespace
+// normalization required by XML. Returns FALSE on an invalid entity.
+static gboolean fl_load_unescape(char *str) {
+  char *s = str + strcspn(str, "&\t\n\r");
+  char *d = s;
+  while(*s) {
+    if(*s == '\t' || *s == '\n' || *s == '\r') {
+      *(d++) = ' ';
+      s++;
+      continue;
     }
-    break;
-
-  case XML_READER_TYPE_END_ELEMENT:
-    // </Directory>
-    if(strcmp(name, "Directory") == 0) {
-      if(!*newdir)
-        *cur = (*cur)->parent;
-      else
-        *newdir = FALSE;
-      fl_list_sort(*cur);
-    // </FileListing>
-    } else if(strcmp(name, "FileListing") == 0) {
-      return 0; // stop reading
+    if(*s != '&') {
+      *(d++) = *(s++);
+      continue;
     }
-    break;
+    char *e = strchr(++s, ';');
+    if(!e)
+      return FALSE;
+    if(*s == '#') {
+      gboolean hex = s[1] == 'x';
+      char *n;
+      if(!(hex ? g_ascii_isxdigit(s[2]) : g_ascii_isdigit(s[1])))
+        return FALSE;
+      gulong v = strtoul(s+(hex?2:1), &n, hex?16:10);
+      if(n != e || !v || v > 0x10FFFF || !g_unichar_validate(v))
+        return FALSE;
+      d += g_unichar_to_utf8(v, d);
+    } else if(e-s == 2 && strncmp(s, "lt", 2) == 0)
+      *(d++) = '<';
+    else if(e-s == 2 && strncmp(s, "gt", 2) == 0)
+      *(d++) = '>';
+    else if(e-s == 3 && strncmp(s, "amp", 3) == 0)
+      *(d++) = '&';
+    else if(e-s == 4 && strncmp(s, "quot", 4) == 0)
+      *(d++) = '"';
+    else if(e-s == 4 && strncmp(s, "apos", 4) == 0)
+      *(d++) = '\'';
+    else
+      return FALSE;
+    s = e+1;
   }
-  return 1;
+  *d = 0;
+  return TRUE;
 }
 
 
-static xmlTextReaderPtr fl_load_open(const char *file, GError **err) {
+// Returns the (unescaped) value of an attribute of the current element, or
+// NULL if it isn't present or invalid.
+static char *fl_load_attr(struct fl_load_ctx *c, const char *name) {
+  int i, len = strlen(name);
+  for(i=0; i<c->nattr; i++)
+    if(c->attr[i].namelen == len && strncmp(c->attr[i].name, name, len) == 0) {
+      if(fl_load_unescape(c->attr[i].val))
+        return c->attr[i].val;
+      fl_load_error(c, "Invalid entity reference in %s attribute.", name);
+      return NULL;
+    }
+  return NULL;
+}
+
+
+// Moves the pending items of the last opened directory into the directory
+// itself.
+static void fl_load_closedir(struct fl_load_ctx *c) {
+  struct fl_list *dir = g_ptr_array_index(c->dirs, c->dirs->len-1);
+  int i, start = g_array_index(c->starts, int, c->starts->len-1);
+  int n = c->items->len - start;
+
+  dir->sub = g_ptr_array_sized_new(n);
+  g_ptr_array_set_free_func(dir->sub, fl_list_free);
+  for(i=0; i<n; i++) {
+    struct fl_list *f = g_ptr_array_index(c->items, start+i);
+    f->parent = dir;
+    dir->size += f->size;
+    g_ptr_array_add(dir->sub, f);
+  }
+  fl_list_sort(dir);
+
+  g_ptr_array_set_size(c->items, start);
+  g_ptr_array_set_size(c->dirs, c->dirs->len-1);
+  g_array_set_size(c->starts, c->starts->len-1);
+  if(c->dirs->len)
+    g_ptr_array_add(c->items, dir);
+}
+
+
+#define fl_load_is(n, l, s) ((l) == sizeof(s)-1 && strncmp(n, s, sizeof(s)-1) == 0)
+
+static gboolean fl_load_start(struct fl_load_ctx *c, const char *name, int len, gboolean empty) {
+  if(c->unknown) {
+    if(!empty)
+      c->unknown++;
+    return TRUE;
+  }
+
+  // <FileListing ..>
+  // We ignore its attributes (for now)
+  if(fl_load_is(name, len, "FileListing")) {
+    if(c->havefl) {
+      fl_load_error(c, "Nested <FileListing> element.");
+      return FALSE;
+    }
+    c->havefl = TRUE;
+    if(empty) {
+      fl_load_closedir(c);
+      c->done = TRUE;
+    }
+
+  // <Directory ..>
+  } else if(fl_load_is(name, len, "Directory")) {
+    char *dname = fl_load_attr(c, "Name");
+    char *incomplete = fl_load_attr(c, "Incomplete");
+    if(!c->havefl || !dname || !g_utf8_validate(dname, -1, NULL)
+        || (incomplete && strcmp(incomplete, "0") != 0 && strcmp(incomplete, "1") != 0)) {
+      fl_load_error(c, "Invalid <Directory> element.");
+      return FALSE;
+    }
+    struct fl_list *dir = fl_list_create(dname, FALSE);
+    if(empty) {
+      dir->sub = g_ptr_array_new_with_free_func(fl_list_free);
+      g_ptr_array_add(c->items, dir);
+    } else {
+      g_ptr_array_add(c->dirs, dir);
+      g_array_append_val(c->starts, c->items->len);
+    }
+
+  // <File .. />
+  } else if(fl_load_is(name, len, "File")) {
+    char *fname = fl_load_attr(c, "Name");
+    char *size = fl_load_attr(c, "Size");
+    char *tth = fl_load_attr(c, "TTH");
+    if(!c->havefl || !empty || !fname || !g_utf8_validate(fname, -1, NULL)
+        || !size || strspn(size, "0123456789") != strlen(size) || !tth || !istth(tth)) {
+      fl_load_error(c, "Invalid <File> element.");
+      return FALSE;
+    }
+    struct fl_list *f = fl_list_create(fname, c->local);
+    f->isfile = TRUE;
+    f->size = g_ascii_strtoull(size, NULL, 10);
+    f->hastth = TRUE;
+    base32_decode(tth, f->tth);
+    g_ptr_array_add(c->items, f);
+
+  } else if(!empty)
+    c->unknown++;
+  return TRUE;
+}
+
+
+static gboolean fl_load_end(struct fl_load_ctx *c, const char *name, int len) {
+  if(c->unknown) {
+    c->unknown--;
+    return TRUE;
+  }
+  // </Directory>
+  if(fl_load_is(name, len, "Directory") && c->dirs->len > 1)
+    fl_load_closedir(c);
+  // </FileListing>
+  else if(fl_load_is(name, len, "FileListing") && c->havefl && c->dirs->len == 1) {
+    fl_load_closedir(c);
+    c->done = TRUE; // stop reading
+  } else {
+    fl_load_error(c, "Unexpected end tag </%.*s>.", MIN(len, 50), name);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+#undef fl_load_is
+
+
+// Finds the end of a comment, processing instruction or CDATA section: the
+// first '>' preceded by the given terminator.
+static char *fl_load_find(char *s, char *end, const char *term) {
+  int len = strlen(term);
+  char *p = s;
+  while((p = memchr(p, '>', end-p)) != NULL) {
+    if(p-s >= len && strncmp(p-len, term, len) == 0)
+      return p;
+    p++;
+  }
+  return NULL;
+}
+
+
+// Parses the next token in the buffer. Returns 1 if a token has been
+// consumed, 0 when more data is needed and -1 on error.
+static int fl_load_token(struct fl_load_ctx *c) {
+#define isws(x) ((x) == ' ' || (x) == '\t' || (x) == '\n' || (x) == '\r')
+  char *s = c->buf + c->pos;
+  char *end = c->buf + c->len;
+  char *p;
+
+  if(s >= end)
+    return 0;
+
+  // Text between tags, ignored.
+  if(*s != '<') {
+    p = memchr(s, '<', end-s);
+    if(!p)
+      p = end;
+    c->line += fl_load_lines(s, p);
+    c->pos = p - c->buf;
+    return p < end ? 1 : 0;
+  }
+
+  if(end-s < 4)
+    return 0;
+
+  // Comments, processing instructions, CDATA sections and DOCTYPE, ignored.
+  if(s[1] == '?' || s[1] == '!') {
+    if(strncmp(s, "<!--", 4) == 0)
+      p = fl_load_find(s+4, end, "--");
+    else if(s[1] == '?')
+      p = fl_load_find(s+2, end, "?");
+    else if(end-s < 9)
+      return 0;
+    else if(strncmp(s, "<![CDATA[", 9) == 0)
+      p = fl_load_find(s+9, end, "]]");
+    else
+      p = memchr(s, '>', end-s);
+    if(!p)
+      return 0;
+    c->line += fl_load_lines(s, p);
+    c->pos = p+1 - c->buf;
+    return 1;
+  }
+
+  // End tag
+  if(s[1] == '/') {
+    if(!(p = memchr(s, '>', end-s)))
+      return 0;
+    c->line += fl_load_lines(s, p);
+    c->pos = p+1 - c->buf;
+    char *name = s+2;
+    while(p > name && isws(p[-1]))
+      p--;
+    return fl_load_end(c, name, p-name) ? 1 : -1;
+  }
+
+  // Start tag
+  char *name = s+1;
+  gboolean empty = FALSE;
+  for(p=name; p<end && !isws(*p) && *p != '/' && *p != '>'; p++)
+    ;
+  int namelen = p-name;
+  c->nattr = 0;
+  while(1) {
+    while(p<end && isws(*p))
+      p++;
+    if(p >= end)
+      return 0;
+    if(*p == '>')
+      break;
+    if(*p == '/') {
+      if(p+1 >= end)
+        return 0;
+      if(p[1] != '>')
+        break;
+      empty = TRUE;
+      p++;
+      break;
+    }
+    // Attribute
+    struct fl_load_attr *a = c->attr + (c->nattr < FL_LOAD_MAXATTR ? c->nattr++ : FL_LOAD_MAXATTR-1);
+    a->name = p;
+    while(p<end && !isws(*p) && *p != '=' && *p != '>' && *p != '/')
+      p++;
+    a->namelen = p - a->name;
+    while(p<end && isws(*p))
+      p++;
+    if(p+1 >= end)
+      return 0;
+    if(*p != '=' || !a->namelen)
+      break;
+    p++;
+    while(p<end && isws(*p))
+      p++;
+    if(p >= end)
+      return 0;
+    if(*p != '"' && *p != '\'')
+      break;
+    a->val = p+1;
+    if(!(p = memchr(a->val, *p, end-a->val)))
+      return 0;
+    a->valend = p++;
+  }
+  if(*p != '>' || !namelen) {
+    c->line += fl_load_lines(s, p);
+    fl_load_error(c, "Malformed start tag.");
+    return -1;
+  }
+  c->line += fl_load_lines(s, p);
+  c->pos = p+1 - c->buf;
+
+  // NUL-terminate the attribute values by overwriting their closing quote.
+  int i;
+  for(i=0; i<c->nattr; i++)
+    *(c->attr[i].valend) = 0;
+  return fl_load_start(c, name, namelen, empty) ? 1 : -1;
+#undef isws
+}
+
+
+struct fl_list *fl_load(const char *file, GError **err, gboolean local) {
+  g_return_val_if_fail(err == NULL || *err == NULL, NULL);
   gboolean isbz2 = strlen(file) > 4 && strcmp(file+(strlen(file)-4), ".bz2") == 0;
 
   // open file
@@ -643,79 +1336,278 @@ static xmlTextReaderPtr fl_load_open(const char *file, GError **err) {
   }
 
   // open BZ2 decompression
-  BZFILE *bzf = NULL;
-  if(isbz2) {
-    int bzerr;
-    bzf = BZ2_bzReadOpen(&bzerr, f, 0, 0, NULL, 0);
-    if(bzerr != BZ_OK) {
-      g_set_error(err, 1, 0, "Unable to open BZ2 file (%d)", bzerr);
-      fclose(f);
-      return NULL;
-    }
+  struct fl_bz *bz = NULL;
+  if(isbz2 && !(bz = fl_bz_read_open(f, err))) {
+    fclose(f);
+    return NULL;
   }
 
-  // create reader
   struct fl_loadsave_context *xc = g_slice_new0(struct fl_loadsave_context);
   xc->err = err;
   xc->file = g_strdup(file);
   xc->fh_f = f;
-  xc->fh_bz = bzf;
-  xmlTextReaderPtr reader = xmlReaderForIO(fl_load_input, fl_load_close, xc, NULL, NULL, XML_PARSE_NOENT);
+  xc->bz = bz;
+
+  struct fl_load_ctx c = {};
+  c.xc = xc;
+  c.local = local;
+  c.line = 1;
+  c.size = FL_LOAD_BUFSIZE;
+  c.buf = g_malloc(c.size);
+  c.items = g_ptr_array_new();
+  c.dirs = g_ptr_array_new();
+  c.starts = g_array_new(FALSE, FALSE, sizeof(int));
+
+  struct fl_list *root = fl_list_create("", FALSE);
+  g_ptr_array_add(c.dirs, root);
+  g_array_append_val(c.starts, c.items->len);
 
-  if(!reader) {
-    fl_load_close(xc);
-    if(err && !*err)
-      g_set_error_literal(err, 1, 0, "Failed to open file.");
-    return NULL;
+  // parse & read
+  int r = 0;
+  while(!c.done) {
+    while(!c.done && (r = fl_load_token(&c)) > 0)
+      ;
+    if(c.done || r < 0)
+      break;
+
+    // Move the incomplete token to the start of the buffer and read more data
+    if(c.pos > 0) {
+      memmove(c.buf, c.buf+c.pos, c.len-c.pos);
+      c.len -= c.pos;
+      c.pos = 0;
+    }
+    if(c.len == c.size) {
+      if(c.size >= FL_LOAD_MAXBUF) {
+        fl_load_error(&c, "Token too long.");
+        r = -1;
+        break;
+      }
+      c.size *= 2;
+      c.buf = g_realloc(c.buf, c.size);
+    }
+    if((r = fl_load_input(xc, c.buf+c.len, c.size-c.len)) < 0)
+      break;
+    if(r == 0) {
+      if(err && !*err)
+        g_set_error_literal(err, 1, 0, !c.havefl ? "No <FileListing> tag found." : "Unexpected end of file.");
+      r = -1;
+      break;
+    }
+    c.len += r;
   }
 
-  xmlTextReaderSetErrorHandler(reader, fl_load_error, xc);
-  return reader;
+  // On error, free everything that has been created
+  if(r < 0) {
+    g_ptr_array_foreach(c.items, (GFunc)fl_list_free, NULL);
+    g_ptr_array_foreach(c.dirs, (GFunc)fl_list_free, NULL);
+    root = NULL;
+  }
+
+  g_free(c.buf);
+  g_ptr_array_free(c.items, TRUE);
+  g_ptr_array_free(c.dirs, TRUE);
+  g_array_free(c.starts, TRUE);
+  // close (ignoring errors)
+  fl_load_close(xc);
+  return root;
 }
 
 
-struct fl_list *fl_load(const char *file, GError **err, gboolean local) {
-  g_return_val_if_fail(err == NULL || *err == NULL, NULL);
 
-  // open the file
-  xmlTextReaderPtr reader = fl_load_open(file, err);
-  if(!reader)
-    return NULL;
 
-  // parse & read
-  struct fl_list *cur, *root;
-  gboolean havefl = FALSE, newdir = TRUE;
-  int ret;
 
-  root = fl_list_create("", FALSE);
-  root->sub = g_ptr_array_new_with_free_func(fl_list_free);
-  cur = root;
+// Binary cache of remote file lists
+//
+// Parsing a large file list takes a while, so after a remote list has been
+// loaded a binary representation is written next to it, which is used
+// instead of the XML on subsequent loads for as long as the XML file hasn't
+// changed. The file starts with a header, followed by all nodes of the tree
+// in breadth-first order, followed by the NUL-terminated names. The items of
+// each directory are stored contiguously and in sorted order. The cache is
+// written in native byte order and is only valid on the machine that
+// created it.
 
-  while((ret = xmlTextReaderRead(reader)) == 1)
-    if((ret = fl_load_handle(reader, &havefl, &newdir, &cur, local)) <= 0)
-      break;
+#define FL_CACHE_MAGIC   "ncdcflc"
+#define FL_CACHE_VERSION 1
 
-  if(ret < 0 || !havefl) {
-    if(err && !*err) // rather uninformative error message as fallback
-      g_set_error_literal(err, 1, 0, !havefl ? "No <FileListing> tag found." : "Error parsing or validating XML.");
-    fl_list_free(root);
-    root = NULL;
-  } else
-    fl_list_sort(root);
+struct fl_cache_header {
+  char magic[8];
+  guint32 version;
+  guint32 nodesize;   // sizeof(struct fl_cache_node), also serves as a sanity check
+  guint64 xmlsize;    // size and mtime of the XML file this cache was created from
+  guint64 xmlmtime;
+  guint32 nodes;
+  guint32 namesize;
+};
 
-  // close (ignoring errors)
-  xmlTextReaderClose(reader);
-  xmlFreeTextReader(reader);
+struct fl_cache_node {
+  guint64 size;
+  char tth[24];
+  guint32 name;   // offset into the names
+  guint32 sub;    // directories: index of the first item
+  guint32 nsub;   // directories: number of items
+  guint32 flags;
+};
 
-  return root;
+#define FL_CACHE_ISFILE 1
+#define FL_CACHE_HASTTH 2
+
+
+// Returns the path of the cache for a (remote) file list. "<x>.xml.bz2"
+// becomes "<x>.flc".
+char *fl_cache_path(const char *file) {
+  int len = strlen(file);
+  if(len > 8 && strcmp(file+len-8, ".xml.bz2") == 0)
+    len -= 8;
+  return g_strdup_printf("%.*s.flc", len, file);
 }
 
 
+static gboolean fl_cache_save(struct fl_list *root, const char *file, struct stat *xml) {
+  char *tmpfile = g_strdup_printf("%s.tmp-%d", file, g_random_int());
+  FILE *f = fopen(tmpfile, "w");
+  if(!f) {
+    g_free(tmpfile);
+    return FALSE;
+  }
+
+  // Count the nodes and the size of the names
+  GPtrArray *order = g_ptr_array_new();
+  g_ptr_array_add(order, root);
+  guint64 namesize = 0;
+  int i, j;
+  for(i=0; i<order->len; i++) {
+    struct fl_list *fl = g_ptr_array_index(order, i);
+    namesize += strlen(fl->name)+1;
+    if(!fl->isfile)
+      for(j=0; j<fl->sub->len; j++)
+        g_ptr_array_add(order, g_ptr_array_index(fl->sub, j));
+  }
+
+  struct fl_cache_header h = {};
+  strcpy(h.magic, FL_CACHE_MAGIC);
+  h.version = FL_CACHE_VERSION;
+  h.nodesize = sizeof(struct fl_cache_node);
+  h.xmlsize = xml->st_size;
+  h.xmlmtime = xml->st_mtime;
+  h.nodes = order->len;
+  h.namesize = namesize;
+  gboolean ok = namesize < G_MAXUINT32 && fwrite(&h, sizeof(h), 1, f) == 1;
+
+  // Nodes. The items of the directories are in the same order as they were
+  // added to the array above.
+  guint32 name = 0, sub = 1;
+  for(i=0; ok && i<order->len; i++) {
+    struct fl_list *fl = g_ptr_array_index(order, i);
+    struct fl_cache_node n = {};
+    n.size = fl->size;
+    n.name = name;
+    name += strlen(fl->name)+1;
+    if(fl->isfile) {
+      n.flags = FL_CACHE_ISFILE | (fl->hastth ? FL_CACHE_HASTTH : 0);
+      memcpy(n.tth, fl->tth, 24);
+    } else {
+      n.sub = sub;
+      n.nsub = fl->sub->len;
+      sub += n.nsub;
+    }
+    ok = fwrite(&n, sizeof(n), 1, f) == 1;
+  }
+
+  // Names
+  for(i=0; ok && i<order->len; i++) {
+    struct fl_list *fl = g_ptr_array_index(order, i);
+    ok = fwrite(fl->name, strlen(fl->name)+1, 1, f) == 1;
+  }
+  g_ptr_array_free(order, TRUE);
+
+  if(fclose(f) != 0)
+    ok = FALSE;
+  if(!ok || rename(tmpfile, file) < 0) {
+    g_warning("Unable to write file list cache %s.", file);
+    unlink(tmpfile);
+    ok = FALSE;
+  }
+  g_free(tmpfile);
+  return ok;
+}
+
+
+// Returns NULL if the cache does not exist, is outdated or invalid.
+static struct fl_list *fl_cache_load(const char *file, struct stat *xml) {
+  GMappedFile *map = g_mapped_file_new(file, FALSE, NULL);
+  if(!map)
+    return NULL;
+  const char *buf = g_mapped_file_get_contents(map);
+  gsize len = g_mapped_file_get_length(map);
+
+  const struct fl_cache_header *h = (const struct fl_cache_header *)buf;
+  if(len < sizeof(*h) || memcmp(h->magic, FL_CACHE_MAGIC, 8) != 0 || h->version != FL_CACHE_VERSION
+      || h->nodesize != sizeof(struct fl_cache_node) || h->xmlsize != xml->st_size || h->xmlmtime != xml->st_mtime
+      || h->nodes < 1 || len != sizeof(*h) + (guint64)h->nodes*sizeof(struct fl_cache_node) + h->namesize
+      || h->namesize < 1 || buf[len-1] != 0) {
+    g_mapped_file_unref(map);
+    return NULL;
+  }
+  const struct fl_cache_node *nodes = (const struct fl_cache_node *)(buf + sizeof(*h));
+  const char *names = buf + sizeof(*h) + h->nodes*sizeof(struct fl_cache_node);
+
+  // Create all nodes, then link the directories to their items. Validates
+  // that the items of each directory follow directly after those of the
+  // previous directory, which guarantees that the result is a proper tree.
+  struct fl_list **fl = g_new(struct fl_list *, h->nodes);
+  guint32 i, j, sub = 1;
+  gboolean ok = TRUE;
+  for(i=0; i<h->nodes; i++) {
+    const struct fl_cache_node *n = nodes+i;
+    if(n->name >= h->namesize || (!(n->flags & FL_CACHE_ISFILE) && (n->sub != sub || n->nsub > h->nodes - sub))) {
+      ok = FALSE;
+      break;
+    }
+    fl[i] = fl_list_create(names + n->name, FALSE);
+    fl[i]->size = n->size;
+    if(n->flags & FL_CACHE_ISFILE) {
+      fl[i]->isfile = TRUE;
+      fl[i]->hastth = n->flags & FL_CACHE_HASTTH ? TRUE : FALSE;
+      memcpy(fl[i]->tth, n->tth, 24);
+    } else
+      sub += n->nsub;
+  }
+  if(ok && (sub != h->nodes || (nodes->flags & FL_CACHE_ISFILE)))
+    ok = FALSE;
+
+  if(ok) {
+    for(i=0; i<h->nodes; i++) {
+      if(fl[i]->isfile)
+        continue;
+      const struct fl_cache_node *n = nodes+i;
+      fl[i]->sub = g_ptr_array_sized_new(n->nsub);
+      g_ptr_array_set_free_func(fl[i]->sub, fl_list_free);
+      for(j=n->sub; j<n->sub+n->nsub; j++) {
+        fl[j]->parent = fl[i];
+        g_ptr_array_add(fl[i]->sub, fl[j]);
+      }
+    }
+  } else {
+    // Nothing has been linked yet, so every node can be freed separately.
+    for(j=0; j<i; j++)
+      fl_list_free(fl[j]);
+  }
+
+  struct fl_list *root = ok ? fl[0] : NULL;
+  g_free(fl);
+  g_mapped_file_unref(map);
+  if(!ok)
+    g_warning("Invalid file list cache: %s", file);
+  return root;
+}
+
 
 
 
 // Async version of fl_load(). Performs the load in a background thread. Only
-// used for non-local filelists.
+// used for non-local filelists, which are cached
+// with fl_cache_save().
 
 static GThreadPool *fl_load_pool = NULL;
 
@@ -739,7 +1631,15 @@ static gboolean fl_load_async_d(gpointer dat) {
 
 static void fl_load_async_f(gpointer dat, gpointer udat) {
   struct fl_load_async_dat *arg = dat;
-  arg->fl = fl_load(arg->file, &arg->err, FALSE);
+  char *cache = fl_cache_path(arg->file);
+  struct stat st;
+  gboolean havest = stat(arg->file, &st) == 0;
+  if(!havest || !(arg->fl = fl_cache_load(cache, &st))) {
+    arg->fl = fl_load(arg->file, &arg->err, FALSE);
+    if(arg->fl && havest)
+      fl_cache_save(arg->fl, cache, &st);
+  }
+  g_free(cache);
   g_idle_add(fl_load_async_d, arg);
 }
 
@@ -764,16 +1664,11 @@ void fl_load_async(const char *file, void (*cb)(struct fl_list *, GError *, void
 
 static int fl_save_write(void *context, const char *buf, int len) {
   struct fl_loadsave_context *xc = context;
-  if(xc->fh_bz) {
-    int bzerr;
-    BZ2_bzWrite(&bzerr, xc->fh_bz, (char *)buf, len);
-    if(bzerr == BZ_OK)
+  if(xc->bz) {
+    if(fl_bz_write(xc->bz, buf, len))
       return len;
-    if(bzerr == BZ_IO_ERROR) {
-      g_set_error_literal(xc->err, 1, 0, "bzip2 write error.");
-      return -1;
-    }
-    g_return_val_if_reached(-1);
+    g_set_error_literal(xc->err, 1, 0, "bzip2 write error.");
+    return -1;
   } else if(xc->fh_f) {
     int r = fwrite(buf, 1, len, xc->fh_f);
     if(r < 0)
@@ -789,11 +1684,19 @@ static int fl_save_write(void *context, const char *buf, int len) {
 
 static int fl_save_close(void *context) {
   struct fl_loadsave_context *xc = context;
-  int bzerr;
-  if(xc->fh_bz)
-    BZ2_bzWriteClose(&bzerr, xc->fh_bz, 0, NULL, NULL);
-  if(xc->fh_f)
-    fclose(xc->fh_f);
+  gboolean ok = TRUE;
+  if(xc->bz && !fl_bz_write_close(xc->bz)) {
+    if(xc->err && !*(xc->err))
+      g_set_error_literal(xc->err, 1, 0, "bzip2 write error.");
+    ok = FALSE;
+  }
+  if(xc->fh_f && fclose(xc->fh_f) != 0) {
+    if(xc->err && !*(xc->err))
+      g_set_error(xc->err, 1, 0, "Write error: %s", g_strerror(errno));
+    ok = FALSE;
+  }
+  if(!ok && xc->closeok)
+    *xc->closeok = FALSE;
   g_free(xc->file);
   g_slice_free(struct fl_loadsave_context, xc);
   return 0;
@@ -831,7 +1734,7 @@ static gboolean fl_save_childs(xmlTextWriterPtr writer, struct fl_list *fl, int
 }
 
 
-static xmlTextWriterPtr fl_save_open(const char *file, gboolean isbz2, GString *buf, GError **err) {
+static xmlTextWriterPtr fl_save_open(const char *file, gboolean isbz2, GString *buf, gboolean *closeok, GError **err) {
   // open file (if any)
   FILE *f = NULL;
   if(file) {
@@ -843,24 +1746,16 @@ static xmlTextWriterPtr fl_save_open(const char *file, gboolean isbz2, GString *
   }
 
   // open compressor (if needed)
-  BZFILE *bzf = NULL;
-  if(f && isbz2) {
-    int bzerr;
-    bzf = BZ2_bzWriteOpen(&bzerr, f, 7, 0, 0);
-    if(bzerr != BZ_OK) {
-      g_set_error(err, 1, 0, "Unable to create BZ2 file (%d)", bzerr);
-      fclose(f);
-      return NULL;
-    }
-  }
+  struct fl_bz *bz = f && isbz2 ? fl_bz_write_open(f) : NULL;
 
   // create writer
   struct fl_loadsave_context *xc = g_slice_new0(struct fl_loadsave_context);
   xc->err = err;
   xc->file = file ? g_strdup(file) : g_strdup("string buffer");
   xc->fh_f = f;
-  xc->fh_bz = bzf;
+  xc->bz = bz;
   xc->buf = buf;
+  xc->closeok = closeok;
   xmlTextWriterPtr writer = xmlNewTextWriter(xmlOutputBufferCreateIO(fl_save_write, fl_save_close, xc, NULL));
 
   if(!writer) {
@@ -884,14 +1779,16 @@ gboolean fl_save(struct fl_list *fl, const char *file, GString *buf, int level,
     tmpfile = g_strdup_printf("%s.tmp-%d", file, rand());
   }
 
-  xmlTextWriterPtr writer = fl_save_open(tmpfile, isbz2, buf, err);
+  // success is also set to FALSE by fl_save_close() when flushing the file
+  // fails.
+  gboolean success = TRUE;
+  xmlTextWriterPtr writer = fl_save_open(tmpfile, isbz2, buf, &success, err);
   if(!writer) {
     g_free(tmpfile);
     return FALSE;
   }
 
   // write
-  gboolean success = TRUE;
 #define CHECKFAIL(f) if((f) < 0) { success = FALSE; goto fl_save_error; }
   CHECKFAIL(xmlTextWriterSetIndent(writer, 1));
   CHECKFAIL(xmlTextWriterSetIndentString(writer, (xmlChar *)"\t"));
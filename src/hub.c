@@ -49,11 +49,12 @@ struct hub_user {
   int sid;        // for ADC
   struct hub *hub;
   char *name;     // UTF-8
-  char *name_hub; // hub-encoded (NMDC)
+  char *name_hub; // hub-encoded (NMDC), may point to name if both are equal
+  char *name_key; // g_utf8_collate_key() of name, created on demand by the user list (may be NULL)
   char *desc;
-  char *conn;     // NMDC: string pointer, ADC: GUINT_TO_POINTER() of the US param
+  char *conn;     // NMDC: string pointer (interned), ADC: GUINT_TO_POINTER() of the US param
   char *mail;
-  char *client;
+  char *client;   // interned, see str_intern()
   char cid[8];   // for ADC - only the first 8 bytes of the CID, for simple verification purposes
   guint64 uid;
   guint64 sharesize;
@@ -74,6 +75,12 @@ struct hub {
   guint64 id;              // "hubid" number
   char *hubname;           // UTF-8, or NULL when unknown
   char *hubname_hub;       // (NMDC) in hub encoding
+  gboolean charset_open;   // (NMDC) cached conversion descriptors, see charset_convert()
+  gboolean charset_utf8;
+  gboolean charset_asciicompat; // whether pure ASCII strings need no conversion
+  int charset_gen;
+  GIConv charset_to;
+  GIConv charset_from;
 
   // Our user info
   char *nick_hub;          // (NMDC) in hub encoding
@@ -152,8 +159,10 @@ static struct hub_user *user_add(struct hub *hub, const char *name, const char *
     memcpy(u->cid, tmp, 8);
     tiger_update(&t, tmp, 24);
   } else {
-    u->name_hub = g_strdup(name);
+    // Most hubs use UTF-8 or have mostly ASCII nicks, don't store the same
+    // string twice in that case.
     u->name = charset_convert(hub, TRUE, name);
+    u->name_hub = strcmp(u->name, name) == 0 ? u->name : g_strdup(name);
     tiger_update(&t, u->name_hub, strlen(u->name_hub));
   }
   tiger_final(&t, tmp);
@@ -186,13 +195,15 @@ static void user_free(gpointer dat) {
   if(u->kp)
     g_slice_free1(32, u->kp);
 #endif
-  g_free(u->name_hub);
+  if(u->name_hub != u->name)
+    g_free(u->name_hub);
   g_free(u->name);
+  g_free(u->name_key);
   g_free(u->desc);
   if(!u->hub->adc)
-    g_free(u->conn);
+    str_unintern(u->conn);
   g_free(u->mail);
-  g_free(u->client);
+  str_unintern(u->client);
   g_slice_free(struct hub_user, u);
 }
 
@@ -331,15 +342,24 @@ static void user_nmdc_nfo(struct hub *hub, struct hub_user *u, char *str) {
   share = g_ascii_strtoull(str, NULL, 10);
 
   // If we still haven't 'return'ed yet, that means we have a correct $MyINFO. Now we can update the struct.
+  char *oclient = u->client;
+  char *oconn = u->conn;
   g_free(u->desc);
-  g_free(u->client);
-  g_free(u->conn);
   g_free(u->mail);
   u->sharesize = share;
   u->desc = desc[0] ? nmdc_unescape_and_decode(hub, desc) : NULL;
-  u->client = client && client[0] ? g_strdup(client) : NULL;
-  u->conn = conn[0] ? nmdc_unescape_and_decode(hub, conn) : NULL;
+  u->client = client && client[0] ? str_intern(client) : NULL;
+  if(conn[0]) {
+    conn = nmdc_unescape_and_decode(hub, conn);
+    u->conn = str_intern(conn);
+    g_free(conn);
+  } else
+    u->conn = NULL;
   u->mail = mail[0] ? nmdc_unescape_and_decode(hub, mail) : NULL;
+  // Release the old strings after interning the new ones, they're likely to
+  // be the same.
+  str_unintern(oclient);
+  str_unintern(oconn);
   u->h_norm = h_norm;
   u->h_reg = h_reg;
   u->h_op = h_op;
@@ -365,7 +385,7 @@ static void user_adc_nfo(struct hub *hub, struct hub_user *u, struct adc_cmd *cm
   }
 
   // This is faster than calling adc_getparam() each time
-  char **n;
+  char **n, *tmp;
   for(n=cmd->argv; n&&*n; n++) {
     if(strlen(*n) < 2)
       continue;
@@ -374,7 +394,9 @@ static void user_adc_nfo(struct hub *hub, struct hub_user *u, struct adc_cmd *cm
     case P('N','I'): // nick
       g_hash_table_steal(hub->users, u->name);
       g_free(u->name);
+      g_free(u->name_key);
       u->name = g_strdup(p);
+      u->name_key = NULL;
       g_hash_table_insert(hub->users, u->name, u);
       break;
     case P('D','E'): // description
@@ -382,9 +404,18 @@ static void user_adc_nfo(struct hub *hub, struct hub_user *u, struct adc_cmd *cm
       u->desc = p[0] ? g_strdup(p) : NULL;
       break;
     case P('V','E'): // client name (+ version)
-      g_free(u->client);
-      char *ap = adc_getparam(cmd->argv, "AP", NULL);
-      u->client = !p[0] ? NULL : !ap || strncmp(p, ap, strlen(ap)) == 0 ? g_strdup(p) : g_strdup_printf("%s %s", ap, p);
+      tmp = u->client;
+      char *ap = adc_param(cmd, 0, "AP");
+      if(!p[0])
+        u->client = NULL;
+      else if(!ap || strncmp(p, ap, strlen(ap)) == 0)
+        u->client = str_intern(p);
+      else {
+        p = g_strdup_printf("%s %s", ap, p);
+        u->client = str_intern(p);
+        g_free(p);
+      }
+      str_unintern(tmp);
       break;
     case P('E','M'): // mail
       g_free(u->mail);
@@ -801,16 +832,16 @@ static void setownip(struct hub *hub, guint32 ip) {
 
 
 static void adc_sch(struct hub *hub, struct adc_cmd *cmd) {
-  char *an = adc_getparam(cmd->argv, "AN", NULL); // and
-  char *no = adc_getparam(cmd->argv, "NO", NULL); // not
-  char *ex = adc_getparam(cmd->argv, "EX", NULL); // ext
-  char *le = adc_getparam(cmd->argv, "LE", NULL); // less-than
-  char *ge = adc_getparam(cmd->argv, "GE", NULL); // greater-than
-  char *eq = adc_getparam(cmd->argv, "EQ", NULL); // equal
-  char *to = adc_getparam(cmd->argv, "TO", NULL); // token
-  char *ty = adc_getparam(cmd->argv, "TY", NULL); // type (1=file, 2=dir)
-  char *tr = adc_getparam(cmd->argv, "TR", NULL); // TTH root
-  char *td = adc_getparam(cmd->argv, "TD", NULL); // tree depth
+  char *an = adc_param(cmd, 0, "AN"); // and
+  char *no = adc_param(cmd, 0, "NO"); // not
+  char *ex = adc_param(cmd, 0, "EX"); // ext
+  char *le = adc_param(cmd, 0, "LE"); // less-than
+  char *ge = adc_param(cmd, 0, "GE"); // greater-than
+  char *eq = adc_param(cmd, 0, "EQ"); // equal
+  char *to = adc_param(cmd, 0, "TO"); // token
+  char *ty = adc_param(cmd, 0, "TY"); // type (1=file, 2=dir)
+  char *tr = adc_param(cmd, 0, "TR"); // TTH root
+  char *td = adc_param(cmd, 0, "TD"); // tree depth
 
   // no strong enough filters specified? ignore
   if(!an && !no && !ex && !le && !ge && !eq && !tr)
@@ -877,10 +908,14 @@ static void adc_sch(struct hub *hub, struct adc_cmd *cmd) {
     slots_free = 0;
   char tth[40] = {};
   char *cid = NULL;
-  char *dest = NULL;
+  struct sockaddr_in dest = {};
   if(u->hasudp4) {
     cid = var_get(0, VAR_cid);
-    dest = g_strdup_printf("%s:%d", ip4_unpack(u->ip4), u->udp4);
+    char *tmp = g_strdup_printf("%s:%d", ip4_unpack(u->ip4), u->udp4);
+    gboolean valid = net_udp_dest(tmp, &dest);
+    g_free(tmp);
+    if(!valid)
+      goto adc_search_cleanup;
   }
 
   // reply
@@ -904,14 +939,12 @@ static void adc_sch(struct hub *hub, struct adc_cmd *cmd) {
     // send
     if(u->hasudp4) {
       g_string_append_c(r, '\n');
-      net_udp_send(dest, r->str);
+      net_udp_send_to(&dest, r->str, r->len);
     } else
       net_send(hub->net, r->str);
     g_string_free(r, TRUE);
   }
 
-  g_free(dest);
-
 adc_search_cleanup:
   fl_search_free_and(s.and);
   if(s.not)
@@ -971,7 +1004,7 @@ static void adc_handle(struct hub *hub, char *msg) {
       if(left)
         hname = adc_getparam(left, "NI", NULL);
       if(!hname)
-        hname = adc_getparam(cmd.argv, "DE", NULL);
+        hname = adc_param(&cmd, 0, "DE");
       if(hname) {
         g_free(hub->hubname);
         hub->hubname = g_strdup(hname);
@@ -980,8 +1013,8 @@ static void adc_handle(struct hub *hub, char *msg) {
     } else if(cmd.type == 'B') {
       struct hub_user *u = g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(cmd.source));
       if(!u) {
-        char *nick = adc_getparam(cmd.argv, "NI", NULL);
-        char *cid = adc_getparam(cmd.argv, "ID", NULL);
+        char *nick = adc_param(&cmd, 0, "NI");
+        char *cid = adc_param(&cmd, 0, "ID");
         // Note that the ADC spec allows hashes of varying length. I'm limiting
         // myself to TTH hashes here since that is more memory-efficient.
         if(nick && cid && istth(cid))
@@ -1019,9 +1052,9 @@ static void adc_handle(struct hub *hub, char *msg) {
       int sid = ADC_DFCC(cmd.argv[0]);
       struct hub_user *u = g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(sid));
       if(sid == hub->sid) {
-        char *rd = adc_getparam(cmd.argv, "RD", NULL);
-        char *ms = adc_getparam(cmd.argv, "MS", NULL);
-        char *tl = adc_getparam(cmd.argv, "TL", NULL);
+        char *rd = adc_param(&cmd, 0, "RD");
+        char *ms = adc_param(&cmd, 0, "MS");
+        char *tl = adc_param(&cmd, 0, "TL");
         if(rd) {
           ui_mf(hub->tab, UIP_HIGH, "\nThe hub is requesting you to move to %s.\nType `/connect %s' to do so.\n", rd, rd);
           if(ms)
@@ -1122,8 +1155,8 @@ static void adc_handle(struct hub *hub, char *msg) {
     if(cmd.argc < 1 || (cmd.type != 'B' && cmd.type != 'E' && cmd.type != 'D' && cmd.type != 'I' && cmd.type != 'F'))
       g_warning("Invalid message from %s: %s", net_remoteaddr(hub->net), msg);
     else {
-      char *pm = adc_getparam(cmd.argv+1, "PM", NULL);
-      gboolean me = adc_getparam(cmd.argv+1, "ME", NULL) != NULL;
+      char *pm = adc_param(&cmd, 1, "PM");
+      gboolean me = adc_param(&cmd, 1, "ME") != NULL;
       struct hub_user *u = cmd.type != 'I' ? g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(cmd.source)) : NULL;
       struct hub_user *d = (cmd.type == 'E' || cmd.type == 'D') && cmd.source == hub->sid
         ? g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(cmd.dest)) : NULL;
@@ -1183,7 +1216,7 @@ static void adc_handle(struct hub *hub, char *msg) {
     g_message("Unknown command from %s: %s", net_remoteaddr(hub->net), msg);
   }
 
-  g_strfreev(cmd.argv);
+  adc_cmd_free(&cmd);
 }
 
 #undef is_adcs_proto
@@ -1236,6 +1269,11 @@ static void nmdc_search(struct hub *hub, char *from, int size_m, guint64 size, i
   if(!i)
     return;
 
+  // Resolve the destination only once for all results
+  struct sockaddr_in dest = {};
+  if(from[0] != 'H' && !net_udp_dest(from, &dest))
+    return;
+
   char *hubaddr = net_remoteaddr(hub->net);
   int slots = var_get_int(0, VAR_slots);
   int slots_free = slots - cc_slots_in_use(NULL);
@@ -1261,8 +1299,11 @@ static void nmdc_search(struct hub *hub, char *from, int size_m, guint64 size, i
       hub->nick_hub, tmp, size ? size : "", slots_free, slots, res[i]->isfile ? tth : hub->hubname_hub, hubaddr);
     if(from[0] == 'H')
       net_sendf(hub->net, "%s\05%s", msg, from+4);
-    else
-      net_udp_sendf(from, "%s|", msg);
+    else {
+      char *udp = g_strconcat(msg, "|", NULL);
+      net_udp_send_to(&dest, udp, strlen(udp));
+      g_free(udp);
+    }
     g_free(fl);
     g_free(msg);
     g_free(size);
@@ -1271,59 +1312,55 @@ static void nmdc_search(struct hub *hub, char *from, int size_m, guint64 size, i
 }
 
 
+// Splits a "$$"-separated list in-place. Returns the first item and advances
+// *str to the next one, or returns NULL at the end of the list or when an
+// empty item is found.
+static char *nmdc_list_next(char **str) {
+  char *item = *str;
+  if(!*item)
+    return NULL;
+  char *sep = strstr(item, "$$");
+  if(sep == item)
+    return NULL;
+  if(sep) {
+    *sep = 0;
+    *str = sep+2;
+  } else
+    *str = item+strlen(item);
+  return item;
+}
+
+
 static void nmdc_handle(struct hub *hub, char *cmd) {
-  GMatchInfo *nfo;
-
-  // create regexes (declared statically, allocated/compiled on first call)
-#define CMDREGEX(name, regex) \
-  static GRegex * name = NULL;\
-  if(!name) name = g_regex_new("\\$" regex, G_REGEX_OPTIMIZE|G_REGEX_ANCHORED|G_REGEX_DOTALL|G_REGEX_RAW, 0, NULL)
-
-  CMDREGEX(lock, "Lock ([^ $]+) Pk=[^ $]+");
-  CMDREGEX(supports, "Supports (.+)");
-  CMDREGEX(hello, "Hello ([^ $]+)");
-  CMDREGEX(quit, "Quit ([^ $]+)");
-  CMDREGEX(nicklist, "NickList (.+)");
-  CMDREGEX(oplist, "OpList (.+)");
-  CMDREGEX(userip, "UserIP (.+)");
-  CMDREGEX(myinfo, "MyINFO \\$ALL ([^ $]+) (.+)");
-  CMDREGEX(hubname, "HubName (.+)");
-  CMDREGEX(to, "To: ([^ $]+) From: ([^ $]+) \\$(.+)");
-  CMDREGEX(forcemove, "ForceMove (.+)");
-  CMDREGEX(connecttome, "ConnectToMe ([^ $]+) ([0-9]{1,3}(?:\\.[0-9]{1,3}){3}:[0-9]+)(S|)"); // TODO: IPv6
-  CMDREGEX(revconnecttome, "RevConnectToMe ([^ $]+) ([^ $]+)");
-  CMDREGEX(search, "Search (Hub:(?:[^ $]+)|(?:[0-9]{1,3}(?:\\.[0-9]{1,3}){3}:[0-9]+)) ([TF])\\?([TF])\\?([0-9]+)\\?([1-9])\\?(.+)");
-
-  // $Lock
-  if(g_regex_match(lock, cmd, 0, &nfo)) { // 1 = lock
-    char *lock = g_match_info_fetch(nfo, 1);
-    if(strncmp(lock, "EXTENDEDPROTOCOL", 16) == 0)
+  char *args, *a, *b, *c;
+  struct hub_user *u;
+
+  switch(nmdc_cmd(cmd, &args)) {
+
+  case NMDCC_LOCK: // $Lock lock Pk=pk
+    if(!(a = nmdc_arg(&args)) || strncmp(args, "Pk=", 3) != 0)
+      break;
+    if(strncmp(a, "EXTENDEDPROTOCOL", 16) == 0)
       net_send(hub->net, "$Supports NoGetINFO NoHello UserIP2");
-    char *key = nmdc_lock2key(lock);
-    net_sendf(hub->net, "$Key %s", key);
+    b = nmdc_lock2key(a);
+    net_sendf(hub->net, "$Key %s", b);
     hub->nick = g_strdup(var_get(hub->id, VAR_nick));
     hub->nick_hub = charset_convert(hub, FALSE, hub->nick);
     ui_hub_setnick(hub->tab);
     net_sendf(hub->net, "$ValidateNick %s", hub->nick_hub);
-    g_free(key);
-    g_free(lock);
-  }
-  g_match_info_free(nfo);
+    g_free(b);
+    break;
 
-  // $Supports
-  if(g_regex_match(supports, cmd, 0, &nfo)) { // 1 = list
-    char *list = g_match_info_fetch(nfo, 1);
-    if(strstr(list, "NoGetINFO"))
+  case NMDCC_SUPPORTS: // $Supports list
+    if(strstr(args, "NoGetINFO"))
       hub->supports_nogetinfo = TRUE;
     // we also support NoHello, but no need to check for that
-    g_free(list);
-  }
-  g_match_info_free(nfo);
+    break;
 
-  // $Hello
-  if(g_regex_match(hello, cmd, 0, &nfo)) { // 1 = nick
-    char *nick = g_match_info_fetch(nfo, 1);
-    if(strcmp(nick, hub->nick_hub) == 0) {
+  case NMDCC_HELLO: // $Hello nick
+    if(!(a = nmdc_arg(&args)))
+      break;
+    if(strcmp(a, hub->nick_hub) == 0) {
       // some hubs send our $Hello twice (like verlihub)
       // just ignore the second one
       if(!hub->nick_valid) {
@@ -1338,181 +1375,148 @@ static void nmdc_handle(struct hub *hub, char *cmd) {
         dl_user_join(0);
       }
     } else {
-      struct hub_user *u = user_add(hub, nick, NULL);
+      u = user_add(hub, a, NULL);
       if(!u->hasinfo && !hub->supports_nogetinfo)
-        net_sendf(hub->net, "$GetINFO %s", nick);
+        net_sendf(hub->net, "$GetINFO %s", a);
     }
-    g_free(nick);
-  }
-  g_match_info_free(nfo);
+    break;
 
-  // $Quit
-  if(g_regex_match(quit, cmd, 0, &nfo)) { // 1 = nick
-    char *nick = g_match_info_fetch(nfo, 1);
-    struct hub_user *u = g_hash_table_lookup(hub->users, nick);
+  case NMDCC_QUIT: // $Quit nick
+    if(!(a = nmdc_arg(&args)))
+      break;
+    u = g_hash_table_lookup(hub->users, a);
     if(u) {
       ui_hub_userchange(hub->tab, UIHUB_UC_QUIT, u);
       if(u->hasinfo) {
         hub->sharecount--;
         hub->sharesize -= u->sharesize;
       }
-      g_hash_table_remove(hub->users, nick);
+      g_hash_table_remove(hub->users, a);
     }
-    g_free(nick);
-  }
-  g_match_info_free(nfo);
-
-  // $NickList
-  if(g_regex_match(nicklist, cmd, 0, &nfo)) { // 1 = list of users
-    // not really efficient, but does the trick
-    char *str = g_match_info_fetch(nfo, 1);
-    char **list = g_strsplit(str, "$$", 0);
-    g_free(str);
-    char **cur;
-    for(cur=list; *cur&&**cur; cur++) {
-      struct hub_user *u = user_add(hub, *cur, NULL);
+    break;
+
+  case NMDCC_NICKLIST: // $NickList nick1$$nick2$$..
+    if(!*args)
+      break;
+    while((a = nmdc_list_next(&args))) {
+      u = user_add(hub, a, NULL);
       if(!u->hasinfo && !hub->supports_nogetinfo)
-        net_sendf(hub->net, "$GetINFO %s %s", *cur, hub->nick_hub);
+        net_sendf(hub->net, "$GetINFO %s %s", a, hub->nick_hub);
     }
     hub->received_first = TRUE;
-    g_strfreev(list);
-  }
-  g_match_info_free(nfo);
-
-  // $OpList
-  if(g_regex_match(oplist, cmd, 0, &nfo)) { // 1 = list of ops
-    // not really efficient, but does the trick
-    char *str = g_match_info_fetch(nfo, 1);
-    char **list = g_strsplit(str, "$$", 0);
-    g_free(str);
-    char **cur;
+    break;
+
+  case NMDCC_OPLIST: // $OpList nick1$$nick2$$..
+    if(!*args)
+      break;
     // Actually, we should be going through the entire user list and set
     // isop=FALSE when the user is not listed here. I consider this to be too
     // inefficient and not all that important at this point.
     hub->isop = FALSE;
-    for(cur=list; *cur&&**cur; cur++) {
-      struct hub_user *u = user_add(hub, *cur, NULL);
+    while((a = nmdc_list_next(&args))) {
+      u = user_add(hub, a, NULL);
       if(!u->isop) {
         u->isop = TRUE;
         ui_hub_userchange(hub->tab, UIHUB_UC_NFO, u);
       } else
         u->isop = TRUE;
-      if(strcmp(hub->nick_hub, *cur) == 0)
+      if(strcmp(hub->nick_hub, a) == 0)
         hub->isop = TRUE;
     }
     hub->received_first = TRUE;
-    g_strfreev(list);
-  }
-  g_match_info_free(nfo);
-
-  // $UserIP
-  if(g_regex_match(userip, cmd, 0, &nfo)) { // 1 = list of users/ips
-    char *str = g_match_info_fetch(nfo, 1);
-    char **list = g_strsplit(str, "$$", 0);
-    g_free(str);
-    char **cur;
-    for(cur=list; *cur&&**cur; cur++) {
-      char *sep = strchr(*cur, ' ');
-      if(!sep)
+    break;
+
+  case NMDCC_USERIP: // $UserIP nick1 ip1$$nick2 ip2$$..
+    while((a = nmdc_list_next(&args))) {
+      b = strchr(a, ' ');
+      if(!b)
         continue;
-      *sep = 0;
-      struct hub_user *u = user_add(hub, *cur, NULL);
-      guint32 new = ip4_pack(sep+1);
+      *b = 0;
+      u = user_add(hub, a, NULL);
+      guint32 new = ip4_pack(b+1);
       if(new != u->ip4) {
         u->ip4 = new;
         ui_hub_userchange(hub->tab, UIHUB_UC_NFO, u);
       }
       // Our own IP, configure active mode
-      if(strcmp(*cur, hub->nick_hub) == 0)
+      if(strcmp(a, hub->nick_hub) == 0)
         setownip(hub, new);
     }
-    g_strfreev(list);
-  }
-  g_match_info_free(nfo);
+    break;
 
-  // $MyINFO
-  if(g_regex_match(myinfo, cmd, 0, &nfo)) { // 1 = nick, 2 = info string
-    char *nick = g_match_info_fetch(nfo, 1);
-    char *str = g_match_info_fetch(nfo, 2);
-    struct hub_user *u = user_add(hub, nick, NULL);
+  case NMDCC_MYINFO: // $MyINFO $ALL nick info
+    if(strncmp(args, "$ALL ", 5) != 0)
+      break;
+    args += 5;
+    if(!(a = nmdc_arg(&args)) || !*args)
+      break;
+    u = user_add(hub, a, NULL);
     if(!u->hasinfo)
       hub->sharecount++;
     else
       hub->sharesize -= u->sharesize;
-    user_nmdc_nfo(hub, u, str);
+    user_nmdc_nfo(hub, u, args);
     if(!u->hasinfo)
       hub->sharecount--;
     else
       hub->sharesize += u->sharesize;
     if(hub->received_first && !hub->joincomplete && hub->sharecount == g_hash_table_size(hub->users))
       hub->joincomplete = TRUE;
-    g_free(str);
-    g_free(nick);
-  }
-  g_match_info_free(nfo);
+    break;
 
-  // $HubName
-  if(g_regex_match(hubname, cmd, 0, &nfo)) { // 1 = name
+  case NMDCC_HUBNAME: // $HubName name
+    if(!*args)
+      break;
     g_free(hub->hubname_hub);
     g_free(hub->hubname);
-    hub->hubname_hub = g_match_info_fetch(nfo, 1);
+    hub->hubname_hub = g_strdup(args);
     hub->hubname = nmdc_unescape_and_decode(hub, hub->hubname_hub);
-  }
-  g_match_info_free(nfo);
-
-  // $To
-  if(g_regex_match(to, cmd, 0, &nfo)) { // 1 = to, 2 = from, 3 = msg
-    char *to = g_match_info_fetch(nfo, 1);
-    char *from = g_match_info_fetch(nfo, 2);
-    char *msg = g_match_info_fetch(nfo, 3);
-    struct hub_user *u = g_hash_table_lookup(hub->users, from);
+    break;
+
+  case NMDCC_TO: // $To: to From: from $msg
+    if(!(a = nmdc_arg(&args)) || strncmp(args, "From: ", 6) != 0)
+      break;
+    args += 6;
+    if(!(b = nmdc_arg(&args)) || args[0] != '$' || !args[1])
+      break;
+    u = g_hash_table_lookup(hub->users, b);
     if(!u)
-      g_warning("[hub: %s] Got a $To from `%s', who is not on this hub!", hub->tab->name, from);
+      g_warning("[hub: %s] Got a $To from `%s', who is not on this hub!", hub->tab->name, b);
     else {
-      char *msge = nmdc_unescape_and_decode(hub, msg);
+      char *msge = nmdc_unescape_and_decode(hub, args+1);
       ui_hub_msg(hub->tab, u, msge, 0);
       show_system_notification(u->name,&msge[strlen(u->name)+2]);
       g_free(msge);
     }
-    g_free(from);
-    g_free(to);
-    g_free(msg);
-  }
-  g_match_info_free(nfo);
+    break;
 
-  // $ForceMove
-  if(g_regex_match(forcemove, cmd, 0, &nfo)) { // 1 = addr
-    char *addr = g_match_info_fetch(nfo, 1);
-    char *eaddr = nmdc_unescape_and_decode(hub, addr);
-    ui_mf(hub->tab, UIP_HIGH, "\nThe hub is requesting you to move to %s.\nType `/connect %s' to do so.\n", eaddr, eaddr);
+  case NMDCC_FORCEMOVE: // $ForceMove addr
+    if(!*args)
+      break;
+    a = nmdc_unescape_and_decode(hub, args);
+    ui_mf(hub->tab, UIP_HIGH, "\nThe hub is requesting you to move to %s.\nType `/connect %s' to do so.\n", a, a);
     hub_disconnect(hub, FALSE);
-    g_free(eaddr);
-    g_free(addr);
-  }
-  g_match_info_free(nfo);
-
-  // $ConnectToMe
-  if(g_regex_match(connecttome, cmd, 0, &nfo)) { // 1 = me, 2 = addr, 3 = TLS
-    char *me = g_match_info_fetch(nfo, 1);
-    char *addr = g_match_info_fetch(nfo, 2);
-    char *tls = g_match_info_fetch(nfo, 3);
-    if(strcmp(me, hub->nick_hub) != 0)
-      g_warning("Received a $ConnectToMe for someone else (to %s from %s)", me, addr);
+    g_free(a);
+    break;
+
+  case NMDCC_CONNECTTOME: // $ConnectToMe me ip:port[S]
+    // TODO: IPv6
+    if(!(a = nmdc_arg(&args)) || !(c = nmdc_addr(args)))
+      break;
+    gboolean tls = *c == 'S';
+    *c = 0;
+    if(strcmp(a, hub->nick_hub) != 0)
+      g_warning("Received a $ConnectToMe for someone else (to %s from %s)", a, args);
     else
-      cc_nmdc_connect(cc_create(hub), addr, var_get(hub->id, VAR_local_address), *tls ? TRUE : FALSE);
-    g_free(me);
-    g_free(addr);
-    g_free(tls);
-  }
-  g_match_info_free(nfo);
-
-  // $RevConnectToMe
-  if(g_regex_match(revconnecttome, cmd, 0, &nfo)) { // 1 = other, 2 = me
-    char *other = g_match_info_fetch(nfo, 1);
-    char *me = g_match_info_fetch(nfo, 2);
-    struct hub_user *u = g_hash_table_lookup(hub->users, other);
-    if(strcmp(me, hub->nick_hub) != 0)
-      g_warning("Received a $RevConnectToMe for someone else (to %s from %s)", me, other);
+      cc_nmdc_connect(cc_create(hub), args, var_get(hub->id, VAR_local_address), tls);
+    break;
+
+  case NMDCC_REVCONNECTTOME: // $RevConnectToMe other me
+    if(!(a = nmdc_arg(&args)) || !(b = nmdc_arg(&args)))
+      break;
+    u = g_hash_table_lookup(hub->users, a);
+    if(strcmp(b, hub->nick_hub) != 0)
+      g_warning("Received a $RevConnectToMe for someone else (to %s from %s)", b, a);
     else if(!u)
       g_message("Received a $RevConnectToMe from someone not on the hub.");
     else if(listen_hub_active(hub->id)) {
@@ -1522,82 +1526,82 @@ static void nmdc_handle(struct hub *hub, char *cmd) {
       guint16 tlsport = listen_hub_tls(hub->id);
       int usetls = u->hastls && tlsport && var_get_int(hub->id, VAR_tls_policy) == VAR_TLSP_PREFER;
       int port = usetls ? tlsport : listen_hub_tcp(hub->id);
-      net_sendf(hub->net, "$ConnectToMe %s %s:%d%s", other, ip4_unpack(hub_ip4(hub)),
+      net_sendf(hub->net, "$ConnectToMe %s %s:%d%s", a, ip4_unpack(hub_ip4(hub)),
         port, usetls ? "S" : "");
       cc_expect_add(hub, u, port, NULL, FALSE);
     } else
       g_message("Received a $RevConnectToMe, but we're not active.");
-    g_free(me);
-    g_free(other);
-  }
-  g_match_info_free(nfo);
-
-  // $Search
-  if(g_regex_match(search, cmd, 0, &nfo)) { // 1=from, 2=sizerestrict, 3=ismax, 4=size, 5=type, 6=query
-    char *from = g_match_info_fetch(nfo, 1);
-    char *sizerestrict = g_match_info_fetch(nfo, 2);
-    char *ismax = g_match_info_fetch(nfo, 3);
-    char *size = g_match_info_fetch(nfo, 4);
-    char *type = g_match_info_fetch(nfo, 5);
-    char *query = g_match_info_fetch(nfo, 6);
+    break;
+
+  case NMDCC_SEARCH: // $Search from sizerestrict?ismax?size?type?query
+    // from = Hub:nick or ip:port
+    if(!(a = nmdc_arg(&args)))
+      break;
+    if(strncmp(a, "Hub:", 4) == 0 ? !a[4] : !(c = nmdc_addr(a)) || *c)
+      break;
+    // sizerestrict and ismax
+    if((args[0] != 'T' && args[0] != 'F') || args[1] != '?' || (args[2] != 'T' && args[2] != 'F') || args[3] != '?')
+      break;
+    b = args;
+    args += 4;
+    // size
+    c = args;
+    args += strspn(args, "0123456789");
+    if(args == c || *args != '?')
+      break;
+    // type and query
+    if(args[1] < '1' || args[1] > '9' || args[2] != '?' || !args[3])
+      break;
     char test[40] = {};
     if(listen_hub_active(hub->id))
       g_snprintf(test, 40, "%s:%d", ip4_unpack(hub_ip4(hub)), listen_hub_udp(hub->id));
-    if(strncmp(from, "Hub:", 4) == 0 ? strcmp(from+4, hub->nick_hub) != 0 : strcmp(from, test) != 0)
-      nmdc_search(hub, from, sizerestrict[0] == 'F' ? -2 : ismax[0] == 'T' ? -1 : 1, g_ascii_strtoull(size, NULL, 10), type[0]-'0', query);
-    g_free(from);
-    g_free(sizerestrict);
-    g_free(ismax);
-    g_free(size);
-    g_free(type);
-    g_free(query);
-  }
-  g_match_info_free(nfo);
+    if(strncmp(a, "Hub:", 4) == 0 ? strcmp(a+4, hub->nick_hub) != 0 : strcmp(a, test) != 0)
+      nmdc_search(hub, a, b[0] == 'F' ? -2 : b[2] == 'T' ? -1 : 1, g_ascii_strtoull(c, NULL, 10), args[1]-'0', args+3);
+    break;
 
-  // $GetPass
-  if(strncmp(cmd, "$GetPass", 8) == 0)
+  case NMDCC_GETPASS:
     hub_password(hub, NULL);
+    break;
 
-  // $BadPass
-  if(strncmp(cmd, "$BadPass", 8) == 0) {
+  case NMDCC_BADPASS:
     if(var_get(hub->id, VAR_password))
       ui_m(hub->tab, 0, "Wrong password. Use '/hset password <password>' to edit your password or '/hunset password' to reset it.");
     else
       ui_m(hub->tab, 0, "Wrong password. Type /reconnect to try again.");
     hub_disconnect(hub, FALSE);
-  }
+    break;
 
-  // $ValidateDenide
-  if(strncmp(cmd, "$ValidateDenide", 15) == 0) {
+  case NMDCC_VALIDATEDENIDE:
     ui_m(hub->tab, 0, "Username invalid or already taken.");
     hub_disconnect(hub, TRUE);
-  }
+    break;
 
-  // $HubIsFull
-  if(strncmp(cmd, "$HubIsFull", 10) == 0) {
+  case NMDCC_HUBISFULL:
     ui_m(hub->tab, 0, "Hub is full.");
     hub_disconnect(hub, TRUE);
-  }
+    break;
 
-  // $SR
-  if(strncmp(cmd, "$SR", 3) == 0) {
+  case NMDCC_SR:;
     struct search_r *r = search_parse_nmdc(hub, cmd);
     if(r) {
       ui_search_global_result(r);
       search_r_free(r);
     } else
       g_message("Received invalid $SR: %s", cmd);
-  }
+    break;
 
-  // global hub message
-  if(cmd[0] != '$') {
-    char *msg = nmdc_unescape_and_decode(hub, cmd);
-    if(msg[0] == '<' || (msg[0] == '*' && msg[1] == '*'))
-      ui_m(hub->tab, UIM_PASS|UIM_CHAT|UIP_MED, msg);
-    else {
-      ui_m(hub->tab, UIM_PASS|UIM_CHAT|UIP_MED, g_strconcat("<hub> ", msg, NULL));
-      g_free(msg);
+  case NMDCC_NONE:
+    // global hub message
+    if(cmd[0] != '$') {
+      char *msg = nmdc_unescape_and_decode(hub, cmd);
+      if(msg[0] == '<' || (msg[0] == '*' && msg[1] == '*'))
+        ui_m(hub->tab, UIM_PASS|UIM_CHAT|UIP_MED, msg);
+      else {
+        ui_m(hub->tab, UIM_PASS|UIM_CHAT|UIP_MED, g_strconcat("<hub> ", msg, NULL));
+        g_free(msg);
+      }
     }
+    break;
   }
 }
 
@@ -1851,6 +1855,7 @@ void hub_free(struct hub *hub) {
   g_free(hub->nfo_conn);
   g_free(hub->nfo_mail);
   g_free(hub->gpa_salt);
+  charset_close(hub);
   g_hash_table_unref(hub->users);
   g_hash_table_unref(hub->sessions);
   g_source_remove(hub->nfo_timer);
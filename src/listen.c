@@ -23,7 +23,12 @@
 
 */
 
+// for recvmmsg()
+#define _GNU_SOURCE
 #include "ncdc.h"
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 
 #if INTERFACE
@@ -152,7 +157,24 @@ static gboolean listen_tcp_handle(GSocket *sock, GIOCondition cond, gpointer dat
 }
 
 
-static void listen_udp_handle_msg(char *addr, char *msg, gboolean adc) {
+// Number of datagrams read in a single wakeup, and the size of each buffer.
+#define LISTEN_UDP_BATCH   32
+#define LISTEN_UDP_BUFSIZE 5000
+
+
+// Formats the source address of a datagram. Only called when the address is
+// actually going to be logged.
+static const char *listen_udp_addr(const struct sockaddr_in *a) {
+  static char buf[INET_ADDRSTRLEN+10];
+  char ip[INET_ADDRSTRLEN];
+  if(a->sin_family != AF_INET || !inet_ntop(AF_INET, &a->sin_addr, ip, sizeof(ip)))
+    return "(addr error)";
+  g_snprintf(buf, sizeof(buf), "%s:%d", ip, ntohs(a->sin_port));
+  return buf;
+}
+
+
+static void listen_udp_handle_msg(const struct sockaddr_in *addr, char *msg, gboolean adc) {
   if(!msg[0])
     return;
   struct search_r *r = NULL;
@@ -163,12 +185,12 @@ static void listen_udp_handle_msg(char *addr, char *msg, gboolean adc) {
     struct adc_cmd cmd;
     adc_parse(msg, &cmd, NULL, &err);
     if(err) {
-      g_warning("ADC parse error from UDP:%s: %s. --> %s", addr, err->message, msg);
+      g_warning("ADC parse error from UDP:%s: %s. --> %s", listen_udp_addr(addr), err->message, msg);
       g_error_free(err);
       return;
     }
     r = search_parse_adc(NULL, &cmd);
-    g_strfreev(cmd.argv);
+    adc_cmd_free(&cmd);
 
   // NMDC
   } else
@@ -179,61 +201,91 @@ static void listen_udp_handle_msg(char *addr, char *msg, gboolean adc) {
     ui_search_global_result(r);
     search_r_free(r);
   } else
-    g_warning("Invalid search result from UDP:%s: %s", addr, msg);
+    g_warning("Invalid search result from UDP:%s: %s", listen_udp_addr(addr), msg);
 }
 
 
-static gboolean listen_udp_handle(GSocket *sock, GIOCondition cond, gpointer dat) {
-  static char buf[5000]; // can be static, this function is only called in the main thread.
-  struct listen_bind *b = dat;
-  GError *err = NULL;
-  GSocketAddress *addr = NULL;
-  int r = g_socket_receive_from(sock, &addr, buf, 5000, NULL, &err);
-
-  // handle error
-  if(r < 0) {
-    if(err->code == G_IO_ERROR_WOULD_BLOCK) {
-      g_error_free(err);
-      return TRUE;
-    }
-    ui_mf(ui_main, 0, "UDP read error on %s:%d: %s. Switching to passive mode.",
-      ip4_unpack(b->ip4), b->port, err->message);
-    listen_stop();
-    hub_global_nfochange();
-    g_error_free(err);
-    return FALSE;
-  }
-
-  // get source ip:port in a readable fashion, for debugging
-  char addr_str[100];
-  GInetSocketAddress *socka = G_INET_SOCKET_ADDRESS(addr);
-  if(!socka)
-    strcat(addr_str, "(addr error)");
-  else {
-    char *ip = g_inet_address_to_string(g_inet_socket_address_get_address(socka));
-    g_snprintf(addr_str, 100, "%s:%d", ip, g_inet_socket_address_get_port(socka));
-    g_free(ip);
-  }
-  g_object_unref(addr);
+// buf must have room for one more byte after len.
+static void listen_udp_handle_dgram(const struct sockaddr_in *addr, char *buf, int len) {
+  buf[len] = 0;
 
   // check for ADC or NMDC
   gboolean adc = FALSE;
   if(buf[0] == 'U')
     adc = TRUE;
   else if(buf[0] != '$') {
-    g_message("CC:UDP:%s: Received invalid message: %s", addr_str, buf);
-    return TRUE;
+    g_message("CC:UDP:%s: Received invalid message: %s", listen_udp_addr(addr), buf);
+    return;
   }
 
+  // Nobody is interested in search results, don't bother parsing them.
+  if(!ui_search_active() && !var_log_debug)
+    return;
+
   // handle message. since all we receive is either URES or $SR, we can handle that here
   char *cur = buf, *next = buf;
   while((next = strchr(cur, adc ? '\n' : '|')) != NULL) {
     *(next++) = 0;
-    g_debug("UDP:%s< %s", addr_str, cur);
-    listen_udp_handle_msg(addr_str, cur, adc);
+    if(var_log_debug)
+      g_debug("UDP:%s< %s", listen_udp_addr(addr), cur);
+    if(ui_search_active())
+      listen_udp_handle_msg(addr, cur, adc);
     cur = next;
   }
+}
+
 
+// Reads up to LISTEN_UDP_BATCH datagrams in one go, using recvmmsg() where
+// available. Popular searches can easily result in thousands of results
+// within a few seconds.
+static gboolean listen_udp_handle(GSocket *sock, GIOCondition cond, gpointer dat) {
+  // can be static, this function is only called in the main thread.
+  static char bufs[LISTEN_UDP_BATCH][LISTEN_UDP_BUFSIZE];
+  static struct sockaddr_in addrs[LISTEN_UDP_BATCH];
+  struct listen_bind *b = dat;
+  int fd = g_socket_get_fd(sock);
+  int i, n;
+
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr msgs[LISTEN_UDP_BATCH];
+  struct iovec iov[LISTEN_UDP_BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  for(i=0; i<LISTEN_UDP_BATCH; i++) {
+    iov[i].iov_base = bufs[i];
+    iov[i].iov_len = LISTEN_UDP_BUFSIZE-1;
+    msgs[i].msg_hdr.msg_iov = iov+i;
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = addrs+i;
+    msgs[i].msg_hdr.msg_namelen = sizeof(*addrs);
+  }
+  n = recvmmsg(fd, msgs, LISTEN_UDP_BATCH, MSG_DONTWAIT, NULL);
+  for(i=0; i<n; i++)
+    listen_udp_handle_dgram(addrs+i, bufs[i], msgs[i].msg_len);
+#else
+  for(n=0; n<LISTEN_UDP_BATCH; n++) {
+    socklen_t addrlen = sizeof(*addrs);
+    int r = recvfrom(fd, bufs[0], LISTEN_UDP_BUFSIZE-1, MSG_DONTWAIT, (struct sockaddr *)addrs, &addrlen);
+    if(r < 0) {
+      if(n > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        n = 0;
+      else
+        n = -1;
+      break;
+    }
+    listen_udp_handle_dgram(addrs, bufs[0], r);
+  }
+#endif
+
+  // handle error
+  if(n < 0) {
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return TRUE;
+    ui_mf(ui_main, 0, "UDP read error on %s:%d: %s. Switching to passive mode.",
+      ip4_unpack(b->ip4), b->port, g_strerror(errno));
+    listen_stop();
+    hub_global_nfochange();
+    return FALSE;
+  }
   return TRUE;
 }
 
@@ -154,7 +154,6 @@ static gboolean stdin_read(GIOChannel *src, GIOCondition cond, gpointer dat) {
 
 
 static gboolean one_second_timer(gpointer dat) {
-  // TODO: ratecalc_calc() requires fairly precise timing, perhaps do this in a separate thread?
   ratecalc_calc();
 
   // Detect day change
@@ -173,7 +172,7 @@ static gboolean one_second_timer(gpointer dat) {
   cc_global_onlinecheck();
 
   // And draw the UI
-  ui_draw();
+  ui_draw_tick();
   return TRUE;
 }
 
@@ -186,8 +185,8 @@ static gboolean screen_update_check(gpointer dat) {
     doupdate();
     ui_draw();
     screen_resized = FALSE;
-  } else if(ui_checkupdate())
-    ui_draw();
+  } else
+    ui_draw_dirty(0);
   return TRUE;
 }
 
@@ -250,7 +249,8 @@ static void log_redirect(const gchar *dom, GLogLevelFlags level, const gchar *ms
 
 // clean-up our ncurses window before throwing a fatal error
 static void log_fatal(const gchar *dom, GLogLevelFlags level, const gchar *msg, gpointer dat) {
-  endwin();
+  if(!ui_headless)
+    endwin();
   // print to both stderr (log file) and stdout
   if(stderr_redir) {
     fprintf(stderr, "\n\n*%s* %s\n", loglevel_to_str(level), msg);
@@ -354,6 +354,7 @@ static gboolean print_version(const gchar *name, const gchar *val, gpointer dat,
 
 
 static gboolean auto_open = TRUE;
+static gboolean headless = FALSE;
 
 static GOptionEntry cli_options[] = {
   { "version", 'v', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, print_version,
@@ -362,6 +363,8 @@ static GOptionEntry cli_options[] = {
       "Use a different session directory. Default: `$NCDC_DIR' or `$HOME/.ncdc'.", "<dir>" },
   { "no-autoconnect", 'n', G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &auto_open,
       "Don't automatically connect to hubs with the `autoconnect' option set.", NULL },
+  { "headless", 0, 0, G_OPTION_ARG_NONE, &headless,
+      "Run without user interface, ncdc can then be controlled through the `ctl.sock' UNIX socket in the session directory.", NULL },
   { NULL }
 };
 
@@ -382,7 +385,7 @@ int main(int argc, char **argv) {
   g_option_context_free(optx);
 
   // check that the current locale is UTF-8. Things aren't going to work otherwise
-  if(!g_get_charset(NULL)) {
+  if(!headless && !g_get_charset(NULL)) {
     puts("WARNING: Your current locale is not set to UTF-8.");
     puts("Non-ASCII characters may not display correctly.");
     puts("Hit Ctrl+c to abort ncdc, or the return key to continue anyway.");
@@ -422,13 +425,16 @@ int main(int argc, char **argv) {
   stderr_redir = TRUE;
 
   // Init more stuff
+  ratecalc_global_init();
   hub_init_global();
   net_init_global();
   listen_global_init();
   cc_global_init();
   dl_init_global();
   ui_cmdhist_init("history");
-  ui_init();
+  ui_init(headless);
+  if(headless)
+    ctl_init();
 
   // setup SIGWINCH
   struct sigaction act;
@@ -458,8 +464,11 @@ int main(int argc, char **argv) {
     open_autoconnect();
 
   // add some watches and start the main loop
-  GIOChannel *in = g_io_channel_unix_new(STDIN_FILENO);
-  g_io_add_watch(in, G_IO_IN, stdin_read, NULL);
+  if(!headless) {
+    GIOChannel *in = g_io_channel_unix_new(STDIN_FILENO);
+    g_io_add_watch(in, G_IO_IN, stdin_read, NULL);
+    g_timeout_add(100, screen_update_check, NULL);
+  }
 
   GSource *sighandle = g_source_new(&sighandle_funcs, sizeof(GSource));
   g_source_set_priority(sighandle, G_PRIORITY_HIGH);
@@ -468,21 +477,23 @@ int main(int argc, char **argv) {
   g_source_unref(sighandle);
 
   g_timeout_add_seconds_full(G_PRIORITY_HIGH, 1, one_second_timer, NULL, NULL);
-  g_timeout_add(100, screen_update_check, NULL);
   int maxage = var_get_int(0, VAR_filelist_maxage);
   g_timeout_add_seconds_full(G_PRIORITY_LOW, CLAMP(maxage, 3600, 24*3600), dl_fl_clean, NULL, NULL);
 
   g_main_loop_run(main_loop);
 
   // cleanup
-  if(!main_noterm) {
+  if(!main_noterm && !headless) {
     erase();
     refresh();
     endwin();
-
+  }
+  if(!main_noterm) {
     printf("Flushing unsaved data to disk...");
     fflush(stdout);
   }
+  if(headless)
+    ctl_close();
   ui_cmdhist_close();
   cc_global_close();
   fl_flush(NULL);
@@ -29,6 +29,7 @@
 #include <gio/gio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <netinet/in.h>
 #include <time.h>
 #include <string.h>
 
@@ -74,6 +75,7 @@ struct var;
 // include the auto-generated header files
 #include "cc.h"
 #include "commands.h"
+#include "ctl.h"
 #include "db.h"
 #include "dl.h"
 #include "fl_local.h"
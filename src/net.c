@@ -24,10 +24,15 @@
 */
 
 
+// for sendmmsg()
+#define _GNU_SOURCE
 #include "ncdc.h"
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 #include <gio/gfiledescriptorbased.h>
 #ifdef HAVE_LINUX_SENDFILE
 # include <sys/sendfile.h>
@@ -1022,57 +1027,130 @@ void net_sendfile(struct net *n, const char *path, guint64 offset, int length, g
 
 // Some global stuff for sending UDP packets
 
-struct net_udp { GSocketAddress *dest; char *msg; int msglen; };
+// Maximum number of messages sent with a single sendmmsg() call.
+#define NET_UDP_BATCH    64
+// Global budget for outgoing UDP messages (mostly search results), in
+// messages per second. Messages exceeding the budget are dropped, as are
+// messages that would grow the queue beyond NET_UDP_MAXQUEUE.
+#define NET_UDP_MAXRATE  2000
+#define NET_UDP_MAXQUEUE 8192
+
+struct net_udp {
+  struct sockaddr_in dest;
+  int msglen;
+  char msg[];
+};
 static GSocket *net_udp_sock;
 static GQueue *net_udp_queue;
+static int net_udp_budget;
+static time_t net_udp_budget_t;
+static gboolean net_udp_budget_warned;
+
 
+static void udp_sent(struct net_udp *m) {
+  ratecalc_add(&net_out, m->msglen);
+  if(var_log_debug) {
+    char a[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &m->dest.sin_addr, a, sizeof(a));
+    g_debug("UDP:%s:%d> %.*s", a, ntohs(m->dest.sin_port), m->msglen, m->msg);
+  }
+  g_free(m);
+}
 
+
+// Sends as many queued messages as possible, in batches.
 static gboolean udp_handle_out(GSocket *sock, GIOCondition cond, gpointer dat) {
-  struct net_udp *m = g_queue_pop_head(net_udp_queue);
-  if(!m)
-    return FALSE;
-  GError *err = NULL;
-  if(g_socket_send_to(net_udp_sock, m->dest, m->msg, m->msglen, NULL, &err) != m->msglen) {
-    g_message("Error sending UDP message: %s.", err->message);
-    g_error_free(err);
-  } else {
-    ratecalc_add(&net_out, m->msglen);
-    char *a = g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(m->dest)));
-    g_debug("UDP:%s:%d> %s", a, g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(m->dest)), m->msg);
-    g_free(a);
+  int fd = g_socket_get_fd(net_udp_sock);
+  while(net_udp_queue->head) {
+    struct net_udp *m[NET_UDP_BATCH];
+    int i, n = 0;
+    GList *l;
+    for(l=net_udp_queue->head; n<NET_UDP_BATCH && l; l=l->next)
+      m[n++] = l->data;
+
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[NET_UDP_BATCH];
+    struct iovec iov[NET_UDP_BATCH];
+    memset(msgs, 0, n*sizeof(*msgs));
+    for(i=0; i<n; i++) {
+      iov[i].iov_base = m[i]->msg;
+      iov[i].iov_len = m[i]->msglen;
+      msgs[i].msg_hdr.msg_iov = iov+i;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &m[i]->dest;
+      msgs[i].msg_hdr.msg_namelen = sizeof(m[i]->dest);
+    }
+    int r = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+#else
+    int r;
+    for(r=0; r<n; r++)
+      if(sendto(fd, m[r]->msg, m[r]->msglen, MSG_DONTWAIT, (struct sockaddr *)&m[r]->dest, sizeof(m[r]->dest)) < 0)
+        break;
+    if(!r)
+      r = -1;
+#endif
+
+    if(r < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+        return TRUE;
+      if(errno == EINTR)
+        continue;
+      // Drop the message that failed, otherwise we'd be trying it forever
+      g_message("Error sending UDP message: %s.", g_strerror(errno));
+      g_free(g_queue_pop_head(net_udp_queue));
+      continue;
+    }
+    for(i=0; i<r; i++)
+      udp_sent(g_queue_pop_head(net_udp_queue));
   }
-  g_free(m->msg);
-  g_object_unref(m->dest);
-  g_slice_free(struct net_udp, m);
-  return net_udp_queue->head ? TRUE : FALSE;
+  return FALSE;
 }
 
 
-// dest is assumed to be a valid IPv4 address with an optional port ("x.x.x.x" or "x.x.x.x:p")
-void net_udp_send_raw(const char *dest, const char *msg, int len) {
-  char *destc = g_strdup(dest);
-  char *port_str = strchr(destc, ':');
+// Parses a destination address. dest is assumed to be a valid IPv4 address
+// with an optional port ("x.x.x.x" or "x.x.x.x:p"). This allows callers that
+// send multiple messages to the same destination to resolve it only once.
+gboolean net_udp_dest(const char *dest, struct sockaddr_in *addr) {
+  char ip[16];
+  int iplen = strcspn(dest, ":");
   long port = 412;
-  if(port_str) {
-    *port_str = 0;
-    port_str++;
-    port = strtol(port_str, NULL, 10);
-    if(port < 0 || port > 0xFFFF) {
-      g_free(destc);
-      return;
-    }
+  if(iplen >= sizeof(ip))
+    return FALSE;
+  if(dest[iplen]) {
+    port = strtol(dest+iplen+1, NULL, 10);
+    if(port < 0 || port > 0xFFFF)
+      return FALSE;
   }
+  memcpy(ip, dest, iplen);
+  ip[iplen] = 0;
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  return inet_pton(AF_INET, ip, &addr->sin_addr) == 1;
+}
 
-  GInetAddress *iaddr = g_inet_address_new_from_string(destc);
-  g_free(destc);
-  if(!iaddr)
+
+void net_udp_send_to(const struct sockaddr_in *dest, const char *msg, int len) {
+  // Check the reply budget
+  time_t now = time(NULL);
+  if(now != net_udp_budget_t) {
+    net_udp_budget = NET_UDP_MAXRATE;
+    net_udp_budget_t = now;
+    net_udp_budget_warned = FALSE;
+  }
+  if(net_udp_budget <= 0 || g_queue_get_length(net_udp_queue) >= NET_UDP_MAXQUEUE) {
+    if(!net_udp_budget_warned)
+      g_debug("UDP: Send budget exceeded, dropping messages.");
+    net_udp_budget_warned = TRUE;
     return;
+  }
+  net_udp_budget--;
 
-  struct net_udp *m = g_slice_new0(struct net_udp);
-  m->msg = g_strdup(msg);
+  struct net_udp *m = g_malloc(offsetof(struct net_udp, msg) + len);
+  m->dest = *dest;
   m->msglen = len;
-  m->dest = G_SOCKET_ADDRESS(g_inet_socket_address_new(iaddr, port));
-  g_object_unref(iaddr);
+  memcpy(m->msg, msg, len);
 
   g_queue_push_tail(net_udp_queue, m);
   if(net_udp_queue->head == net_udp_queue->tail) {
@@ -1084,6 +1162,13 @@ void net_udp_send_raw(const char *dest, const char *msg, int len) {
 }
 
 
+void net_udp_send_raw(const char *dest, const char *msg, int len) {
+  struct sockaddr_in addr;
+  if(net_udp_dest(dest, &addr))
+    net_udp_send_to(&addr, msg, len);
+}
+
+
 void net_udp_send(const char *dest, const char *msg) {
   net_udp_send_raw(dest, msg, strlen(msg));
 }
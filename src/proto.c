@@ -27,6 +27,7 @@
 #include "ncdc.h"
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 
 // This file contains various protocol-related utility functions:
@@ -38,10 +39,57 @@
 
 // NMDC support
 
-char *charset_convert(struct hub *hub, gboolean to_utf8, const char *str) {
+// The conversion descriptors for the encoding of a hub are opened on demand
+// by charset_convert(), and re-opened when var_encoding_gen changes.
+
+void charset_close(struct hub *hub) {
+  if(hub->charset_open && !hub->charset_utf8) {
+    if(hub->charset_to != (GIConv)-1)
+      g_iconv_close(hub->charset_to);
+    if(hub->charset_from != (GIConv)-1)
+      g_iconv_close(hub->charset_from);
+  }
+  hub->charset_open = FALSE;
+}
+
+
+static void charset_open(struct hub *hub) {
   char *fmt = var_get(hub->id, VAR_encoding);
-  char *res = str_convert(to_utf8?"UTF-8":fmt, !to_utf8?"UTF-8":fmt, str);
-  return res;
+  hub->charset_open = TRUE;
+  hub->charset_gen = var_encoding_gen;
+  hub->charset_utf8 = g_ascii_strcasecmp(fmt, "UTF-8") == 0 || g_ascii_strcasecmp(fmt, "UTF8") == 0;
+  // Stateful 7-bit encodings use ASCII bytes (ESC sequences, or '+' and '~')
+  // to switch character sets, so ASCII input may still need decoding.
+  hub->charset_asciicompat = !(g_ascii_strncasecmp(fmt, "ISO-2022", 8) == 0 || g_ascii_strncasecmp(fmt, "ISO2022", 7) == 0
+    || g_ascii_strcasecmp(fmt, "UTF-7") == 0 || g_ascii_strcasecmp(fmt, "UTF7") == 0 || g_ascii_strncasecmp(fmt, "HZ", 2) == 0);
+  if(hub->charset_utf8)
+    return;
+  hub->charset_to = g_iconv_open("UTF-8", fmt);
+  hub->charset_from = g_iconv_open(fmt, "UTF-8");
+  if(hub->charset_to == (GIConv)-1 || hub->charset_from == (GIConv)-1)
+    g_critical("No conversion between '%s' and 'UTF-8': %s", fmt, g_strerror(errno));
+}
+
+
+char *charset_convert(struct hub *hub, gboolean to_utf8, const char *str) {
+  if(!hub->charset_open || hub->charset_gen != var_encoding_gen) {
+    charset_close(hub);
+    charset_open(hub);
+  }
+
+  // Pure ASCII is the same in every ASCII-compatible encoding
+  if(hub->charset_asciicompat && str_is_ascii(str))
+    return g_strdup(str);
+
+  // Our own strings are always valid UTF-8, those coming from the hub might
+  // not be.
+  if(hub->charset_utf8)
+    return to_utf8 ? str_utf8_fix(str) : g_strdup(str);
+
+  GIConv cd = to_utf8 ? hub->charset_to : hub->charset_from;
+  if(cd == (GIConv)-1)
+    return g_strdup("<encoding-error>");
+  return str_convert_cd(cd, str);
 }
 
 
@@ -114,6 +162,143 @@ char *nmdc_lock2key(char *lock) {
 }
 
 
+#if INTERFACE
+
+// NMDC commands, as identified by nmdc_cmd().
+enum nmdc_commands {
+  NMDCC_NONE = 0,     // Unknown command, or not a command at all
+  // Hub commands
+  NMDCC_LOCK,
+  NMDCC_SUPPORTS,
+  NMDCC_HELLO,
+  NMDCC_QUIT,
+  NMDCC_NICKLIST,
+  NMDCC_OPLIST,
+  NMDCC_USERIP,
+  NMDCC_MYINFO,
+  NMDCC_HUBNAME,
+  NMDCC_TO,
+  NMDCC_FORCEMOVE,
+  NMDCC_CONNECTTOME,
+  NMDCC_REVCONNECTTOME,
+  NMDCC_SEARCH,
+  NMDCC_SR,
+  NMDCC_GETPASS,
+  NMDCC_BADPASS,
+  NMDCC_VALIDATEDENIDE,
+  NMDCC_HUBISFULL,
+  // Client-client commands (and $Lock and $Supports from above)
+  NMDCC_MYNICK,
+  NMDCC_DIRECTION,
+  NMDCC_ADCGET,
+  NMDCC_ADCSND,
+  NMDCC_ERROR,
+  NMDCC_MAXEDOUT
+};
+
+#endif
+
+
+// Identifies the command in an NMDC message. Returns NMDCC_NONE if the message
+// does not start with a known $Command. *args is set to the first character
+// after the command name and the space that follows it.
+int nmdc_cmd(char *msg, char **args) {
+  if(msg[0] != '$')
+    return NMDCC_NONE;
+  char *name = msg+1;
+  int len = strcspn(name, " ");
+  *args = name + len + (name[len] ? 1 : 0);
+
+  // Switching on the first character followed by a full compare narrows it
+  // down to at most three candidates, ordered by how common they are.
+#define C(n, s) if(len == sizeof(s)-1 && memcmp(name, s, sizeof(s)-1) == 0) return NMDCC_##n
+  switch(name[0]) {
+  case 'A': C(ADCGET, "ADCGET"); C(ADCSND, "ADCSND"); break;
+  case 'B': C(BADPASS, "BadPass"); break;
+  case 'C': C(CONNECTTOME, "ConnectToMe"); break;
+  case 'D': C(DIRECTION, "Direction"); break;
+  case 'E': C(ERROR, "Error"); break;
+  case 'F': C(FORCEMOVE, "ForceMove"); break;
+  case 'G': C(GETPASS, "GetPass"); break;
+  case 'H': C(HELLO, "Hello"); C(HUBNAME, "HubName"); C(HUBISFULL, "HubIsFull"); break;
+  case 'L': C(LOCK, "Lock"); break;
+  case 'M': C(MYINFO, "MyINFO"); C(MYNICK, "MyNick"); C(MAXEDOUT, "MaxedOut"); break;
+  case 'N': C(NICKLIST, "NickList"); break;
+  case 'O': C(OPLIST, "OpList"); break;
+  case 'Q': C(QUIT, "Quit"); break;
+  case 'R': C(REVCONNECTTOME, "RevConnectToMe"); break;
+  case 'S': C(SEARCH, "Search"); C(SR, "SR"); C(SUPPORTS, "Supports"); break;
+  case 'T': C(TO, "To:"); break;
+  case 'U': C(USERIP, "UserIP"); break;
+  case 'V': C(VALIDATEDENIDE, "ValidateDenide"); break;
+  }
+#undef C
+  return NMDCC_NONE;
+}
+
+
+// Field splitters for NMDC command arguments. These modify the string
+// in-place and advance *str past the returned argument.
+
+// Returns the next argument, which must be non-empty, may not contain a '$',
+// and must be followed by either a space or the end of the string. Returns
+// NULL if there is no such argument.
+char *nmdc_arg(char **str) {
+  char *a = *str;
+  int len = strcspn(a, " $");
+  if(!len || a[len] == '$')
+    return NULL;
+  *str = a + len;
+  if(a[len]) {
+    a[len] = 0;
+    (*str)++;
+  }
+  return a;
+}
+
+
+// Like nmdc_arg(), but allows '$' and backslash-escaped spaces in the
+// argument, as used for the identifier in $ADCGET and $ADCSND.
+char *nmdc_escarg(char **str) {
+  char *a = *str;
+  char *e = a;
+  while(*e && *e != ' ')
+    e += e[0] == '\\' && e[1] ? 2 : 1;
+  if(e == a)
+    return NULL;
+  *str = e;
+  if(*e) {
+    *e = 0;
+    (*str)++;
+  }
+  return a;
+}
+
+
+// Returns whether str is a non-empty string of digits, optionally preceded by
+// a minus sign.
+gboolean nmdc_isnum(const char *str, gboolean neg) {
+  if(neg && *str == '-')
+    str++;
+  return *str && !str[strspn(str, "0123456789")];
+}
+
+
+// Checks whether str starts with an "a.b.c.d:port" address. Returns a pointer
+// to the first character after the address, or NULL if there is none.
+char *nmdc_addr(char *str) {
+  int i;
+  for(i=0; i<4; i++) {
+    int n = strspn(str, "0123456789");
+    if(n < 1 || n > 3 || str[n] != (i == 3 ? ':' : '.'))
+      return NULL;
+    str += n+1;
+  }
+  int n = strspn(str, "0123456789");
+  return n ? str+n : NULL;
+}
+
+
 
 
 
@@ -202,13 +387,26 @@ enum adc_commands {
 };
 
 
+// Commands and arguments up to these sizes are parsed without allocating
+// memory.
+#define ADC_CMD_BUFSIZE 1024
+#define ADC_CMD_ARGS 64
+
+// Number of parameter names that are indexed by adc_parse(): [A-Z][A-Z0-9]
+#define ADC_CMD_PARAMS (26*36)
+
 struct adc_cmd {
   char type;  // B|C|D|E|F|H|I|U
   int cmd;    // ADCC_*, but can also be something else. Unhandled commands should be ignored anyway.
   int source; // Only when type = B|D|E|F
   int dest;   // Only when type = D|E
   char **argv;
-  char argc;
+  int argc;
+  // Internal storage, use adc_cmd_free() to free any allocated memory.
+  char *buf;                          // unescaped arguments, argv points into this
+  unsigned char param[ADC_CMD_PARAMS]; // parameter name -> argv index + 1, see adc_param()
+  char *argv_buf[ADC_CMD_ARGS];
+  char str_buf[ADC_CMD_BUFSIZE];
 };
 
 
@@ -222,6 +420,44 @@ struct adc_cmd {
 #endif
 
 
+// Unescapes an ADC argument in-place. Returns FALSE on an invalid escape.
+static gboolean adc_unescape_inplace(char *str) {
+  char *dest = str;
+  while(*str) {
+    if(*str == '\\') {
+      str++;
+      if(*str == 's')
+        *dest = ' ';
+      else if(*str == 'n')
+        *dest = '\n';
+      else if(*str == '\\')
+        *dest = '\\';
+      else
+        return FALSE;
+    } else
+      *dest = *str;
+    dest++;
+    str++;
+  }
+  *dest = 0;
+  return TRUE;
+}
+
+
+// Returns the index in adc_cmd.param for the two-letter parameter name at the
+// start of str, or -1 if it is not a valid parameter name.
+static int adc_param_key(const char *str) {
+  int a = str[0], b = str[1];
+  if(a < 'A' || a > 'Z')
+    return -1;
+  if(b >= 'A' && b <= 'Z')
+    return (a-'A')*36 + (b-'A');
+  if(b >= '0' && b <= '9')
+    return (a-'A')*36 + 26 + (b-'0');
+  return -1;
+}
+
+
 static gboolean int_in_array(const int *arr, int needle) {
   for(; arr&&*arr; arr++)
     if(*arr == needle)
@@ -253,7 +489,8 @@ void adc_parse(const char *str, struct adc_cmd *c, int *feats, GError **err) {
     g_set_error_literal(err, 1, 0, "Invalid characters after command.");
     return;
   }
-  off++;
+  if(*off)
+    off++;
 
   // type = U, first argument is source CID. But we don't handle that here.
 
@@ -310,27 +547,66 @@ void adc_parse(const char *str, struct adc_cmd *c, int *feats, GError **err) {
     off += off[l] ? l+1 : l;
   }
 
-  // parse the rest of the arguments
-  char **s = g_strsplit(off, " ", 0);
-  c->argc = s ? g_strv_length(s) : 0;
-  if(s) {
-    char **a = g_new0(char *, c->argc+1);
-    int i;
-    for(i=0; i<c->argc; i++) {
-      a[i] = adc_unescape(s[i], FALSE);
-      if(!a[i]) {
-        g_set_error_literal(err, 1, 0, "Invalid escape in argument.");
-        break;
-      }
-    }
-    g_strfreev(s);
-    if(i < c->argc) {
-      g_strfreev(a);
+  // Copy the arguments into c->buf, split them and unescape them in-place
+  int len = strlen(off);
+  c->buf = len < ADC_CMD_BUFSIZE ? c->str_buf : g_malloc(len+1);
+  memcpy(c->buf, off, len+1);
+
+  int i;
+  c->argc = 0;
+  if(*off) {
+    c->argc++;
+    for(i=0; i<len; i++)
+      if(off[i] == ' ')
+        c->argc++;
+  }
+  c->argv = c->argc < ADC_CMD_ARGS ? c->argv_buf : g_new(char *, c->argc+1);
+
+  char *arg = c->buf;
+  for(i=0; i<c->argc; i++) {
+    char *next = strchr(arg, ' ');
+    if(next)
+      *(next++) = 0;
+    if(!adc_unescape_inplace(arg)) {
+      g_set_error_literal(err, 1, 0, "Invalid escape in argument.");
+      adc_cmd_free(c);
       return;
     }
-    c->argv = a;
-  } else
-    c->argv = NULL;
+    c->argv[i] = arg;
+    arg = next;
+  }
+  c->argv[i] = NULL;
+
+  // Index the named parameters
+  memset(c->param, 0, ADC_CMD_PARAMS);
+  for(i=0; i<c->argc && i<255; i++) {
+    int k = adc_param_key(c->argv[i]);
+    if(k >= 0 && !c->param[k])
+      c->param[k] = i+1;
+  }
+}
+
+
+void adc_cmd_free(struct adc_cmd *c) {
+  if(c->buf && c->buf != c->str_buf)
+    g_free(c->buf);
+  if(c->argv && c->argv != c->argv_buf)
+    g_free(c->argv);
+  c->buf = NULL;
+  c->argv = NULL;
+  c->argc = 0;
+}
+
+
+// Same as adc_getparam(c->argv+from, name, NULL), but uses the index created
+// by adc_parse() and thus runs in constant time.
+char *adc_param(struct adc_cmd *c, int from, char *name) {
+  int k = adc_param_key(name);
+  int i = k >= 0 ? c->param[k] : 0;
+  // Not indexed, or the first occurrence is before 'from'
+  if(k < 0 || (!i && c->argc > 255) || (i && i-1 < from))
+    return from <= c->argc ? adc_getparam(c->argv+from, name, NULL) : NULL;
+  return i ? c->argv[i-1]+2 : NULL;
 }
 
 
@@ -425,6 +701,7 @@ struct search_r {
   guint64 size;   // file size, G_MAXUINT64 = directory
   int slots;      // free slots
   char tth[24];   // TTH root (for regular files)
+  char *file_key; // collation key of the file name, created on demand by the UI (may be NULL)
 }
 
 struct search_type {
@@ -463,6 +740,7 @@ void search_r_free(gpointer data) {
   if(!r)
     return;
   g_free(r->file);
+  g_free(r->file_key);
   g_slice_free(struct search_r, r);
 }
 
@@ -470,6 +748,7 @@ void search_r_free(gpointer data) {
 struct search_r *search_r_copy(struct search_r *r) {
   struct search_r *res = g_slice_dup(struct search_r, r);
   res->file = g_strdup(r->file);
+  res->file_key = g_strdup(r->file_key);
   return res;
 }
 
@@ -598,10 +877,10 @@ struct search_r *search_parse_adc(struct hub *hub, struct adc_cmd *cmd) {
   char cid[24];
   if(!hub)
     base32_decode(cmd->argv[0], cid);
-  char **argv = hub ? cmd->argv : cmd->argv+1;
+  int from = hub ? 0 : 1;
 
   // file
-  r.file = adc_getparam(argv, "FN", NULL);
+  r.file = adc_param(cmd, from, "FN");
   if(!r.file)
     return NULL;
   gboolean isfile = TRUE;
@@ -611,12 +890,12 @@ struct search_r *search_parse_adc(struct hub *hub, struct adc_cmd *cmd) {
   }
 
   // tth & size
-  tmp = isfile ? adc_getparam(argv, "TR", NULL) : NULL;
+  tmp = isfile ? adc_param(cmd, from, "TR") : NULL;
   if(tmp) {
     if(!istth(tmp))
       return NULL;
     base32_decode(tmp, r.tth);
-    tmp = adc_getparam(argv, "SI", NULL);
+    tmp = adc_param(cmd, from, "SI");
     if(!tmp)
       return NULL;
     r.size = g_ascii_strtoull(tmp, &tmp2, 10);
@@ -626,7 +905,7 @@ struct search_r *search_parse_adc(struct hub *hub, struct adc_cmd *cmd) {
     r.size = G_MAXUINT64;
 
   // slots
-  tmp = adc_getparam(argv, "SL", NULL);
+  tmp = adc_param(cmd, from, "SL");
   if(tmp) {
     r.slots = g_ascii_strtoull(tmp, &tmp2, 10);
     if(tmp == tmp2 || !tmp2 || *tmp2)
@@ -643,7 +922,7 @@ struct search_r *search_parse_adc(struct hub *hub, struct adc_cmd *cmd) {
   // uid - active. Active responses must have the hubid in the token, from
   // which we can generate the uid.
   } else {
-    tmp = adc_getparam(argv, "TO", NULL);
+    tmp = adc_param(cmd, from, "TO");
     if(!tmp)
       return NULL;
     guint64 hubid = g_ascii_strtoull(tmp, &tmp2, 10);
@@ -409,6 +409,72 @@ guint64 tth_blocksize(guint64 fs, int blocks) {
 }
 
 
+#if INTERFACE
+
+// Length of the serialized state of a struct tth_ctx, see tth_save().
+#define tth_state_len (1 + 3*8 + 8 + tiger_block_size + 4 + 1 + 29*24)
+
+#endif
+
+#define tth_state_version 1
+
+
+// Serializes a TTH context into buf, which must be tth_state_len bytes long.
+// The first byte is a format version, integers are stored in little-endian.
+void tth_save(const struct tth_ctx *ctx, char *buf) {
+  int i;
+  guint64 v;
+  guint32 n;
+  *(buf++) = tth_state_version;
+  for(i=0; i<3; i++) {
+    v = GUINT64_TO_LE(ctx->tiger.hash[i]);
+    memcpy(buf, &v, 8);
+    buf += 8;
+  }
+  v = GUINT64_TO_LE(ctx->tiger.length);
+  memcpy(buf, &v, 8);
+  buf += 8;
+  memcpy(buf, ctx->tiger.message, tiger_block_size);
+  buf += tiger_block_size;
+  n = GUINT32_TO_LE(ctx->leafnum);
+  memcpy(buf, &n, 4);
+  buf += 4;
+  *(buf++) = ctx->gotfirst ? 1 : 0;
+  memcpy(buf, ctx->stack, 29*24);
+}
+
+
+// Reverse of tth_save(). Returns FALSE if buf does not hold a state in the
+// expected format.
+gboolean tth_load(struct tth_ctx *ctx, const char *buf, int len) {
+  if(len != tth_state_len || *buf != tth_state_version)
+    return FALSE;
+  buf++;
+  int i;
+  guint64 v;
+  guint32 n;
+  for(i=0; i<3; i++) {
+    memcpy(&v, buf, 8);
+    ctx->tiger.hash[i] = GUINT64_FROM_LE(v);
+    buf += 8;
+  }
+  memcpy(&v, buf, 8);
+  ctx->tiger.length = GUINT64_FROM_LE(v);
+  buf += 8;
+  memcpy(ctx->tiger.message, buf, tiger_block_size);
+  buf += tiger_block_size;
+  memcpy(&n, buf, 4);
+  n = GUINT32_FROM_LE(n);
+  buf += 4;
+  if(n >= 1<<29 || (guchar)*buf > 1)
+    return FALSE;
+  ctx->leafnum = n;
+  ctx->gotfirst = *(buf++);
+  memcpy(ctx->stack, buf, 29*24);
+  return TRUE;
+}
+
+
 
 
 
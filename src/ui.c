@@ -64,6 +64,8 @@ struct ui_tab {
   gboolean user_hide_mail : 1;
   gboolean user_hide_conn : 1;
   gboolean user_hide_ip : 1;
+  GHashTable *user_pending;    // queued changes, see ui_userlist_userchange()
+  guint user_flush;            // ui_userlist_flush() idle source
   // HUB
   gboolean hub_joincomplete : 1;
   GRegex *hub_highlight;
@@ -75,6 +77,7 @@ struct ui_tab {
   gboolean fl_loading : 1;
   gboolean fl_dirfirst : 1;
   gboolean fl_match : 1;
+  GHashTable *fl_sizeorder;    // fl_list -> guint32 index array, see ui_fl_sizeorder()
   GError *fl_err;
   char *fl_sel;
   // DL
@@ -99,6 +102,11 @@ int winrows;
 
 gboolean ui_beep = FALSE; // set to true anywhere to send a beep
 
+// Running without a user interface (--headless). The tabs and their state are
+// still maintained, but nothing is drawn and all messages are forwarded to the
+// control socket.
+gboolean ui_headless = FALSE;
+
 // uid -> tab lookup table for MSG tabs.
 GHashTable *ui_msg_tabs = NULL;
 
@@ -445,8 +453,12 @@ void ui_hub_msg(struct ui_tab *tab, struct hub_user *user, const char *msg, int
   ui_msg_msg(t, msg, replyto);
 }
 
+// The user list is only of use when it can be displayed. When headless, it
+// isn't opened at all so that its listing doesn't have to be kept up to date.
 void ui_hub_userlist_open(struct ui_tab *tab) {
-  if(tab->userlist_tab)
+  if(ui_headless)
+    ui_m(NULL, 0, "The user list is not available in headless mode.");
+  else if(tab->userlist_tab)
     ui_tab_cur = g_list_find(ui_tabs, tab->userlist_tab);
   else {
     tab->userlist_tab = ui_userlist_create(tab->hub);
@@ -455,6 +467,8 @@ void ui_hub_userlist_open(struct ui_tab *tab) {
 }
 
 
+static gboolean ui_userlist_flush(gpointer dat);
+
 gboolean ui_hub_finduser(struct ui_tab *tab, guint64 uid, const char *user, gboolean utf8) {
   struct hub_user *u =
     uid ? g_hash_table_lookup(hub_uids, &uid) :
@@ -462,9 +476,17 @@ gboolean ui_hub_finduser(struct ui_tab *tab, guint64 uid, const char *user, gboo
   if(!u || u->hub != tab->hub)
     return FALSE;
   ui_hub_userlist_open(tab);
-  // u->iter should be valid at this point.
-  tab->userlist_tab->list->sel = u->iter;
-  tab->userlist_tab->details = TRUE;
+  struct ui_tab *ul = tab->userlist_tab;
+  if(!ul) // headless
+    return TRUE;
+  // Apply any queued joins right away, the user may not be in the list yet.
+  if(ul->user_flush) {
+    g_source_remove(ul->user_flush);
+    ui_userlist_flush(ul);
+  }
+  // u->iter is valid now that there are no pending changes.
+  ul->list->sel = u->iter;
+  ul->details = TRUE;
   return TRUE;
 }
 
@@ -484,6 +506,17 @@ gboolean ui_hub_finduser(struct ui_tab *tab, guint64 uid, const char *user, gboo
 #define UIUL_IP     6
 
 
+// Returns the collation key of the user name, creating it when necessary. The
+// key is cached in the hub_user struct, so that sorting only has to do a
+// strcmp().
+static const char *ui_userlist_namekey(const struct hub_user *cu) {
+  struct hub_user *u = (struct hub_user *)cu;
+  if(!u->name_key)
+    u->name_key = g_utf8_collate_key(u->name, -1);
+  return u->name_key;
+}
+
+
 static gint ui_userlist_sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
   const struct hub_user *a = da;
   const struct hub_user *b = db;
@@ -504,7 +537,7 @@ static gint ui_userlist_sort_func(gconstpointer da, gconstpointer db, gpointer d
 
   // Username sort
   if(!o)
-    o = g_utf8_collate(a->name, b->name);
+    o = strcmp(ui_userlist_namekey(a), ui_userlist_namekey(b));
   if(!o && a->name_hub && b->name_hub)
     o = strcmp(a->name_hub, b->name_hub);
   if(!o)
@@ -522,6 +555,7 @@ struct ui_tab *ui_userlist_create(struct hub *hub) {
   tab->user_hide_conn = TRUE;
   tab->user_hide_mail = TRUE;
   tab->user_hide_ip = TRUE;
+  tab->user_pending = g_hash_table_new(g_direct_hash, g_direct_equal);
   GSequence *users = g_sequence_new(NULL);
   // populate the list
   // g_sequence_sort() uses insertion sort? in that case it is faster to insert
@@ -544,6 +578,9 @@ void ui_userlist_close(struct ui_tab *tab) {
   // To clean things up, we should also reset all hub_user->iter fields. But
   // this isn't all that necessary since they won't be used anymore until they
   // get reset in a subsequent ui_userlist_create().
+  if(tab->user_flush)
+    g_source_remove(tab->user_flush);
+  g_hash_table_destroy(tab->user_pending);
   g_sequence_free(tab->list->list);
   ui_listing_free(tab->list);
   g_free(tab->name);
@@ -840,24 +877,82 @@ static void ui_userlist_key(struct ui_tab *tab, guint64 key) {
 // Called when the hub is disconnected. All users should be removed in one go,
 // this is faster than a _userchange() for every user.
 void ui_userlist_disconnect(struct ui_tab *tab) {
+  g_hash_table_remove_all(tab->user_pending);
   g_sequence_free(tab->list->list);
   ui_listing_free(tab->list);
   tab->list = ui_listing_create(g_sequence_new(NULL));
 }
 
 
+// Values in tab->user_pending
+#define UIUL_PEND_JOIN GINT_TO_POINTER(1) // not in the list yet
+#define UIUL_PEND_NFO  GINT_TO_POINTER(2) // in the list, but may be at the wrong position
+
+
+// Applies all queued changes to the user list in one go.
+static gboolean ui_userlist_flush(gpointer dat) {
+  struct ui_tab *tab = dat;
+  tab->user_flush = 0;
+
+  GSequence *list = tab->list->list;
+  GHashTableIter iter;
+  struct hub_user *u;
+  gpointer change;
+
+  // Large batch (e.g. when joining a hub): add the new users to the end and
+  // sort the entire list.
+  if(g_hash_table_size(tab->user_pending) > (guint)g_sequence_get_length(list)/4) {
+    g_hash_table_iter_init(&iter, tab->user_pending);
+    while(g_hash_table_iter_next(&iter, (gpointer *)&u, &change))
+      if(change == UIUL_PEND_JOIN)
+        u->iter = g_sequence_append(list, u);
+    g_sequence_sort(list, ui_userlist_sort_func, tab);
+
+  // Small batch: temporarily move the changed users out of the list, so that
+  // the remaining list is properly ordered, then insert every user at the
+  // right position.
+  } else {
+    GSequence *tmp = g_sequence_new(NULL);
+    g_hash_table_iter_init(&iter, tab->user_pending);
+    while(g_hash_table_iter_next(&iter, (gpointer *)&u, &change))
+      if(change == UIUL_PEND_NFO)
+        g_sequence_move(u->iter, g_sequence_get_end_iter(tmp));
+    g_hash_table_iter_init(&iter, tab->user_pending);
+    while(g_hash_table_iter_next(&iter, (gpointer *)&u, &change)) {
+      if(change == UIUL_PEND_JOIN)
+        u->iter = g_sequence_insert_sorted(list, u, ui_userlist_sort_func, tab);
+      else
+        g_sequence_move(u->iter, g_sequence_search(list, u, ui_userlist_sort_func, tab));
+    }
+    g_sequence_free(tmp);
+  }
+
+  g_hash_table_remove_all(tab->user_pending);
+  ui_listing_inserted(tab->list);
+  return FALSE;
+}
+
+
+// Joins and info changes are queued and applied in a single batch from an idle
+// callback, quits are handled immediately since the hub_user struct is freed
+// afterwards.
 void ui_userlist_userchange(struct ui_tab *tab, int change, struct hub_user *user) {
-  if(change == UIHUB_UC_JOIN) {
-    user->iter = g_sequence_insert_sorted(tab->list->list, user, ui_userlist_sort_func, tab);
-    ui_listing_inserted(tab->list);
-  } else if(change == UIHUB_UC_QUIT) {
+  gpointer pending = g_hash_table_lookup(tab->user_pending, user);
+
+  if(change == UIHUB_UC_QUIT) {
+    g_hash_table_remove(tab->user_pending, user);
+    if(pending == UIUL_PEND_JOIN)
+      return;
     g_return_if_fail(g_sequence_get(user->iter) == (gpointer)user);
     ui_listing_remove(tab->list, user->iter);
     g_sequence_remove(user->iter);
-  } else {
-    g_sequence_sort_changed(user->iter, ui_userlist_sort_func, tab);
-    ui_listing_sorted(tab->list);
+    return;
   }
+
+  if(!pending)
+    g_hash_table_insert(tab->user_pending, user, change == UIHUB_UC_JOIN ? UIUL_PEND_JOIN : UIUL_PEND_NFO);
+  if(!tab->user_flush)
+    tab->user_flush = g_idle_add(ui_userlist_flush, tab);
 }
 
 
@@ -1166,19 +1261,89 @@ static void ui_conn_key(guint64 key) {
 #define UIFL_SIZE  1
 
 
-static gint ui_fl_sort(gconstpointer a, gconstpointer b, gpointer dat) {
-  const struct fl_list *la = a;
-  const struct fl_list *lb = b;
-  struct ui_tab *tab = dat;
+// The items of a directory are already sorted on name (fl_list_cmp()), so the
+// name ordering is simply the index into fl->sub. The size ordering is
+// computed once per directory by a stable LSD radix sort over the sizes and
+// cached as an index array in tab->fl_sizeorder. Since the input is in name
+// order, equal sizes stay ordered by name. Reversing the order and putting
+// dirs first are then only a matter of how these arrays are walked, so
+// (re)sorting a directory doesn't need a single comparison.
 
-  // dirs before files
-  if(tab->fl_dirfirst && !!la->isfile != !!lb->isfile)
-    return la->isfile ? 1 : -1;
+struct ui_fl_sizekey {
+  guint64 size;
+  guint32 idx;
+};
+
+
+static guint32 *ui_fl_sizeorder(struct ui_tab *tab, struct fl_list *fl) {
+  if(!tab->fl_sizeorder)
+    tab->fl_sizeorder = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  guint32 *order = g_hash_table_lookup(tab->fl_sizeorder, fl);
+  if(order)
+    return order;
+
+  int n = fl->sub->len;
+  struct ui_fl_sizekey *a = g_new(struct ui_fl_sizekey, n);
+  struct ui_fl_sizekey *b = g_new(struct ui_fl_sizekey, n);
+  int i, shift;
+  for(i=0; i<n; i++) {
+    a[i].size = ((struct fl_list *)g_ptr_array_index(fl->sub, i))->size;
+    a[i].idx = i;
+  }
+
+  for(shift=0; shift<64; shift+=8) {
+    guint32 count[256] = {};
+    for(i=0; i<n; i++)
+      count[(a[i].size >> shift) & 0xFF]++;
+    // all items share this byte, nothing to do
+    if(n && count[(a[0].size >> shift) & 0xFF] == n)
+      continue;
+    guint32 pos = 0;
+    for(i=0; i<256; i++) {
+      guint32 c = count[i];
+      count[i] = pos;
+      pos += c;
+    }
+    for(i=0; i<n; i++)
+      b[count[(a[i].size >> shift) & 0xFF]++] = a[i];
+    struct ui_fl_sizekey *t = a;
+    a = b;
+    b = t;
+  }
+
+  order = g_new(guint32, n);
+  for(i=0; i<n; i++)
+    order[i] = a[i].idx;
+  g_free(a);
+  g_free(b);
+  g_hash_table_insert(tab->fl_sizeorder, fl, order);
+  return order;
+}
 
-  int r = tab->order == UIFL_NAME ? fl_list_cmp(la, lb) : (la->size > lb->size ? 1 : la->size < lb->size ? -1 : 0);
-  if(!r)
-    r = tab->order == UIFL_NAME ? (la->size > lb->size ? 1 : la->size < lb->size ? -1 : 0) : fl_list_cmp(la, lb);
-  return tab->o_reverse ? -r : r;
+
+// Creates a GSequence with the items of fl in the current order of the tab.
+// The iterators of the items *sel and *top (if set) are stored in *seli and
+// *topi.
+static GSequence *ui_fl_sequence(struct ui_tab *tab, struct fl_list *fl, struct fl_list *sel, GSequenceIter **seli, struct fl_list *top, GSequenceIter **topi) {
+  GSequence *seq = g_sequence_new(NULL);
+  guint32 *order = tab->order == UIFL_SIZE ? ui_fl_sizeorder(tab, fl) : NULL;
+  int n = fl->sub->len;
+  int i, pass;
+  // with dirfirst, the first pass only adds dirs and the second only files
+  for(pass=0; pass<(tab->fl_dirfirst ? 2 : 1); pass++) {
+    for(i=0; i<n; i++) {
+      int j = tab->o_reverse ? n-1-i : i;
+      struct fl_list *cur = g_ptr_array_index(fl->sub, order ? order[j] : j);
+      if(tab->fl_dirfirst && !!cur->isfile != pass)
+        continue;
+      GSequenceIter *iter = g_sequence_append(seq, cur);
+      if(cur == sel)
+        *seli = iter;
+      if(cur == top)
+        *topi = iter;
+    }
+  }
+  return seq;
 }
 
 
@@ -1190,20 +1355,30 @@ static void ui_fl_setdir(struct ui_tab *tab, struct fl_list *fl, struct fl_list
   }
   // Open this one and select *sel, if set
   tab->fl_list = fl;
-  GSequence *seq = g_sequence_new(NULL);
   GSequenceIter *seli = NULL;
-  int i;
-  for(i=0; i<fl->sub->len; i++) {
-    GSequenceIter *iter = g_sequence_insert_sorted(seq, g_ptr_array_index(fl->sub, i), ui_fl_sort, tab);
-    if(sel == g_ptr_array_index(fl->sub, i))
-      seli = iter;
-  }
+  GSequence *seq = ui_fl_sequence(tab, fl, sel, &seli, NULL, NULL);
   tab->list = ui_listing_create(seq);
   if(seli)
     tab->list->sel = seli;
 }
 
 
+// Re-creates the listing of the current directory after the order has
+// changed, keeping the same selected and top items.
+static void ui_fl_resort(struct ui_tab *tab) {
+  struct ui_listing *ul = tab->list;
+  struct fl_list *sel = g_sequence_iter_is_end(ul->sel) ? NULL : g_sequence_get(ul->sel);
+  struct fl_list *top = g_sequence_iter_is_end(ul->top) ? NULL : g_sequence_get(ul->top);
+  GSequenceIter *seli = NULL, *topi = NULL;
+  GSequence *seq = ui_fl_sequence(tab, tab->fl_list, sel, &seli, top, &topi);
+  g_sequence_free(ul->list);
+  ul->list = seq;
+  ul->sel = seli ? seli : g_sequence_get_begin_iter(seq);
+  ul->top = topi ? topi : g_sequence_get_begin_iter(seq);
+  ui_listing_updateisbegin(ul);
+}
+
+
 static void ui_fl_matchqueue(struct ui_tab *tab, struct fl_list *root) {
   if(!tab->fl_list) {
     tab->fl_match = TRUE;
@@ -1402,6 +1577,8 @@ void ui_fl_close(struct ui_tab *tab) {
     p = p->parent;
   if(p)
     fl_list_free(p);
+  if(tab->fl_sizeorder)
+    g_hash_table_unref(tab->fl_sizeorder);
   if(tab->fl_err)
     g_error_free(tab->fl_err);
   g_free(tab->fl_sel);
@@ -1540,7 +1717,7 @@ static void ui_fl_key(struct ui_tab *tab, guint64 key) {
       g_return_if_fail(!sel->isfile || sel->hastth);
       char *excl = var_get(0, VAR_download_exclude);
       GRegex *r = excl ? g_regex_new(excl, 0, 0, NULL) : NULL;
-      dl_queue_add_fl(tab->uid, sel, NULL, r);
+      dl_queue_add_fl(tab->uid, sel, r);
       if(r)
         g_regex_unref(r);
     }
@@ -1571,8 +1748,7 @@ static void ui_fl_key(struct ui_tab *tab, guint64 key) {
   }
 
   if(sort && tab->fl_list) {
-    g_sequence_sort(tab->list->list, ui_fl_sort, tab);
-    ui_listing_sorted(tab->list);
+    ui_fl_resort(tab);
     ui_mf(NULL, 0, "Ordering by %s (%s%s)",
       tab->order == UIFL_NAME  ? "file name" : "file size",
       tab->o_reverse ? "descending" : "ascending", tab->fl_dirfirst ? ", dirs first" : "");
@@ -1703,6 +1879,23 @@ void ui_dl_listchange(struct dl *dl, int change) {
 }
 
 
+// Adds a batch of new dl items to the list. Large batches are appended and
+// sorted in one go.
+void ui_dl_listadd(GPtrArray *dls) {
+  g_return_if_fail(ui_dl);
+  GSequence *list = ui_dl->list->list;
+  gboolean sort = dls->len > (guint)g_sequence_get_length(list)/4;
+  int i;
+  for(i=0; i<dls->len; i++) {
+    struct dl *dl = g_ptr_array_index(dls, i);
+    dl->iter = sort ? g_sequence_append(list, dl) : g_sequence_insert_sorted(list, dl, ui_dl_sort_func, NULL);
+  }
+  if(sort)
+    g_sequence_sort(list, ui_dl_sort_func, NULL);
+  ui_listing_inserted(ui_dl->list);
+}
+
+
 void ui_dl_dud_listchange(struct dl_user_dl *dud, int change) {
   g_return_if_fail(ui_dl);
   if(dud->dl != ui_dl->dl_cur || !ui_dl->dl_users)
@@ -1835,6 +2028,8 @@ static void ui_dl_draw() {
   // error info
   if(sel && sel->prio == DLP_ERR)
     mvprintw(++bottom, 0, "Error: %s", dl_strerror(sel->error, sel->error_msg));
+  else if(sel && sel->moving)
+    mvprintw(++bottom, 0, "Moving to destination: %d%%", g_atomic_int_get(&sel->move_pct));
 
   // user list
   if(sel && ui_dl->details) {
@@ -2003,17 +2198,22 @@ static int ui_search_cmp_user(guint64 ua, guint64 ub) {
   struct hub_user *b = g_hash_table_lookup(hub_uids, &ub);
   int o =
     !a && !b ? (ua > ub ? 1 : ua < ub ? -1 : 0) :
-     a && !b ? 1 : !a && b ? -1 : g_utf8_collate(a->name, b->name);
+     a && !b ? 1 : !a && b ? -1 : strcmp(ui_userlist_namekey(a), ui_userlist_namekey(b));
   if(!o && a && b)
     return g_utf8_collate(a->hub->tab->name, b->hub->tab->name);
   return o;
 }
 
 
-static int ui_search_cmp_file(const char *fa, const char *fb) {
-  const char *a = strrchr(fa, '/');
-  const char *b = strrchr(fb, '/');
-  return g_utf8_collate(a?a+1:fa, b?b+1:fb);
+// Returns the collation key of the file name (without path) of a search
+// result. The key is cached in the search_r struct.
+static const char *ui_search_filekey(const struct search_r *cr) {
+  struct search_r *r = (struct search_r *)cr;
+  if(!r->file_key) {
+    const char *f = strrchr(r->file, '/');
+    r->file_key = g_utf8_collate_key(f ? f+1 : r->file, -1);
+  }
+  return r->file_key;
 }
 
 
@@ -2032,7 +2232,7 @@ static gint ui_search_sort_func(gconstpointer da, gconstpointer db, gpointer dat
 #define CMP_USER  ui_search_cmp_user(a->uid, b->uid)
 #define CMP_SIZE  (a->size == b->size ? 0 : (a->size == G_MAXUINT64 ? 0 : a->size) > (b->size == G_MAXUINT64 ? 0 : b->size) ? 1 : -1)
 #define CMP_SLOTS (a->slots > b->slots ? 1 : a->slots < b->slots ? -1 : 0)
-#define CMP_FILE  ui_search_cmp_file(a->file, b->file)
+#define CMP_FILE  strcmp(ui_search_filekey(a), ui_search_filekey(b))
 #define CMP_TTH   memcmp(a->tth, b->tth, 24)
 
   // Try 1
@@ -2047,18 +2247,37 @@ static gint ui_search_sort_func(gconstpointer da, gconstpointer db, gpointer dat
 }
 
 
+// Index of the opened search tabs. TTH searches are looked up by their root
+// (tth -> GSList of tabs), other searches are in a list and have to be matched
+// one by one.
+static GHashTable *ui_search_tth = NULL;
+static GSList *ui_search_other = NULL;
+
+
+// Whether there are any search tabs open. If not, incoming search results can
+// be ignored without parsing them.
+gboolean ui_search_active() {
+  return ui_search_other || (ui_search_tth && g_hash_table_size(ui_search_tth));
+}
+
+
+static void ui_search_addresult(struct ui_tab *t, struct search_r *r) {
+  g_sequence_insert_sorted(t->list->list, search_r_copy(r), ui_search_sort_func, t);
+  ui_listing_inserted(t->list);
+  t->prio = MAX(t->prio, UIP_LOW);
+}
+
+
 // Called when a new search result has been received. Looks through the opened
 // search tabs and adds the result to the list if it matches the query.
 void ui_search_global_result(struct search_r *r) {
-  GList *n;
-  for(n=ui_tabs; n; n=n->next) {
-    struct ui_tab *t = n->data;
-    if(t->type == UIT_SEARCH && search_match(t->search_q, r)) {
-      g_sequence_insert_sorted(t->list->list, search_r_copy(r), ui_search_sort_func, t);
-      ui_listing_inserted(t->list);
-      t->prio = MAX(t->prio, UIP_LOW);
-    }
-  }
+  GSList *n;
+  if(r->size != G_MAXUINT64 && ui_search_tth)
+    for(n=g_hash_table_lookup(ui_search_tth, r->tth); n; n=n->next)
+      ui_search_addresult(n->data, r);
+  for(n=ui_search_other; n; n=n->next)
+    if(search_match(((struct ui_tab *)n->data)->search_q, r))
+      ui_search_addresult(n->data, r);
 }
 
 
@@ -2089,11 +2308,30 @@ struct ui_tab *ui_search_create(struct hub *hub, struct search_q *q) {
 
   // Create an empty list
   tab->list = ui_listing_create(g_sequence_new(search_r_free));
+
+  // Add to the index
+  if(q->type == 9) {
+    if(!ui_search_tth)
+      ui_search_tth = g_hash_table_new(g_int_hash, tiger_hash_equal);
+    GSList *l = g_hash_table_lookup(ui_search_tth, q->tth);
+    g_hash_table_replace(ui_search_tth, q->tth, g_slist_prepend(l, tab));
+  } else
+    ui_search_other = g_slist_prepend(ui_search_other, tab);
   return tab;
 }
 
 
 void ui_search_close(struct ui_tab *tab) {
+  struct search_q *q = tab->search_q;
+  if(q->type == 9) {
+    GSList *l = g_slist_remove(g_hash_table_lookup(ui_search_tth, q->tth), tab);
+    // The key may point into the search_q of this tab, so always re-insert
+    // with the key of a remaining tab.
+    g_hash_table_remove(ui_search_tth, q->tth);
+    if(l)
+      g_hash_table_insert(ui_search_tth, ((struct ui_tab *)l->data)->search_q->tth, l);
+  } else
+    ui_search_other = g_slist_remove(ui_search_other, tab);
   search_q_free(tab->search_q);
   g_sequence_free(tab->list->list);
   ui_listing_free(tab->list);
@@ -2398,7 +2636,11 @@ static gboolean ui_m_mainthread(gpointer dat) {
   else if(!(msg->flags & UIM_DIRECT) && !g_list_find(ui_tabs, tab))
     goto ui_m_cleanup;
 
-  gboolean notify = (msg->flags & UIM_NOTIFY) || !tab->log;
+  if(ui_headless && msg->msg)
+    ctl_m(tab, msg->msg);
+
+  // There is no status bar when headless
+  gboolean notify = !ui_headless && ((msg->flags & UIM_NOTIFY) || !tab->log);
 
   if(notify && ui_m_text) {
     g_free(ui_m_text);
@@ -2489,7 +2731,8 @@ void ui_tab_remove(struct ui_tab *tab) {
 }
 
 
-void ui_init() {
+void ui_init(gboolean headless) {
+  ui_headless = headless;
   ui_msg_tabs = g_hash_table_new(g_int64_hash, g_int64_equal);
 
   // global textinput field
@@ -2498,6 +2741,9 @@ void ui_init() {
   // first tab = main tab
   ui_tab_open(ui_main_create(), TRUE, NULL);
 
+  if(ui_headless)
+    return;
+
   // init curses
   initscr();
   raw();
@@ -2645,70 +2891,131 @@ static void ui_draw_tablist(int xoffset) {
 #undef prio2a
 
 
-void ui_draw() {
+#if INTERFACE
+
+// Screen regions, see ui_draw_dirty()
+#define UID_TITLE   1 // first line
+#define UID_TABLIST 2 // second-last line, time and tab list
+#define UID_STATUS  4 // last line
+#define UID_BODY    8 // tab contents, including any text input
+#define UID_ALL    15
+
+#endif
+
+
+// Regions that have changed since the last draw
+static int ui_dirty = 0;
+// Time of the last draw, in milliseconds
+static gint64 ui_lastdraw = 0;
+
+
+static gint64 ui_draw_now() {
+  GTimeVal tv;
+  g_get_current_time(&tv);
+  return ((gint64)tv.tv_sec)*1000 + tv.tv_usec/1000;
+}
+
+
+// Redraws the regions in ui_dirty. Unchanged regions are left alone, curses
+// will then also not have to compare them with the terminal state.
+static void ui_draw_regions() {
+  if(ui_headless)
+    return;
   struct ui_tab *curtab = ui_tab_cur->data;
   curtab->prio = UIP_EMPTY;
 
+  int oldrows = winrows, oldcols = wincols;
   getmaxyx(stdscr, winrows, wincols);
-  curs_set(0); // may be overridden later on by a textinput widget
-  erase();
+  int dirty = oldrows != winrows || oldcols != wincols ? UID_ALL : ui_dirty;
+  ui_dirty = 0;
+  ui_lastdraw = ui_draw_now();
+
+  // Remember the cursor position set by a textinput widget, in case the body
+  // isn't redrawn.
+  int cury, curx;
+  getyx(stdscr, cury, curx);
+
+  if(dirty == UID_ALL)
+    erase();
+  else if(dirty & UID_BODY) {
+    int i;
+    for(i=1; i<winrows-2; i++) {
+      move(i, 0);
+      clrtoeol();
+    }
+  }
+  if(dirty & UID_BODY)
+    curs_set(0); // may be overridden later on by a textinput widget
 
   // first line - title
-  char *title =
-    curtab->type == UIT_MAIN     ? ui_main_title() :
-    curtab->type == UIT_HUB      ? ui_hub_title(curtab) :
-    curtab->type == UIT_USERLIST ? ui_userlist_title(curtab) :
-    curtab->type == UIT_MSG      ? ui_msg_title(curtab) :
-    curtab->type == UIT_CONN     ? ui_conn_title() :
-    curtab->type == UIT_FL       ? ui_fl_title(curtab) :
-    curtab->type == UIT_DL       ? ui_dl_title() :
-    curtab->type == UIT_SEARCH   ? ui_search_title(curtab) : g_strdup("");
-  attron(UIC(title));
-  mvhline(0, 0, ' ', wincols);
-  mvaddstr(0, 0, title);
-  attroff(UIC(title));
-  g_free(title);
+  if(dirty & UID_TITLE) {
+    char *title =
+      curtab->type == UIT_MAIN     ? ui_main_title() :
+      curtab->type == UIT_HUB      ? ui_hub_title(curtab) :
+      curtab->type == UIT_USERLIST ? ui_userlist_title(curtab) :
+      curtab->type == UIT_MSG      ? ui_msg_title(curtab) :
+      curtab->type == UIT_CONN     ? ui_conn_title() :
+      curtab->type == UIT_FL       ? ui_fl_title(curtab) :
+      curtab->type == UIT_DL       ? ui_dl_title() :
+      curtab->type == UIT_SEARCH   ? ui_search_title(curtab) : g_strdup("");
+    attron(UIC(title));
+    mvhline(0, 0, ' ', wincols);
+    mvaddstr(0, 0, title);
+    attroff(UIC(title));
+    g_free(title);
+  }
 
   // second-last line - time and tab list
-  mvhline(winrows-2, 0, ACS_HLINE, wincols);
-  // time
-  int xoffset = 0;
-  char *tfmt = var_get(0, VAR_ui_time_format);
-  if(strcmp(tfmt, "-") != 0) {
+  if(dirty & UID_TABLIST) {
+    mvhline(winrows-2, 0, ACS_HLINE, wincols);
+    // time
+    int xoffset = 0;
+    char *tfmt = var_get(0, VAR_ui_time_format);
+    if(strcmp(tfmt, "-") != 0) {
 #if GLIB_CHECK_VERSION(2,26,0)
-    GDateTime *tm = g_date_time_new_now_local();
-    char *ts = g_date_time_format(tm, tfmt);
-    mvaddstr(winrows-2, 1, ts);
-    xoffset = 2 + str_columns(ts);
-    g_free(ts);
-    g_date_time_unref(tm);
+      GDateTime *tm = g_date_time_new_now_local();
+      char *ts = g_date_time_format(tm, tfmt);
+      mvaddstr(winrows-2, 1, ts);
+      xoffset = 2 + str_columns(ts);
+      g_free(ts);
+      g_date_time_unref(tm);
 #else
-    // Pre-2.6 users will have a possible buffer overflow and a slightly
-    // different formatting function. Just fucking update your system already!
-    time_t tm = time(NULL);
-    char ts[250];
-    strftime(ts, 11, tfmt, localtime(&tm));
-    mvaddstr(winrows-2, 1, ts);
-    xoffset = 2 + str_columns(ts);
+      // Pre-2.6 users will have a possible buffer overflow and a slightly
+      // different formatting function. Just fucking update your system already!
+      time_t tm = time(NULL);
+      char ts[250];
+      strftime(ts, 11, tfmt, localtime(&tm));
+      mvaddstr(winrows-2, 1, ts);
+      xoffset = 2 + str_columns(ts);
 #endif
+    }
+    // tabs
+    ui_draw_tablist(xoffset);
   }
-  // tabs
-  ui_draw_tablist(xoffset);
 
   // last line - status info or notification
-  ui_draw_status();
+  if(dirty & UID_STATUS) {
+    if(dirty != UID_ALL) {
+      move(winrows-1, 0);
+      clrtoeol();
+    }
+    ui_draw_status();
+  }
 
   // tab contents
-  switch(curtab->type) {
-  case UIT_MAIN:     ui_main_draw(); break;
-  case UIT_HUB:      ui_hub_draw(curtab);  break;
-  case UIT_USERLIST: ui_userlist_draw(curtab);  break;
-  case UIT_MSG:      ui_msg_draw(curtab);  break;
-  case UIT_CONN:     ui_conn_draw(); break;
-  case UIT_FL:       ui_fl_draw(curtab); break;
-  case UIT_DL:       ui_dl_draw(); break;
-  case UIT_SEARCH:   ui_search_draw(curtab); break;
-  }
+  if(dirty & UID_BODY) {
+    switch(curtab->type) {
+    case UIT_MAIN:     ui_main_draw(); break;
+    case UIT_HUB:      ui_hub_draw(curtab);  break;
+    case UIT_USERLIST: ui_userlist_draw(curtab);  break;
+    case UIT_MSG:      ui_msg_draw(curtab);  break;
+    case UIT_CONN:     ui_conn_draw(); break;
+    case UIT_FL:       ui_fl_draw(curtab); break;
+    case UIT_DL:       ui_dl_draw(); break;
+    case UIT_SEARCH:   ui_search_draw(curtab); break;
+    }
+  } else
+    move(cury, curx);
 
   refresh();
   if(ui_beep) {
@@ -2718,9 +3025,43 @@ void ui_draw() {
 }
 
 
-gboolean ui_checkupdate() {
+// Redraws the entire screen. Used after user input, which may affect anything.
+void ui_draw() {
+  ui_dirty = UID_ALL;
+  ui_draw_regions();
+}
+
+
+// Marks the given regions as changed and draws whatever has changed, unless
+// the screen has been updated less than ui_frame_interval milliseconds ago.
+// In that case the changes are drawn by a later call.
+void ui_draw_dirty(int regions) {
+  if(ui_headless)
+    return;
+  struct ui_tab *cur = ui_tab_cur->data;
+  ui_dirty |= regions;
+  if(ui_m_updated)
+    ui_dirty |= UID_STATUS;
+  if(cur->log && cur->log->updated)
+    ui_dirty |= UID_BODY;
+  if(!ui_dirty && !ui_beep)
+    return;
+
+  gint64 now = ui_draw_now();
+  if(now >= ui_lastdraw && now - ui_lastdraw < var_get_int(0, VAR_ui_frame_interval))
+    return;
+  ui_draw_regions();
+}
+
+
+// Called every second. The title, time and status line always change, the
+// tab contents only need to be redrawn for tabs that display information
+// without being notified of its changes. The main and message tabs only
+// display a log window, which has its own update tracking.
+void ui_draw_tick() {
   struct ui_tab *cur = ui_tab_cur->data;
-  return ui_m_updated || ui_beep || (cur->log && cur->log->updated);
+  ui_draw_dirty(UID_TITLE | UID_TABLIST | UID_STATUS
+    | (cur->type == UIT_MAIN || cur->type == UIT_MSG ? 0 : UID_BODY));
 }
 
 
@@ -185,6 +185,8 @@ char *ui_color_str_gen(int fd, int bg, int x) {
 
 // TODO: re-use color pairs when we have too many (>64) color groups
 void ui_colors_update() {
+  if(ui_headless)
+    return;
   int pair = 0;
   struct ui_color *c = ui_colors;
   for(; c->var>=0; c++) {
@@ -238,6 +240,13 @@ struct ui_logwindow {
 
 
 void ui_logwindow_addline(struct ui_logwindow *lw, const char *msg, gboolean raw, gboolean nolog) {
+  // Nothing is ever displayed when headless, only the log file is of use.
+  if(ui_headless) {
+    if(!nolog && lw->logfile)
+      logfile_add(lw->logfile, msg);
+    return;
+  }
+
   if(lw->lastlog == lw->lastvis)
     lw->lastvis = lw->lastlog + 1;
   lw->lastlog++;
@@ -308,7 +317,7 @@ struct ui_logwindow *ui_logwindow_create(const char *file, int load) {
   if(file) {
     lw->logfile = logfile_create(file);
 
-    if(load)
+    if(load && !ui_headless)
       ui_logwindow_load(lw, lw->logfile->path, load);
   }
   return lw;
@@ -1123,9 +1132,10 @@ gboolean ui_listing_key(struct ui_listing *ul, guint64 key, int page) {
 int ui_listing_draw(struct ui_listing *ul, int top, int bottom, void (*cb)(struct ui_listing *, GSequenceIter *, int, void *), void *dat) {
   // get or update the top row to make sure sel is visible
   int height = 1 + bottom - top;
-  int row_last = g_sequence_iter_get_position(g_sequence_get_end_iter(ul->list));
+  int row_last = g_sequence_get_length(ul->list);
   int row_top = g_sequence_iter_get_position(ul->top);
   int row_sel = g_sequence_iter_get_position(ul->sel);
+  int row_oldtop = row_top;
   // sel is before top? top = sel!
   if(row_top > row_sel)
     row_top = row_sel;
@@ -1135,7 +1145,10 @@ int ui_listing_draw(struct ui_listing *ul, int top, int bottom, void (*cb)(struc
   // make sure there are no empty lines when len > height
   if(row_top && row_top+height > row_last)
     row_top = MAX(0, row_last-height);
-  ul->top = g_sequence_get_iter_at_pos(ul->list, row_top);
+  // GSequence keeps subtree sizes, so these position lookups are O(log n).
+  // Only look for the new top when it has actually moved.
+  if(row_top != row_oldtop)
+    ul->top = g_sequence_get_iter_at_pos(ul->list, row_top);
 
   // draw
   GSequenceIter *n = ul->top;
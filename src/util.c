@@ -75,6 +75,15 @@ char *str_convert(const char *to, const char *from, const char *str) {
     g_critical("No conversion from '%s' to '%s': %s", from, to, g_strerror(errno));
     return g_strdup("<encoding-error>");
   }
+  char *dest = str_convert_cd(cd, str);
+  g_iconv_close(cd);
+  return dest;
+}
+
+
+// Same as str_convert(), but with an already opened conversion descriptor,
+// which is left in the initial state after the conversion.
+char *str_convert_cd(GIConv cd, const char *str) {
   gsize inlen = strlen(str);
   gsize outlen = inlen+96;
   gsize outsize = inlen+100;
@@ -106,12 +115,41 @@ char *str_convert(const char *to, const char *from, const char *str) {
     } else
       g_warn_if_reached();
   }
+  // Reset the shift state, in case the descriptor is re-used
+  g_iconv(cd, NULL, NULL, NULL, NULL);
   memset(outbuf, 0, 4);
-  g_iconv_close(cd);
   return dest;
 }
 
 
+// Whether the string only consists of 7-bit ASCII characters, which are the
+// same in all ASCII-compatible encodings.
+gboolean str_is_ascii(const char *str) {
+  for(; *str; str++)
+    if(*str & 0x80)
+      return FALSE;
+  return TRUE;
+}
+
+
+// Returns a copy of a supposedly UTF-8 string, with invalid bytes replaced by
+// question marks. This gives the same result as str_convert() from UTF-8 to
+// UTF-8, but without the overhead of iconv.
+char *str_utf8_fix(const char *str) {
+  const char *end;
+  if(g_utf8_validate(str, -1, &end))
+    return g_strdup(str);
+  GString *dest = g_string_sized_new(strlen(str));
+  do {
+    g_string_append_len(dest, str, end-str);
+    g_string_append_c(dest, '?');
+    str = end+1;
+  } while(!g_utf8_validate(str, -1, &end));
+  g_string_append(dest, str);
+  return g_string_free(dest, FALSE);
+}
+
+
 // Test that conversion is possible from UTF-8 to fmt and backwards.  Not a
 // very comprehensive test, but ensures str_convert() can do its job.
 // The reason for this test is to make sure the conversion *exists*,
@@ -399,6 +437,40 @@ void str_arg2_split(char *str, char **first, char **second) {
 }
 
 
+// Reference-counted string interning, for strings that are likely to have
+// many duplicates (e.g. client names in user lists). str_intern() returns a
+// shared copy of str, which must not be modified and must be released with
+// str_unintern(). Not thread-safe.
+// Key = string, value = GUINT_TO_POINTER(number of references)
+static GHashTable *str_intern_table = NULL;
+
+char *str_intern(const char *str) {
+  if(!str_intern_table)
+    str_intern_table = g_hash_table_new(g_str_hash, g_str_equal);
+  gpointer key, cnt;
+  if(g_hash_table_lookup_extended(str_intern_table, str, &key, &cnt))
+    g_hash_table_insert(str_intern_table, key, GUINT_TO_POINTER(GPOINTER_TO_UINT(cnt)+1));
+  else {
+    key = g_strdup(str);
+    g_hash_table_insert(str_intern_table, key, GUINT_TO_POINTER(1));
+  }
+  return key;
+}
+
+
+void str_unintern(char *str) {
+  gpointer key, cnt;
+  if(!str || !g_hash_table_lookup_extended(str_intern_table, str, &key, &cnt))
+    return;
+  if(GPOINTER_TO_UINT(cnt) > 1)
+    g_hash_table_insert(str_intern_table, key, GUINT_TO_POINTER(GPOINTER_TO_UINT(cnt)-1));
+  else {
+    g_hash_table_remove(str_intern_table, key);
+    g_free(key);
+  }
+}
+
+
 // Perform a binary search on a GPtrArray, returning the index of the found
 // item. The result is undefined if the array is not sorted according to `cmp'.
 // Returns -1 when nothing is found.
@@ -856,7 +928,10 @@ char *darray_get_dat(char *v, int *l) {
  *   ratecalc_reset(&thing);
  *   ratecalc_unregister(&thing);
  *
- * ratecalc_calc() should be called with a one-second interval
+ * ratecalc_calc() should be called with a one-second interval, it calculates
+ * the rates and reads the configured limits. The actual bandwidth is handed
+ * out in small portions every RATECALC_TICK milliseconds by a separate thread,
+ * which also wakes up any threads waiting in ratecalc_request().
  */
 
 #if INTERFACE
@@ -869,17 +944,20 @@ char *darray_get_dat(char *v, int *l) {
 #define RCC_MAX  RCC_DOWN
 
 struct ratecalc {
-  GStaticMutex lock; // protects total, last, rate and burst
+  GStaticMutex lock; // protects total, last and rate
   gint64 total;
   gint64 last;
-  int burst;
+  int pending; // bytes added since the last ratecalc_calc(), atomic
+  int burst;   // atomic
   int rate;
   int reg; // 0 = not registered, >1 = registered with class #n
 };
 
 #define ratecalc_reset(rc) do {\
     g_static_mutex_lock(&((rc)->lock));\
-    (rc)->total = (rc)->last = (rc)->rate = (rc)->burst = 0;\
+    (rc)->total = (rc)->last = (rc)->rate = 0;\
+    g_atomic_int_set(&(rc)->pending, 0);\
+    g_atomic_int_set(&(rc)->burst, 0);\
     g_static_mutex_unlock(&((rc)->lock));\
   } while(0)
 
@@ -889,29 +967,43 @@ struct ratecalc {
     ratecalc_reset(rc);\
   } while(0)
 
-// TODO: get some burst allocated upon registering? Otherwise a transfer will
-// block until _calc() has assigned some bandwidth to it...
 #define ratecalc_register(rc, n) do { if(!(rc)->reg) {\
+    g_static_mutex_lock(&ratecalc_list_lock);\
     ratecalc_list = g_slist_prepend(ratecalc_list, rc);\
     (rc)->reg = n;\
+    g_static_mutex_unlock(&ratecalc_list_lock);\
   } } while(0)
 
 // TODO: give rc->burst back to the class? (in particular the negative ones)
 #define ratecalc_unregister(rc) do {\
+    g_static_mutex_lock(&ratecalc_list_lock);\
     ratecalc_list = g_slist_remove(ratecalc_list, rc);\
-    (rc)->reg = (rc)->rate = (rc)->burst = 0;\
+    (rc)->reg = (rc)->rate = 0;\
+    g_atomic_int_set(&(rc)->burst, 0);\
+    g_static_mutex_unlock(&ratecalc_list_lock);\
   } while(0)
 
 #endif
 
+// Interval between two refills, in milliseconds. When no class is being
+// limited, the refill thread wakes up less often.
+#define RATECALC_TICK      10
+#define RATECALC_IDLE_TICK 250
+
 GSList *ratecalc_list = NULL;
+GStaticMutex ratecalc_list_lock = G_STATIC_MUTEX_INIT; // protects ratecalc_list and rc->reg
+
+static int ratecalc_max[RCC_MAX+1]; // configured limits per class, 0 = unlimited (atomic)
+static GMutex *ratecalc_lock;       // protects ratecalc_waiters and ratecalc_limited
+static GCond *ratecalc_refilled;    // broadcasted after a refill when there are waiters
+static GCond *ratecalc_kick;        // wakes up the refill thread when it's idle
+static int ratecalc_waiters = 0;
+static gboolean ratecalc_limited = TRUE;
 
 
 void ratecalc_add(struct ratecalc *rc, int b) {
-  g_static_mutex_lock(&rc->lock);
-  rc->total += b;
-  rc->burst -= b;
-  g_static_mutex_unlock(&rc->lock);
+  g_atomic_int_add(&rc->pending, b);
+  g_atomic_int_add(&rc->burst, -b);
 }
 
 
@@ -923,60 +1015,82 @@ int ratecalc_rate(struct ratecalc *rc) {
 }
 
 
-static int ratecalc_burst(struct ratecalc *rc) {
+gint64 ratecalc_total(struct ratecalc *rc) {
   g_static_mutex_lock(&rc->lock);
-  int r = rc->burst;
+  gint64 r = rc->total + g_atomic_int_get(&rc->pending);
   g_static_mutex_unlock(&rc->lock);
   return r;
 }
 
 
-gint64 ratecalc_total(struct ratecalc *rc) {
-  g_static_mutex_lock(&rc->lock);
-  gint64 r = rc->total;
-  g_static_mutex_unlock(&rc->lock);
-  return r;
+static void ratecalc_setmax() {
+  g_atomic_int_set(&ratecalc_max[RCC_HASH], var_get_int(0, VAR_hash_rate));
+  g_atomic_int_set(&ratecalc_max[RCC_UP],   var_get_int(0, VAR_upload_rate));
+  g_atomic_int_set(&ratecalc_max[RCC_DOWN], var_get_int(0, VAR_download_rate));
 }
 
 
-// Calculates rc->rate and rc->burst.
+// Calculates rc->rate and reads the configured limits.
 void ratecalc_calc() {
-  GSList *n;
-  // Bytes allocated to each class
-  int maxburst[RCC_MAX+1] = {};
-  maxburst[RCC_HASH] = var_get_int(0, VAR_hash_rate);
-  maxburst[RCC_UP]   = var_get_int(0, VAR_upload_rate);
-  maxburst[RCC_DOWN] = var_get_int(0, VAR_download_rate);
-  int i;
-  for(i=0; i<=RCC_MAX; i++)
-    if(!maxburst[i])
-      maxburst[i] = INT_MAX;
+  ratecalc_setmax();
 
-  int left[RCC_MAX+1]; // Number of bytes left to distribute
-  int nums[RCC_MAX+1] = {}; // Number of rc structs with burst < max
-  memcpy(left, maxburst, (RCC_MAX+1)*sizeof(int));
-
-  // Pass one: calculate rc->rate, substract negative burst values from left[] and calculate nums[].
+  GSList *n;
+  g_static_mutex_lock(&ratecalc_list_lock);
   for(n=ratecalc_list; n; n=n->next) {
     struct ratecalc *rc = n->data;
     g_static_mutex_lock(&rc->lock);
+    int p = g_atomic_int_get(&rc->pending);
+    g_atomic_int_add(&rc->pending, -p);
+    rc->total += p;
     gint64 diff = rc->total - rc->last;
     rc->rate = diff + ((rc->rate - diff) / 2);
     rc->last = rc->total;
-    if(rc->burst < 0) {
-      int sub = MIN(left[rc->reg], -rc->burst);
+    g_static_mutex_unlock(&rc->lock);
+  }
+  g_static_mutex_unlock(&ratecalc_list_lock);
+}
+
+
+// Distributes the bandwidth for one tick of the given length (in ms) among the
+// registered ratecalc structs. Must be called with ratecalc_list_lock held.
+// Returns whether any class is being limited.
+static gboolean ratecalc_refill(int ms) {
+  GSList *n;
+  gboolean limited = FALSE;
+  // Bytes allocated to each class for this tick, and the maximum burst of a
+  // single ratecalc struct (a quarter of a second worth of bandwidth).
+  int left[RCC_MAX+1]; // Number of bytes left to distribute
+  int maxburst[RCC_MAX+1];
+  int nums[RCC_MAX+1] = {}; // Number of rc structs with burst < max
+  int i;
+  for(i=0; i<=RCC_MAX; i++) {
+    int max = g_atomic_int_get(&ratecalc_max[i]);
+    if(max <= 0)
+      left[i] = maxburst[i] = INT_MAX;
+    else {
+      limited = TRUE;
+      left[i] = MAX(1, ((gint64)max)*ms/1000);
+      maxburst[i] = MAX(left[i], max/4);
+    }
+  }
+
+  // Pass one: substract negative burst values from left[] and calculate nums[].
+  for(n=ratecalc_list; n; n=n->next) {
+    struct ratecalc *rc = n->data;
+    int b = g_atomic_int_get(&rc->burst);
+    if(b < 0) {
+      int sub = MIN(left[rc->reg], -b);
       left[rc->reg] -= sub;
-      rc->burst += sub;
+      g_atomic_int_add(&rc->burst, sub);
+      b += sub;
     }
-    if(rc->burst < maxburst[rc->reg])
+    // Other threads only ever decrease the burst, so this won't exceed maxburst
+    if(b < maxburst[rc->reg])
       nums[rc->reg]++;
     else
-      rc->burst = maxburst[rc->reg];
-    g_static_mutex_unlock(&rc->lock);
+      g_atomic_int_add(&rc->burst, maxburst[rc->reg]-b);
   }
 
-  //g_debug("Num: %d - %d - %d", nums[2], nums[3], nums[4]);
-
   // Pass 2..i+1: distribute bandwidth from left[] among the ratecalc structures.
   // (The i variable is to limit the number of passes, otherwise it easily gets into an infinite loop)
   i = 3;
@@ -985,7 +1099,9 @@ void ratecalc_calc() {
     gboolean c = FALSE;
     int j;
     for(j=2; j<=RCC_MAX; j++) {
-      bwp[j] = nums[j] ? left[j]/nums[j] : 0;
+      bwp[j] = nums[j] ? MAX(1, left[j]/nums[j]) : 0;
+      if(left[j] <= 0)
+        bwp[j] = 0;
       if(bwp[j] > 0)
         c = TRUE;
     }
@@ -995,22 +1111,70 @@ void ratecalc_calc() {
     // Loop through the ratecalc structs and assign it some BW
     for(n=ratecalc_list; n; n=n->next) {
       struct ratecalc *rc = n->data;
-      if(bwp[rc->reg] > 0) {
-        g_static_mutex_lock(&rc->lock);
-        int alloc = MIN(maxburst[rc->reg]-rc->burst, bwp[rc->reg]);
-        //g_debug("Allocing class %d(num=%d), %d new bytes to %d", rc->reg, nums[rc->reg], alloc, rc->burst);
-        rc->burst += alloc;
+      if(bwp[rc->reg] > 0 && left[rc->reg] > 0) {
+        int alloc = MIN(left[rc->reg], MIN(maxburst[rc->reg]-g_atomic_int_get(&rc->burst), bwp[rc->reg]));
+        if(alloc <= 0)
+          continue;
+        g_atomic_int_add(&rc->burst, alloc);
         left[rc->reg] -= alloc;
-        g_static_mutex_unlock(&rc->lock);
-        if(alloc > 0 && alloc < bwp[rc->reg])
+        if(alloc < bwp[rc->reg])
           nums[rc->reg]--;
       }
     }
-    //g_debug("Left after #%d: %d - %d - %d", 3-i, left[2], left[3], left[4]);
   }
+  return limited;
+}
 
-  //g_debug("Left after distribution: %d - %d - %d", left[2], left[3], left[4]);
-  // TODO: distribute the last remaining BW on a first-find basis?
+
+// Milliseconds on the monotonic clock, unaffected by changes to the system time.
+static gint64 ratecalc_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (gint64)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+
+static gpointer ratecalc_thread(gpointer dat) {
+  GTimeVal end;
+  gint64 last = ratecalc_now();
+  g_mutex_lock(ratecalc_lock);
+  while(1) {
+    // g_cond_timed_wait() only accepts a wall clock deadline. A jump of the
+    // system clock may cause a wakeup too early or too late, but the time is
+    // always measured on the monotonic clock below.
+    g_get_current_time(&end);
+    g_time_val_add(&end, (ratecalc_limited ? RATECALC_TICK : RATECALC_IDLE_TICK)*1000);
+    g_cond_timed_wait(ratecalc_kick, ratecalc_lock, &end);
+    g_mutex_unlock(ratecalc_lock);
+
+    // Hand out the bandwidth for the time that has actually passed, so that
+    // an early wakeup or a late one doesn't affect the rate. Nothing is handed
+    // out when woken up again within the same millisecond.
+    gint64 ms = ratecalc_now() - last;
+    gboolean limited = TRUE;
+    if(ms > 0) {
+      last += ms;
+      g_static_mutex_lock(&ratecalc_list_lock);
+      limited = ratecalc_refill(MIN(ms, 1000));
+      g_static_mutex_unlock(&ratecalc_list_lock);
+    }
+
+    g_mutex_lock(ratecalc_lock);
+    if(ms > 0)
+      ratecalc_limited = limited;
+    if(ratecalc_waiters)
+      g_cond_broadcast(ratecalc_refilled);
+  }
+  return NULL;
+}
+
+
+void ratecalc_global_init() {
+  ratecalc_lock = g_mutex_new();
+  ratecalc_refilled = g_cond_new();
+  ratecalc_kick = g_cond_new();
+  ratecalc_setmax();
+  g_thread_create(ratecalc_thread, NULL, FALSE, NULL);
 }
 
 
@@ -1019,21 +1183,26 @@ void ratecalc_calc() {
 // burst > 0. Returns the number of bytes that are allowed to be processed
 // before calling this function again, or 0 when it has been cancelled.
 int ratecalc_request(struct ratecalc *rc, GCancellable *can) {
-  // This waiting loop is based on g_socket_condition_wait()
-  GPollFD poll_fd[1];
-  g_cancellable_make_pollfd(can, &poll_fd[0]);
-  int r = 0;
-  int b;
-  while(r <= 0 && (b = ratecalc_burst(rc)) <= 0) {
-    // Wake up 4 times per second. If the resource is CPU or HDD I/O
-    // constrained, then this means that at most 1/4th of the possible usage
-    // time is "thrown away". I don't expect this to be much of an issue,
-    // however.
-    r = g_poll(poll_fd, 1, 250);
-    g_return_val_if_fail(r >= 0 || errno == EINTR, -1);
+  int b = g_atomic_int_get(&rc->burst);
+  if(b > 0)
+    return b;
+
+  g_mutex_lock(ratecalc_lock);
+  ratecalc_waiters++;
+  // Make sure the refill thread isn't sleeping for longer than necessary
+  if(!ratecalc_limited)
+    g_cond_signal(ratecalc_kick);
+  while((b = g_atomic_int_get(&rc->burst)) <= 0 && !g_cancellable_is_cancelled(can)) {
+    // The timeout is only there to check for cancellation, the refill thread
+    // wakes us up when there is new bandwidth available.
+    GTimeVal end;
+    g_get_current_time(&end);
+    g_time_val_add(&end, 250*1000);
+    g_cond_timed_wait(ratecalc_refilled, ratecalc_lock, &end);
   }
-  g_cancellable_release_fd(can);
-  return r > 1 ? 0 : b;
+  ratecalc_waiters--;
+  g_mutex_unlock(ratecalc_lock);
+  return g_cancellable_is_cancelled(can) ? 0 : b;
 }
 
 
@@ -316,6 +316,13 @@ static char *p_backlog(const char *val, GError **err) {
 }
 
 
+// ui_frame_interval
+
+static char *p_frame_interval(const char *val, GError **err) {
+  return p_int_range(val, 0, 10000, "Interval must be between 0 and 10000 milliseconds.", err);
+}
+
+
 // nick
 
 static char *p_nick(const char *val, GError **err) {
@@ -469,7 +476,7 @@ static gboolean s_dl_inc_dir(guint64 hub, const char *key, const char *val, GErr
 
   if(a.st_dev != b.st_dev)
     ui_m(NULL, 0, "WARNING: The download directory is not on the same filesystem as the incoming"
-                  " directory. This may cause the program to hang when downloading large files.");
+                  " directory. Finished downloads will have to be copied, which may take a while for large files.");
   db_vars_set(hub, key, val);
   return TRUE;
 }
@@ -497,6 +504,16 @@ static char *p_encoding(const char *val, GError **err) {
   return g_strdup(val);
 }
 
+// Incremented whenever an encoding setting changes, to invalidate the
+// conversion descriptors cached by charset_convert().
+int var_encoding_gen = 0;
+
+static gboolean s_encoding(guint64 hub, const char *key, const char *val, GError **err) {
+  db_vars_set(hub, key, val);
+  var_encoding_gen++;
+  return TRUE;
+}
+
 static void su_encoding(const char *old, const char *val, char **sug) {
   static struct flag_option encoding_flags[] = {
     {1,"CP1250"}, {1,"CP1251"}, {1,"CP1252"}, {1,"ISO-2022-JP"}, {1,"ISO-8859-2"}, {1,"ISO-8859-7"},
@@ -838,7 +855,7 @@ struct var {
   V(download_rate,    1,0, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)\
   V(download_slots,   1,0, f_int,          p_int,           NULL,          NULL,         s_download_slots,"3")\
   V(email,            1,1, f_id,           p_id,            su_old,        NULL,         s_hubinfo,       NULL)\
-  V(encoding,         1,1, f_id,           p_encoding,      su_encoding,   NULL,         NULL,            "UTF-8")\
+  V(encoding,         1,1, f_id,           p_encoding,      su_encoding,   NULL,         s_encoding,      "UTF-8")\
   V(filelist_maxage,  1,0, f_interval,     p_interval,      su_old,        NULL,         NULL,            "604800")\
   V(flush_file_cache, 1,0, f_ffc,          p_ffc,           su_ffc,        g_ffc,        s_ffc,           i_ffc())\
   V(fl_done,          0,0, NULL,           NULL,            NULL,          NULL,         NULL,            "false")\
@@ -862,6 +879,7 @@ struct var {
   V(show_joinquit,    1,1, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
   V(slots,            1,0, f_int,          p_int_ge1,       NULL,          NULL,         s_hubinfo,       "10")\
   V(tls_policy,       1,1, f_tls_policy,   p_tls_policy,    su_tls_policy, g_tls_policy, s_tls_policy,    G_STRINGIFY(VAR_TLSP_DISABLE))\
+  V(ui_frame_interval,1,0, f_int,          p_frame_interval,NULL,          NULL,         NULL,            "100")\
   V(ui_time_format,   1,0, f_id,           p_id,            su_old,        NULL,         NULL,            "[%H:%M:%S]")\
   V(upload_rate,      1,0, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)
 